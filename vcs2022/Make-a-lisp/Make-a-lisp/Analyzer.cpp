@@ -0,0 +1,653 @@
+#include "Analyzer.h"
+#include "Collector.h"
+#include "Scope.h"
+#include "SpecFormHandler.h"
+#include "VM.h"
+
+static const MALSymbolTypePtr defBangSymbol = MALSymbolType::intern("def!");
+static const MALSymbolTypePtr letStarSymbol = MALSymbolType::intern("let*");
+static const MALSymbolTypePtr doSymbol = MALSymbolType::intern("do");
+static const MALSymbolTypePtr ifSymbol = MALSymbolType::intern("if");
+static const MALSymbolTypePtr fnStarSymbol = MALSymbolType::intern("fn*");
+static const MALSymbolTypePtr quoteSymbol = MALSymbolType::intern("quote");
+static const MALSymbolTypePtr quasiquoteSymbol = MALSymbolType::intern("quasiquote");
+static const MALSymbolTypePtr quasiquoteExpandSymbol = MALSymbolType::intern("quasiquoteexpand");
+static const MALSymbolTypePtr defMacroSymbol = MALSymbolType::intern("defmacro!");
+static const MALSymbolTypePtr macroexpandSymbol = MALSymbolType::intern("macroexpand");
+static const MALSymbolTypePtr tryStarSymbol = MALSymbolType::intern("try*");
+
+namespace {
+    // The arguments of the calls being made, those of a nested call above
+    // those of the call it is an argument of.
+    std::vector<MALValue> arguments;
+
+    // A call in tail position, which the node making it left to the function
+    // call running it (see run).
+    struct TailCall {
+        bool pending = false;
+        Ref<MALFuncType> func;
+        std::vector<MALValue> args;
+    } tailCall;
+
+    // Drops the arguments a call pushed when it returns or throws.
+    struct ArgumentsMark {
+        size_t height;
+        ~ArgumentsMark() { arguments.resize(this->height); }
+    };
+
+    // Hands a frame to Env::recycle when the node that made it returns or
+    // throws.
+    struct FrameRecycler {
+        EnvPtr& frame;
+        ~FrameRecycler() { Env::recycle(frame); }
+    };
+}
+
+// Moves the arguments above from in args to the slots of frame, a call frame
+// of lambda.
+static void bindArguments(Env& frame, const Lambda& lambda, std::vector<MALValue>& args, size_t from)
+{
+    auto argc = args.size() - from;
+    if (argc < lambda.requiredArgs) {
+        args.resize(from);
+        throw std::runtime_error("Error: Number of parameters don't match function's parameters list size.");
+    }
+    for (unsigned int i = 0; i < lambda.requiredArgs; i++) {
+        frame.setSlot(i, std::move(args[from + i]));
+    }
+    if (lambda.variadic) {
+        std::vector<MALValue> rest(std::make_move_iterator(args.begin() + from + lambda.requiredArgs), std::make_move_iterator(args.end()));
+        frame.setSlot(lambda.requiredArgs, Ref<MALListType>(new MALListType(std::move(rest))));
+    }
+    args.resize(from);
+}
+
+// Runs lambda in frame, a call frame of it, and then the calls it leaves in
+// tail position, in turn: a loop of tail calls takes no C++ stack.
+static MALValue run(Ref<Lambda> lambda, EnvPtr frame)
+{
+    FrameRecycler recycler{ frame };
+    for (;;) {
+        auto result = lambda->body->execute(frame);
+        if (!tailCall.pending) {
+            return result;
+        }
+        tailCall.pending = false;
+        auto func = std::move(tailCall.func);
+        lambda = func->lambda;
+        //nothing else holds the frame the tail call is made from: reuse it
+        if (frame.useCount() == 1 && !frame->isGlobal()) {
+            frame->rebindSlots(func->env, lambda->names);
+        }
+        else {
+            frame = Env::letFrame(func->env, lambda->names, 1);
+        }
+        bindArguments(*frame, *lambda, tailCall.args, 0);
+    }
+}
+
+namespace {
+    class ConstNode : public Node {
+        MALValue value;
+    public:
+        ConstNode(MALValue value) : value(std::move(value)) {}
+        MALValue execute(const EnvPtr& frame) const override { return this->value; }
+    };
+
+    class LocalRefNode : public Node {
+        Ref<MALResolvedSymbolType> symbol;
+    public:
+        LocalRefNode(Ref<MALResolvedSymbolType> symbol) : symbol(std::move(symbol)) {}
+        MALValue execute(const EnvPtr& frame) const override {
+            //a def! in a frame on the way may shadow the slot
+            if (Env::hasLocalDefinitions()) {
+                return frame->get(this->symbol);
+            }
+            Env* env = frame.get();
+            for (unsigned int hops = 0; hops < this->symbol->depth; hops++) {
+                env = env->outerFrame();
+            }
+            return env->getSlot(this->symbol->slot);
+        }
+    };
+
+    // The value found is kept until the next def!.
+    class GlobalRefNode : public Node {
+        Ref<MALResolvedSymbolType> symbol;
+        mutable size_t definitionEpoch = SIZE_MAX;
+        mutable MALValue value;
+    public:
+        GlobalRefNode(Ref<MALResolvedSymbolType> symbol) : symbol(std::move(symbol)) {}
+        MALValue execute(const EnvPtr& frame) const override {
+            if (this->definitionEpoch == Env::definitions() && !Env::hasLocalDefinitions()) {
+                return this->value;
+            }
+            auto value = frame->get(this->symbol);
+            this->value = value;
+            this->definitionEpoch = Env::definitions();
+            return value;
+        }
+    };
+
+    class IfNode : public Node {
+        Ref<Node> condition;
+        Ref<Node> consequent;
+        Ref<Node> alternative;
+    public:
+        IfNode(Ref<Node> condition, Ref<Node> consequent, Ref<Node> alternative)
+            : condition(std::move(condition)), consequent(std::move(consequent)), alternative(std::move(alternative)) {}
+        MALValue execute(const EnvPtr& frame) const override {
+            if (this->condition->execute(frame).isTruthy()) {
+                return this->consequent->execute(frame);
+            }
+            return this->alternative->execute(frame);
+        }
+    };
+
+    // The forms of a do with more than one.
+    class DoNode : public Node {
+        std::vector<Ref<Node>> body;
+    public:
+        DoNode(std::vector<Ref<Node>> body) : body(std::move(body)) {}
+        MALValue execute(const EnvPtr& frame) const override {
+            auto last = this->body.end() - 1;
+            for (auto p = this->body.begin(); p != last; p++) {
+                (*p)->execute(frame);
+            }
+            return (*last)->execute(frame);
+        }
+    };
+
+    // The value of the i-th binding goes to slot bindingSlots[i] of a frame
+    // with a slot for each of names (see LetBindings).
+    class LetNode : public Node {
+        LetBindings let;
+        std::vector<Ref<Node>> values;
+        Ref<Node> body;
+    public:
+        LetNode(LetBindings let, std::vector<Ref<Node>> values, Ref<Node> body)
+            : let(std::move(let)), values(std::move(values)), body(std::move(body)) {}
+        MALValue execute(const EnvPtr& frame) const override {
+            auto letFrame = Env::letFrame(frame, this->let.names, 1);
+            FrameRecycler recycler{ letFrame };
+            for (size_t i = 0; i < this->values.size(); i++) {
+                letFrame->setSlot(this->let.bindingSlots[i], this->values[i]->execute(letFrame));
+            }
+            return this->body->execute(letFrame);
+        }
+    };
+
+    class FnNode : public Node {
+        Ref<Lambda> lambda;
+    public:
+        FnNode(Ref<Lambda> lambda) : lambda(std::move(lambda)) {}
+        MALValue execute(const EnvPtr& frame) const override {
+            Ref<MALFuncType> func(new MALFuncType(this->lambda->name, frame, this->lambda->params, this->lambda->source));
+            func->lambda = this->lambda;
+            return func;
+        }
+    };
+
+    // def!, or defmacro! when macro is set.
+    class DefNode : public Node {
+        MALSymbolTypePtr symbol;
+        Ref<Node> value;
+        bool macro;
+    public:
+        DefNode(MALSymbolTypePtr symbol, Ref<Node> value, bool macro) : symbol(std::move(symbol)), value(std::move(value)), macro(macro) {}
+        MALValue execute(const EnvPtr& frame) const override {
+            auto value = this->value->execute(frame);
+            Ref<MALCallableType> callable;
+            if (this->macro && !value.tryAsCallable(callable)) {
+                throw std::runtime_error("ERROR: 'defmacro!' second param must evaluate to a function.");
+            }
+            frame->set(this->symbol, value);
+            if (this->macro) {
+                callable->is_macro = true;
+            }
+            return value;
+        }
+    };
+
+    // The catch* body runs in a frame of its own binding the error.
+    class TryNode : public Node {
+        Ref<Node> body;
+        MALValue bodyForm;
+        Ref<MALListType> names;
+        Ref<Node> handler;
+    public:
+        TryNode(Ref<Node> body, MALValue bodyForm, Ref<MALListType> names, Ref<Node> handler)
+            : body(std::move(body)), bodyForm(std::move(bodyForm)), names(std::move(names)), handler(std::move(handler)) {}
+        MALValue execute(const EnvPtr& frame) const override {
+            MALValue error;
+            try {
+                return this->body->execute(frame);
+            }
+            catch (MALException& e) {
+                error = e.errorValue;
+            }
+            catch (std::string& e) {
+                error = Ref<MALStringType>(new MALStringType(e + ", in:\n\t" + this->bodyForm.to_string(false)));
+            }
+            catch (std::exception& e) {
+                error = Ref<MALStringType>(new MALStringType(std::string(e.what()) + ", in:\n\t" + this->bodyForm.to_string(false)));
+            }
+            catch (...) {
+                error = Ref<MALStringType>(new MALStringType("Unknown error. Something went wrong running:\n\t" + this->bodyForm.to_string(false)));
+            }
+            auto catchFrame = Env::letFrame(frame, this->names, 1);
+            FrameRecycler recycler{ catchFrame };
+            catchFrame->setSlot(0, std::move(error));
+            return this->handler->execute(catchFrame);
+        }
+    };
+
+    class VectorNode : public Node {
+        std::vector<Ref<Node>> elements;
+    public:
+        VectorNode(std::vector<Ref<Node>> elements) : elements(std::move(elements)) {}
+        MALValue execute(const EnvPtr& frame) const override {
+            Ref<MALVectorType> vector(new MALVectorType());
+            for (auto& element : this->elements) {
+                vector->push_back(element->execute(frame));
+            }
+            return vector;
+        }
+    };
+
+    class HashMapNode : public Node {
+        std::vector<std::pair<MALValue, Ref<Node>>> entries;
+    public:
+        HashMapNode(std::vector<std::pair<MALValue, Ref<Node>>> entries) : entries(std::move(entries)) {}
+        MALValue execute(const EnvPtr& frame) const override {
+            Ref<MALHashMapType> map(new MALHashMapType());
+            for (auto& entry : this->entries) {
+                map->set(entry.first, entry.second->execute(frame));
+            }
+            return map;
+        }
+    };
+
+    // A form the analyzer leaves to EVAL: a malformed special form, which
+    // EVAL reports when it is run, and macroexpand, which sees the macros of
+    // the frames it runs in.
+    class InterpretNode : public Node {
+        MALValue form;
+    public:
+        InterpretNode(MALValue form) : form(std::move(form)) {}
+        MALValue execute(const EnvPtr& frame) const override { return EVAL(this->form, frame); }
+    };
+
+    // A call of a global macro, expanded when it runs; the node analyzed from
+    // the expansion is kept along with it.
+    class MacroCallNode : public Node {
+        mutable MacroCallSite site;
+        mutable Ref<Node> expansion;
+        bool tail;
+    public:
+        MacroCallNode(MacroCallSite site, bool tail) : site(std::move(site)), tail(tail) {}
+        MALValue execute(const EnvPtr& frame) const override;
+    };
+
+    class CallNode : public Node {
+    protected:
+        MALListTypePtr form;
+        Ref<Node> callee;
+        std::vector<Ref<Node>> args;
+        // The callee is named by a symbol, which may be bound to a macro
+        // defined after the call was analyzed.
+        bool namedCallee;
+        bool tail;
+
+        bool isMacro(const MALValue& callee) const;
+        // EVAL expands the macro call and evaluates the expansion.
+        MALValue expand(const EnvPtr& frame) const { return EVAL(macroexpand(this->form, frame), frame); }
+        // Calls callee with the arguments above argsAt.
+        MALValue call(const MALValue& callee, size_t argsAt, const EnvPtr& frame) const;
+    public:
+        CallNode(MALListTypePtr form, Ref<Node> callee, std::vector<Ref<Node>> args, bool namedCallee, bool tail)
+            : form(std::move(form)), callee(std::move(callee)), args(std::move(args)), namedCallee(namedCallee), tail(tail) {}
+        MALValue execute(const EnvPtr& frame) const override;
+    };
+
+    // A two-argument call of a core arithmetic function or comparison, done in
+    // place while the callee is still that function and the arguments are
+    // numbers.
+    class PrimitiveNode : public CallNode {
+        size_t primitive;
+    public:
+        PrimitiveNode(MALListTypePtr form, Ref<Node> callee, std::vector<Ref<Node>> args, bool tail, size_t primitive)
+            : CallNode(std::move(form), std::move(callee), std::move(args), true, tail), primitive(primitive) {}
+        MALValue execute(const EnvPtr& frame) const override;
+    };
+}
+
+bool CallNode::isMacro(const MALValue& callee) const
+{
+    Ref<MALCallableType> callable;
+    return this->namedCallee && callee.tryAsCallable(callable) && callable->is_macro;
+}
+
+MALValue CallNode::call(const MALValue& callee, size_t argsAt, const EnvPtr& frame) const
+{
+    Collector::collectIfNeeded();
+    if (callee.type() != MALType::Types::Function) {
+        throw std::runtime_error("Error: function not found with name '" + this->form->getAt(0).to_string(true) + "' in '" + this->form->to_string(true) + "'");
+    }
+    auto callable = static_cast<MALCallableType*>(callee.ptr().get());
+    auto func = callable->isBuiltin() ? nullptr : static_cast<MALFuncType*>(callable);
+    if (func == nullptr) {
+        auto result = static_cast<MALBuiltinFuncType*>(callable)->call(arguments.data() + argsAt, arguments.size() - argsAt, frame);
+        arguments.resize(argsAt);
+        return result;
+    }
+    if (func->lambda == nullptr) {
+        std::vector<MALValue> args(std::make_move_iterator(arguments.begin() + argsAt), std::make_move_iterator(arguments.end()));
+        arguments.resize(argsAt);
+        if (func->code != nullptr) {
+            return VM::apply(func, std::move(args));
+        }
+        return EVAL(func->funcBody, Env::callFrame(func->env, func->bindingsList, args.data(), args.size()));
+    }
+    if (this->tail) {
+        tailCall.func = Ref<MALFuncType>(func);
+        tailCall.args.assign(std::make_move_iterator(arguments.begin() + argsAt), std::make_move_iterator(arguments.end()));
+        arguments.resize(argsAt);
+        tailCall.pending = true;
+        return nullptr;
+    }
+    auto calleeFrame = Env::letFrame(func->env, func->lambda->names, 1);
+    bindArguments(*calleeFrame, *func->lambda, arguments, argsAt);
+    return run(func->lambda, std::move(calleeFrame));
+}
+
+MALValue CallNode::execute(const EnvPtr& frame) const
+{
+    auto callee = this->callee->execute(frame);
+    if (this->isMacro(callee)) {
+        return this->expand(frame);
+    }
+    ArgumentsMark mark{ arguments.size() };
+    for (auto& arg : this->args) {
+        arguments.push_back(arg->execute(frame));
+    }
+    return this->call(callee, mark.height, frame);
+}
+
+MALValue PrimitiveNode::execute(const EnvPtr& frame) const
+{
+    auto callee = this->callee->execute(frame);
+    if (this->isMacro(callee)) {
+        return this->expand(frame);
+    }
+    auto x = this->args[0]->execute(frame);
+    auto y = this->args[1]->execute(frame);
+    MALValue result;
+    if (applyPrimitive(this->primitive, callee, x, y, result)) {
+        return result;
+    }
+    ArgumentsMark mark{ arguments.size() };
+    arguments.push_back(std::move(x));
+    arguments.push_back(std::move(y));
+    return this->call(callee, mark.height, frame);
+}
+
+namespace {
+    class Analysis
+    {
+        const EnvPtr& globalEnv;
+        const Scope* scope;
+
+        Ref<Node> analyzeSymbol(MALSymbolType* name);
+        Ref<Node> analyzeList(const MALListTypePtr& list, bool tail);
+        Ref<Node> analyzeCall(const MALListTypePtr& list, bool tail);
+        Ref<Node> analyzeMacroCall(const MALListTypePtr& list, bool tail);
+        Ref<Node> analyzeDefinition(const MALListTypePtr& form, bool macro);
+        Ref<Node> analyzeDo(const MALListTypePtr& form, bool tail);
+        Ref<Node> analyzeIf(const MALListTypePtr& form, bool tail);
+        Ref<Node> analyzeLet(const MALListTypePtr& form, bool tail);
+        Ref<Node> analyzeClosure(const MALListTypePtr& form);
+        Ref<Node> analyzeTry(const MALListTypePtr& form, bool tail);
+    public:
+        Analysis(const EnvPtr& globalEnv, const Scope* scope) : globalEnv(globalEnv), scope(scope) {}
+        // A node in tail position of a function leaves its calls of analyzed
+        // functions to the call running the function.
+        Ref<Node> analyze(const MALValue& ast, bool tail);
+        // Analyzes the expansion of the macro call.
+        Ref<Node> analyzeExpansion(const MacroCallSite& site, bool tail);
+    };
+}
+
+Ref<Node> Analysis::analyze(const MALValue& ast, bool tail)
+{
+    switch (ast.type()) {
+    case MALType::Types::Symbol:
+        return this->analyzeSymbol(ast.asSymbol()->canonical);
+    case MALType::Types::List:
+        return this->analyzeList(ast.asList(), tail);
+    case MALType::Types::Vector: {
+        std::vector<Ref<Node>> elements;
+        for (auto& element : malCast<MALVectorType>(ast)->toVector()) {
+            elements.push_back(this->analyze(element, false));
+        }
+        return Ref<Node>(new VectorNode(std::move(elements)));
+    }
+    case MALType::Types::HashMap: {
+        std::vector<std::pair<MALValue, Ref<Node>>> entries;
+        for (auto& entry : malCast<MALHashMapType>(ast)->entries()) {
+            entries.emplace_back(entry.first, this->analyze(entry.second, false));
+        }
+        return Ref<Node>(new HashMapNode(std::move(entries)));
+    }
+    default:
+        return Ref<Node>(new ConstNode(ast));
+    }
+}
+
+Ref<Node> Analysis::analyzeSymbol(MALSymbolType* name)
+{
+    unsigned int depth, slot;
+    if (findLocal(this->scope, name, depth, slot)) {
+        return Ref<Node>(new LocalRefNode(localReference(this->scope, name, depth, slot)));
+    }
+    return Ref<Node>(new GlobalRefNode(globalReference(this->scope, name)));
+}
+
+Ref<Node> Analysis::analyzeList(const MALListTypePtr& list, bool tail)
+{
+    if (list->size() == 0) {
+        return Ref<Node>(new ConstNode(list));
+    }
+    MALSymbolTypePtr head;
+    if (!list->getAt(0).tryAsSymbol(head)) {
+        return this->analyzeCall(list, tail);
+    }
+    auto name = head->canonical;
+    if (findMacro(this->scope, name, this->globalEnv) != nullptr) {
+        return this->analyzeMacroCall(list, tail);
+    }
+    if (name == defBangSymbol.get()) {
+        return this->analyzeDefinition(list, false);
+    }
+    else if (name == letStarSymbol.get()) {
+        return this->analyzeLet(list, tail);
+    }
+    else if (name == doSymbol.get()) {
+        return this->analyzeDo(list, tail);
+    }
+    else if (name == ifSymbol.get()) {
+        return this->analyzeIf(list, tail);
+    }
+    else if (name == fnStarSymbol.get()) {
+        return this->analyzeClosure(list);
+    }
+    else if (name == quoteSymbol.get() && list->size() == 2) {
+        return Ref<Node>(new ConstNode(list->getAt(1)));
+    }
+    else if (name == quasiquoteSymbol.get() && list->size() == 2) {
+        return this->analyze(quasiquote(list->getAt(1)), tail);
+    }
+    else if (name == quasiquoteExpandSymbol.get() && list->size() == 2) {
+        return Ref<Node>(new ConstNode(quasiquote(list->getAt(1))));
+    }
+    else if (name == defMacroSymbol.get()) {
+        return this->analyzeDefinition(list, true);
+    }
+    else if (name == tryStarSymbol.get()) {
+        return this->analyzeTry(list, tail);
+    }
+    else if (name == quoteSymbol.get() || name == quasiquoteSymbol.get() || name == quasiquoteExpandSymbol.get() || name == macroexpandSymbol.get()) {
+        return Ref<Node>(new InterpretNode(list));
+    }
+    return this->analyzeCall(list, tail);
+}
+
+Ref<Node> Analysis::analyzeCall(const MALListTypePtr& list, bool tail)
+{
+    auto head = list->getAt(0);
+    auto callee = this->analyze(head, false);
+    std::vector<Ref<Node>> args;
+    for (auto p = ++list->begin(); p != list->end(); p++) {
+        args.push_back(this->analyze(*p, false));
+    }
+    MALSymbolTypePtr headSymbol;
+    bool namedCallee = head.tryAsSymbol(headSymbol);
+    unsigned int depth, slot;
+    if (namedCallee && args.size() == 2 && !findLocal(this->scope, headSymbol->canonical, depth, slot)) {
+        auto primitive = findPrimitive(headSymbol.get());
+        if (primitive < primitiveCount) {
+            return Ref<Node>(new PrimitiveNode(list, std::move(callee), std::move(args), tail, primitive));
+        }
+    }
+    return Ref<Node>(new CallNode(list, std::move(callee), std::move(args), namedCallee, tail));
+}
+
+// The call is expanded when it runs, so it gets the macro bound to its head
+// then, and the expansion, with its errors and side effects, happens then.
+Ref<Node> Analysis::analyzeMacroCall(const MALListTypePtr& list, bool tail)
+{
+    return Ref<Node>(new MacroCallNode(MacroCallSite(list, frameNamesOf(this->scope)), tail));
+}
+
+Ref<Node> Analysis::analyzeDefinition(const MALListTypePtr& form, bool macro)
+{
+    MALSymbolTypePtr symbol;
+    if (form->size() < 3 || (macro && form->size() != 3) || !form->getAt(1).tryAsSymbol(symbol)) {
+        return Ref<Node>(new InterpretNode(form));
+    }
+    return Ref<Node>(new DefNode(MALSymbolTypePtr(symbol->canonical), this->analyze(form->getAt(2), false), macro));
+}
+
+Ref<Node> Analysis::analyzeDo(const MALListTypePtr& form, bool tail)
+{
+    if (form->size() <= 1) {
+        return Ref<Node>(new ConstNode(MALValue::nil()));
+    }
+    if (form->size() == 2) {
+        return this->analyze(form->getAt(1), tail);
+    }
+    std::vector<Ref<Node>> body;
+    auto p = ++form->begin();
+    for (size_t i = 1; i < form->size() - 1; i++, p++) {
+        body.push_back(this->analyze(*p, false));
+    }
+    body.push_back(this->analyze(*p, tail));
+    return Ref<Node>(new DoNode(std::move(body)));
+}
+
+Ref<Node> Analysis::analyzeIf(const MALListTypePtr& form, bool tail)
+{
+    if (form->size() < 3) {
+        return Ref<Node>(new InterpretNode(form));
+    }
+    auto condition = this->analyze(form->getAt(1), false);
+    auto consequent = this->analyze(form->getAt(2), tail);
+    auto alternative = form->size() > 3 ? this->analyze(form->getAt(3), tail) : Ref<Node>(new ConstNode(MALValue::nil()));
+    return Ref<Node>(new IfNode(std::move(condition), std::move(consequent), std::move(alternative)));
+}
+
+Ref<Node> Analysis::analyzeLet(const MALListTypePtr& form, bool tail)
+{
+    LetBindings let;
+    if (!let.read(form)) {
+        return Ref<Node>(new InterpretNode(form));
+    }
+    Scope letScope(this->scope, let.names);
+    Analysis inner(this->globalEnv, &letScope);
+    std::vector<Ref<Node>> values;
+    for (size_t i = 0; i < let.bindings->size(); i += 2) {
+        values.push_back(inner.analyze(let.bindings->getAt(i + 1), false));
+    }
+    auto body = inner.analyze(form->getAt(2), tail);
+    return Ref<Node>(new LetNode(std::move(let), std::move(values), std::move(body)));
+}
+
+Ref<Node> Analysis::analyzeClosure(const MALListTypePtr& form)
+{
+    Parameters parameters;
+    if (!parameters.read(form)) {
+        return Ref<Node>(new InterpretNode(form));
+    }
+    Ref<Lambda> lambda(new Lambda());
+    lambda->names = parameters.names;
+    lambda->requiredArgs = parameters.requiredArgs;
+    lambda->variadic = parameters.variadic;
+    lambda->params = parameters.params;
+    lambda->source = form->getAt(2);
+    Scope callScope(this->scope, lambda->names);
+    lambda->name = form->to_string(true);
+    lambda->body = Analysis(this->globalEnv, &callScope).analyze(lambda->source, true);
+    return Ref<Node>(new FnNode(std::move(lambda)));
+}
+
+Ref<Node> Analysis::analyzeTry(const MALListTypePtr& form, bool tail)
+{
+    CatchClause clause;
+    if (!clause.read(form)) {
+        return Ref<Node>(new InterpretNode(form));
+    }
+    //the body's errors are caught here, so its calls are made here too
+    auto body = this->analyze(form->getAt(1), false);
+    Ref<MALListType> names(new MALListType({ MALSymbolTypePtr(clause.name) }));
+    Scope catchScope(this->scope, names);
+    auto handler = Analysis(this->globalEnv, &catchScope).analyze(clause.form->getAt(2), tail);
+    return Ref<Node>(new TryNode(std::move(body), form->getAt(1), std::move(names), std::move(handler)));
+}
+
+Ref<Node> Analysis::analyzeExpansion(const MacroCallSite& site, bool tail)
+{
+    if (site.isCall()) {
+        return this->analyzeCall(site.form, tail);
+    }
+    return this->analyze(site.expansion(), tail);
+}
+
+MALValue MacroCallNode::execute(const EnvPtr& frame) const
+{
+    if (this->site.expand(frame)) {
+        ScopeChain scopes(this->site.frames);
+        auto globalEnv = globalFrame(frame);
+        this->expansion = Analysis(globalEnv, scopes.innermost()).analyzeExpansion(this->site, this->tail);
+    }
+    //a call made by the expansion may expand the form again
+    Ref<Node> expansion = this->expansion;
+    return expansion->execute(frame);
+}
+
+static MALValue evalAnalyzed(const MALValue& ast, const EnvPtr& globalEnv)
+{
+    auto node = Analysis(globalEnv, nullptr).analyze(ast, false);
+    return node->execute(globalEnv);
+}
+
+MALValue Analyzer::eval(MALValue ast, EnvPtr globalEnv)
+{
+    return evalTopLevel(std::move(ast), globalEnv, evalAnalyzed);
+}
+
+MALValue Analyzer::apply(MALFuncType* func, std::vector<MALValue> args)
+{
+    auto frame = Env::letFrame(func->env, func->lambda->names, 1);
+    bindArguments(*frame, *func->lambda, args, 0);
+    return run(func->lambda, std::move(frame));
+}
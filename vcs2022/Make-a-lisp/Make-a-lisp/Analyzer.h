@@ -0,0 +1,49 @@
+#pragma once
+#include <string>
+#include <vector>
+
+#include "Type.h"
+#include "Env.h"
+
+// Closure-compiling engine, picked with --analyze on the command line. Each
+// top-level form is analyzed once, after macroexpansion, into a tree of nodes:
+// one node per form, of a class made for that kind of form (an if, a let*, a
+// local or global reference, a call...), so running it makes none of the type
+// switches and special form lookups EVAL makes on every pass. Locals live in
+// the same Env frames as in the other engines and are reached by the frame
+// depth and slot found by the analysis; a global is cached until the next
+// def!. Every fn* is analyzed along with the form it is in, and the functions
+// it makes share the result, so calling one runs its tree straight away. A
+// macro call in the form is analyzed when it first runs, from its expansion
+// then, and again when it expands to something else.
+
+class Node : public RefCounted {
+public:
+	virtual ~Node() = default;
+	// Evaluates the form in frame. A call in tail position of a function
+	// made by the analyzer is not made here but left to the call that runs
+	// the function, which makes it in the same C++ frame.
+	virtual MALValue execute(const EnvPtr& frame) const = 0;
+};
+
+// An analyzed fn*, held by each function made from it.
+class Lambda : public RefCounted {
+public:
+	Ref<Node> body;
+	// The names of the slots of a call frame: the parameters without the '&'.
+	Ref<MALListType> names;
+	unsigned int requiredArgs = 0;
+	bool variadic = false;
+	// The fn* as written, for the functions made from it.
+	Ref<MALSequenceType> params;
+	MALValue source;
+	std::string name;
+};
+
+class Analyzer {
+public:
+	// Evaluates a top-level form in the global environment.
+	static MALValue eval(MALValue ast, EnvPtr globalEnv);
+	// Calls a function made by the analyzer.
+	static MALValue apply(MALFuncType* func, std::vector<MALValue> args);
+};
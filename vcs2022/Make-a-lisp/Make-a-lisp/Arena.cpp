@@ -0,0 +1,117 @@
+#include "Arena.h"
+#include "Ref.h"
+#include "Pool.h"
+#include <new>
+
+static const size_t blockSize = 64 * 1024;
+// Larger objects go to the heap instead of wasting the rest of a block.
+static const size_t largestArenaObject = blockSize / 16;
+// Every allocation is preceded by the block it lives in, or nullptr when it
+// comes from the Pool.
+static const size_t headerSize = sizeof(void*);
+
+struct ReadArena::Block
+{
+    // Objects alive in the block, plus one while it is the open block.
+    // Shares RefCount's thread safety.
+    RefCount live = 1;
+    char* next = nullptr;
+    char* end = nullptr;
+};
+
+static thread_local ReadArena* activeArena = nullptr;
+thread_local ReadArena::Block* ReadArena::openBlock = nullptr;
+static thread_local size_t blockBytes = 0;
+
+static size_t roundUp(size_t size)
+{
+    return (size + alignof(void*) - 1) & ~(alignof(void*) - 1);
+}
+
+ReadArena::ReadArena() : previous(activeArena)
+{
+    activeArena = this;
+}
+
+ReadArena::~ReadArena()
+{
+    activeArena = this->previous;
+}
+
+void ReadArena::retire()
+{
+    if (openBlock == nullptr) {
+        return;
+    }
+    if (--openBlock->live == 0) {
+        openBlock->~Block();
+        ::operator delete(openBlock);
+        blockBytes -= blockSize;
+    }
+    openBlock = nullptr;
+}
+
+void* ReadArena::allocate(size_t size)
+{
+#ifdef MAL_SYSTEM_ALLOCATOR
+    return Pool::allocate(size);
+#else
+    size = roundUp(size) + headerSize;
+    if (activeArena == nullptr || size > largestArenaObject) {
+        auto memory = static_cast<char*>(Pool::allocate(size));
+        *reinterpret_cast<Block**>(memory) = nullptr;
+        return memory + headerSize;
+    }
+    if (openBlock == nullptr || openBlock->next + size > openBlock->end) {
+        retire();
+        auto memory = static_cast<char*>(::operator new(blockSize));
+        blockBytes += blockSize;
+        openBlock = new (memory) Block();
+        openBlock->next = memory + roundUp(sizeof(Block));
+        openBlock->end = memory + blockSize;
+    }
+    auto block = openBlock;
+    auto memory = block->next;
+    block->next += size;
+    block->live++;
+    *reinterpret_cast<Block**>(memory) = block;
+    return memory + headerSize;
+#endif
+}
+
+void ReadArena::deallocate(void* object, size_t size)
+{
+    if (object == nullptr) {
+        return;
+    }
+#ifdef MAL_SYSTEM_ALLOCATOR
+    Pool::deallocate(object, size);
+#else
+    auto memory = static_cast<char*>(object) - headerSize;
+    Block* block = *reinterpret_cast<Block**>(memory);
+    if (block == nullptr) {
+        Pool::deallocate(memory, roundUp(size) + headerSize);
+        return;
+    }
+    if (--block->live == 0) {
+        block->~Block();
+        ::operator delete(block);
+        blockBytes -= blockSize;
+    }
+#endif
+}
+
+size_t ReadArena::retainedBytes()
+{
+    return blockBytes;
+}
+
+ReadArenaPause::ReadArenaPause() : paused(activeArena)
+{
+    activeArena = nullptr;
+}
+
+ReadArenaPause::~ReadArenaPause()
+{
+    activeArena = this->paused;
+}
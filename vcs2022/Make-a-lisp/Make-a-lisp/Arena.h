@@ -0,0 +1,48 @@
+#pragma once
+#include <cstddef>
+
+// Bump allocator for the objects the reader creates. While a ReadArena is
+// active, every RefCounted object allocated on this thread is placed right
+// after the previous one in a large block, so the AST of a form ends up
+// contiguous and in the order it was read.
+// Objects are still reference counted one by one: each block counts the
+// objects alive in it and is freed together with the last one, so fragments
+// of the AST that escape through quote or macros stay valid.
+// The block being filled is kept from one read to the next and only replaced
+// when full, so the forms of many short reads share blocks: what survives a
+// read (the body of a fn*, a name) keeps at most the block it is in alive,
+// not a block of its own.
+class ReadArena
+{
+	struct Block;
+	// The block allocations go to, shared by every read on the thread.
+	static thread_local Block* openBlock;
+	ReadArena* previous;
+	// Stops allocating from the open block, freeing it if it is empty.
+	static void retire();
+public:
+	ReadArena();
+	~ReadArena();
+	ReadArena(const ReadArena&) = delete;
+	ReadArena& operator=(const ReadArena&) = delete;
+
+	// Used by RefCounted: allocates from the active arena, if any, and from
+	// the Pool otherwise.
+	static void* allocate(size_t size);
+	// size must be the one given to allocate.
+	static void deallocate(void* object, size_t size);
+	// Bytes held in blocks on the calling thread, open or not.
+	static size_t retainedBytes();
+};
+
+// Suspends the active arena, for objects created during a read that are
+// meant to outlive it (interned symbols and keywords).
+class ReadArenaPause
+{
+	ReadArena* paused;
+public:
+	ReadArenaPause();
+	~ReadArenaPause();
+	ReadArenaPause(const ReadArenaPause&) = delete;
+	ReadArenaPause& operator=(const ReadArenaPause&) = delete;
+};
@@ -0,0 +1,373 @@
+#include "Collector.h"
+#include "Env.h"
+#include <algorithm>
+#include <chrono>
+#include <unordered_map>
+#include <vector>
+
+static const unsigned char youngGeneration = 0;
+static const unsigned char oldGeneration = 1;
+// Young objects alive before a young collection runs.
+static const size_t youngThreshold = 10000;
+// Smallest old generation worth a full collection.
+static const size_t oldThreshold = 10000;
+
+// Plain pointers and counts, so they are set before any global Env is built.
+static Collectable* generations[oldGeneration + 1] = {};
+static size_t generationSizes[oldGeneration + 1] = {};
+static size_t oldSizeAfterFull = 0;
+static Collector::Stats collectorStats = {};
+
+Collectable::Collectable(Kind kind) : kind(kind)
+{
+    this->next = generations[youngGeneration];
+    if (this->next != nullptr) {
+        this->next->previous = this;
+    }
+    generations[youngGeneration] = this;
+    generationSizes[youngGeneration]++;
+}
+
+Collectable::~Collectable()
+{
+    if (this->previous != nullptr) {
+        this->previous->next = this->next;
+    }
+    else {
+        generations[this->generation] = this->next;
+    }
+    if (this->next != nullptr) {
+        this->next->previous = this->previous;
+    }
+    generationSizes[this->generation]--;
+}
+
+namespace {
+    // What a heap object reached by a collection is, so its references can be
+    // listed.
+    enum class NodeKind : unsigned char {
+        Env,
+        Atom,
+        Function,
+        List,
+        ListChunk,
+        Vector,
+        VectorNode,
+        HashMap,
+        HashMapNode,
+    };
+}
+
+struct Collector::Walk
+{
+    struct Node {
+        NodeKind kind;
+        bool alive;
+        // The object's reference count, less the references from the walked objects.
+        long long references;
+    };
+    // Generations up to this one are walked; older objects count as outside.
+    unsigned char oldest;
+    std::unordered_map<RefCounted*, Node> nodes;
+    std::vector<std::pair<RefCounted*, NodeKind>> pending;
+
+    Walk(unsigned char oldest) : oldest(oldest) {}
+
+    static RefCounted* object(Collectable* collectable)
+    {
+        if (collectable->kind == Collectable::Kind::Env) {
+            return static_cast<Env*>(collectable);
+        }
+        return static_cast<MALAtomType*>(collectable);
+    }
+
+    bool isOlder(RefCounted* object, NodeKind kind) const
+    {
+        switch (kind) {
+        case NodeKind::Env:
+            return static_cast<Env*>(object)->generation > this->oldest;
+        case NodeKind::Atom:
+            return static_cast<MALAtomType*>(object)->generation > this->oldest;
+        default:
+            return false;
+        }
+    }
+
+    // Only these types hold references that can lead back to an Env or an atom.
+    template<class F>
+    static void forEachValue(MALType* value, MALType::Types type, F& visit)
+    {
+        switch (type) {
+        case MALType::Types::List:
+            visit(value, NodeKind::List);
+            break;
+        case MALType::Types::Vector:
+            visit(value, NodeKind::Vector);
+            break;
+        case MALType::Types::HashMap:
+            visit(value, NodeKind::HashMap);
+            break;
+        case MALType::Types::Atom:
+            visit(value, NodeKind::Atom);
+            break;
+        case MALType::Types::Function:
+            if (!static_cast<MALCallableType*>(value)->isBuiltin()) {
+                visit(value, NodeKind::Function);
+            }
+            break;
+        default:
+            break;
+        }
+    }
+
+    template<class F>
+    static void forEachValue(const MALValue& value, F& visit)
+    {
+        if (value.isHeap()) {
+            forEachValue(value.ptr().get(), value.type(), visit);
+        }
+    }
+
+    // Calls visit once for every reference the object holds.
+    template<class F>
+    static void forEachReference(RefCounted* object, NodeKind kind, F& visit)
+    {
+        switch (kind) {
+        case NodeKind::Env: {
+            auto env = static_cast<Env*>(object);
+            if (env->outer != nullptr) {
+                visit(env->outer.get(), NodeKind::Env);
+            }
+            if (env->names != nullptr) {
+                forEachValue(env->names.get(), env->names->type(), visit);
+            }
+            for (auto& value : env->slots) {
+                forEachValue(value, visit);
+            }
+            env->data.forEach([&](EnvTable::Entry& entry) {
+                forEachValue(entry.value, visit);
+            });
+            break;
+        }
+        case NodeKind::Atom:
+            forEachValue(static_cast<MALAtomType*>(object)->ref, visit);
+            break;
+        case NodeKind::Function: {
+            auto func = static_cast<MALFuncType*>(object);
+            if (func->env != nullptr) {
+                visit(func->env.get(), NodeKind::Env);
+            }
+            if (func->bindingsList != nullptr) {
+                forEachValue(func->bindingsList.get(), func->bindingsList->type(), visit);
+            }
+            forEachValue(func->funcBody, visit);
+            break;
+        }
+        case NodeKind::List: {
+            auto list = static_cast<MALListType*>(object);
+            if (list->chunk != nullptr) {
+                visit(list->chunk.get(), NodeKind::ListChunk);
+            }
+            if (list->next != nullptr) {
+                visit(list->next.get(), NodeKind::List);
+            }
+            break;
+        }
+        case NodeKind::ListChunk:
+            for (auto& value : static_cast<MALListChunk*>(object)->values) {
+                forEachValue(value, visit);
+            }
+            break;
+        case NodeKind::Vector: {
+            auto vector = static_cast<MALVectorType*>(object);
+            if (vector->root != nullptr) {
+                visit(vector->root.get(), NodeKind::VectorNode);
+            }
+            if (vector->tail != nullptr) {
+                visit(vector->tail.get(), NodeKind::VectorNode);
+            }
+            break;
+        }
+        case NodeKind::VectorNode: {
+            auto node = static_cast<MALVectorNode*>(object);
+            for (auto& value : node->values) {
+                forEachValue(value, visit);
+            }
+            for (auto& child : node->children) {
+                if (child != nullptr) {
+                    visit(child.get(), NodeKind::VectorNode);
+                }
+            }
+            break;
+        }
+        case NodeKind::HashMap: {
+            auto map = static_cast<MALHashMapType*>(object);
+            if (map->root != nullptr) {
+                visit(map->root.get(), NodeKind::HashMapNode);
+            }
+            break;
+        }
+        case NodeKind::HashMapNode:
+            for (auto& entry : static_cast<MALHashMapNode*>(object)->entries) {
+                forEachValue(entry.key, visit);
+                forEachValue(entry.value, visit);
+                if (entry.node != nullptr) {
+                    visit(entry.node.get(), NodeKind::HashMapNode);
+                }
+            }
+            break;
+        }
+    }
+
+    Node& add(RefCounted* object, NodeKind kind)
+    {
+        auto added = this->nodes.try_emplace(object, Node{ kind, false, (long long)object->refCount });
+        if (added.second) {
+            this->pending.emplace_back(object, kind);
+        }
+        return added.first->second;
+    }
+
+    // Walks everything reachable from the collected generations, leaving in
+    // each node the references that come from outside the walk.
+    void subtractInternalReferences()
+    {
+        size_t walked = 0;
+        for (unsigned char generation = 0; generation <= this->oldest; generation++) {
+            walked += generationSizes[generation];
+        }
+        //most Envs bring at least a function or a list along
+        this->nodes.reserve(2 * walked);
+        for (unsigned char generation = 0; generation <= this->oldest; generation++) {
+            for (auto collectable = generations[generation]; collectable != nullptr; collectable = collectable->next) {
+                this->add(object(collectable), collectable->kind == Collectable::Kind::Env ? NodeKind::Env : NodeKind::Atom);
+            }
+        }
+        auto subtract = [this](RefCounted* child, NodeKind kind) {
+            if (!this->isOlder(child, kind)) {
+                this->add(child, kind).references--;
+            }
+        };
+        while (!this->pending.empty()) {
+            auto current = this->pending.back();
+            this->pending.pop_back();
+            forEachReference(current.first, current.second, subtract);
+        }
+    }
+
+    // Marks the nodes referenced from outside, and everything they reach.
+    void markAlive()
+    {
+        for (auto& entry : this->nodes) {
+            if (entry.second.references > 0) {
+                entry.second.alive = true;
+                this->pending.emplace_back(entry.first, entry.second.kind);
+            }
+        }
+        auto mark = [this](RefCounted* child, NodeKind kind) {
+            auto found = this->nodes.find(child);
+            if (found != this->nodes.end() && !found->second.alive) {
+                found->second.alive = true;
+                this->pending.emplace_back(child, kind);
+            }
+        };
+        while (!this->pending.empty()) {
+            auto current = this->pending.back();
+            this->pending.pop_back();
+            forEachReference(current.first, current.second, mark);
+        }
+    }
+
+    // Clears the Envs and atoms left unmarked; reference counting frees the
+    // rest of their cycles. Returns the number of objects freed.
+    size_t freeGarbage()
+    {
+        std::vector<Ref<Env>> envs;
+        std::vector<Ref<MALAtomType>> atoms;
+        size_t freed = 0;
+        for (auto& entry : this->nodes) {
+            if (entry.second.alive) {
+                continue;
+            }
+            freed++;
+            if (entry.second.kind == NodeKind::Env) {
+                envs.emplace_back(static_cast<Env*>(entry.first));
+            }
+            else if (entry.second.kind == NodeKind::Atom) {
+                atoms.emplace_back(static_cast<MALAtomType*>(entry.first));
+            }
+        }
+        this->nodes.clear();
+        //the Refs above keep every cleared object alive until all are cleared
+        for (auto& env : envs) {
+            env->slots.clear();
+            env->data.clear();
+            env->outer = nullptr;
+        }
+        for (auto& atom : atoms) {
+            atom->ref = nullptr;
+        }
+        return freed;
+    }
+};
+
+void Collector::promoteYoung()
+{
+    auto young = generations[youngGeneration];
+    if (young == nullptr) {
+        return;
+    }
+    auto last = young;
+    for (;;) {
+        last->generation = oldGeneration;
+        if (last->next == nullptr) {
+            break;
+        }
+        last = last->next;
+    }
+    last->next = generations[oldGeneration];
+    if (last->next != nullptr) {
+        last->next->previous = last;
+    }
+    generations[oldGeneration] = young;
+    generations[youngGeneration] = nullptr;
+    generationSizes[oldGeneration] += generationSizes[youngGeneration];
+    generationSizes[youngGeneration] = 0;
+}
+
+void Collector::collectIfNeeded()
+{
+    if (generationSizes[youngGeneration] < youngThreshold) {
+        return;
+    }
+    bool full = generationSizes[oldGeneration] >= std::max(oldThreshold, 2 * oldSizeAfterFull);
+    collect(full);
+}
+
+size_t Collector::collect(bool full)
+{
+    auto start = std::chrono::steady_clock::now();
+    Walk walk(full ? oldGeneration : youngGeneration);
+    walk.subtractInternalReferences();
+    walk.markAlive();
+    size_t freed = walk.freeGarbage();
+    promoteYoung();
+    if (full) {
+        oldSizeAfterFull = generationSizes[oldGeneration];
+        collectorStats.fullCollections++;
+    }
+    collectorStats.collections++;
+    collectorStats.freedObjects += freed;
+    double pauseMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    collectorStats.lastPauseMs = pauseMs;
+    collectorStats.maxPauseMs = std::max(collectorStats.maxPauseMs, pauseMs);
+    collectorStats.totalPauseMs += pauseMs;
+    return freed;
+}
+
+Collector::Stats Collector::stats()
+{
+    Stats result = collectorStats;
+    result.trackedObjects = generationSizes[youngGeneration] + generationSizes[oldGeneration];
+    return result;
+}
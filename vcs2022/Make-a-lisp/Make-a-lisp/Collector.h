@@ -0,0 +1,66 @@
+#pragma once
+#include <cstddef>
+
+// Base of the objects a cycle collection starts from: environments and atoms.
+// They are the only objects changed after they are made (def! in an Env,
+// reset! and swap! on an atom), so every reference cycle goes through one of
+// them. Each one is linked into the list of its generation for as long as it
+// lives.
+class Collectable
+{
+	friend class Collector;
+public:
+	enum class Kind : unsigned char { Env, Atom };
+private:
+	Collectable* previous = nullptr;
+	Collectable* next = nullptr;
+	const Kind kind;
+	unsigned char generation = 0;
+protected:
+	Collectable(Kind kind);
+	Collectable(const Collectable& other) : Collectable(other.kind) {}
+	Collectable& operator=(const Collectable&) { return *this; }
+	~Collectable();
+};
+
+// Collects the cycles reference counting cannot free, like a function defined
+// in a let* or fn* scope: the Env holds the function and the function holds
+// the Env.
+// A collection walks the graph reachable from the Envs and atoms of the
+// collected generations, through functions, lists, vectors, maps and their
+// nodes, and takes off each object's count the references coming from inside
+// that graph. An object left with a positive count is referenced from outside
+// it: from a Ref on the C++ stack, the global environment or an object of an
+// older generation. Such objects and everything they reach are alive, so the
+// roots are found without scanning the stack. The rest is garbage; clearing
+// its Envs and atoms breaks the cycles and reference counting frees it all.
+// New objects start young and move to the old generation when they survive a
+// collection. The old generation is collected when it has doubled in size
+// since the last full collection.
+// Like the rest of the evaluator, the collector is single threaded.
+class Collector
+{
+	struct Walk;
+	// Moves the survivors of a collection to the old generation.
+	static void promoteYoung();
+public:
+	// Runs a young collection once enough young objects are alive. Called by
+	// the evaluator between steps, where every live object is held by a Ref.
+	static void collectIfNeeded();
+	// Collects the young generation, or every generation when full is set.
+	// Returns the number of objects freed.
+	static size_t collect(bool full);
+
+	struct Stats {
+		size_t collections;
+		size_t fullCollections;
+		// Objects found in garbage cycles, over all collections.
+		size_t freedObjects;
+		// Envs and atoms alive, in every generation.
+		size_t trackedObjects;
+		double lastPauseMs;
+		double maxPauseMs;
+		double totalPauseMs;
+	};
+	static Stats stats();
+};
@@ -0,0 +1,382 @@
+#include "Compiler.h"
+#include "SpecFormHandler.h"
+#include "Scope.h"
+
+static const MALSymbolTypePtr defBangSymbol = MALSymbolType::intern("def!");
+static const MALSymbolTypePtr letStarSymbol = MALSymbolType::intern("let*");
+static const MALSymbolTypePtr doSymbol = MALSymbolType::intern("do");
+static const MALSymbolTypePtr ifSymbol = MALSymbolType::intern("if");
+static const MALSymbolTypePtr fnStarSymbol = MALSymbolType::intern("fn*");
+static const MALSymbolTypePtr quoteSymbol = MALSymbolType::intern("quote");
+static const MALSymbolTypePtr quasiquoteSymbol = MALSymbolType::intern("quasiquote");
+static const MALSymbolTypePtr quasiquoteExpandSymbol = MALSymbolType::intern("quasiquoteexpand");
+static const MALSymbolTypePtr defMacroSymbol = MALSymbolType::intern("defmacro!");
+static const MALSymbolTypePtr macroexpandSymbol = MALSymbolType::intern("macroexpand");
+static const MALSymbolTypePtr tryStarSymbol = MALSymbolType::intern("try*");
+
+namespace {
+    class Compiler
+    {
+        const EnvPtr& globalEnv;
+        Bytecode& code;
+        const Scope* scope;
+
+        unsigned int emit(OpCode op, unsigned int a = 0, unsigned int b = 0);
+        unsigned int addConstant(MALValue value);
+        unsigned int addGlobal(MALSymbolType* name);
+        void emitReturnIf(bool tail);
+        void emitLocal(MALSymbolType* name, unsigned int depth, unsigned int slot, unsigned int callSite = 0);
+
+        void compileSymbol(MALSymbolType* name, bool tail);
+        void compileList(const MALListTypePtr& list, bool tail);
+        void compileCall(const MALListTypePtr& list, bool tail);
+        void compileMacroCall(const MALListTypePtr& list, bool tail);
+        void compileDefinition(const MALListTypePtr& form, OpCode op, bool tail);
+        void compileDo(const MALListTypePtr& form, bool tail);
+        void compileIf(const MALListTypePtr& form, bool tail);
+        void compileLet(const MALListTypePtr& form, bool tail);
+        void compileClosure(const MALListTypePtr& form, bool tail);
+        void compileTry(const MALListTypePtr& form, bool tail);
+        // For a malformed special form, which EVAL reports when it is run.
+        void compileInterpreted(const MALValue& form, bool tail);
+    public:
+        Compiler(const EnvPtr& globalEnv, Bytecode& code, const Scope* scope) : globalEnv(globalEnv), code(code), scope(scope) {}
+        void compile(const MALValue& ast, bool tail);
+        // Compiles the expansion of the macro call to return its value.
+        void compileExpansion(const MacroCallSite& site);
+    };
+}
+
+unsigned int Compiler::emit(OpCode op, unsigned int a, unsigned int b)
+{
+    this->code.instructions.push_back(Instruction{ op, a, b });
+    return (unsigned int)this->code.instructions.size() - 1;
+}
+
+unsigned int Compiler::addConstant(MALValue value)
+{
+    this->code.constants.push_back(std::move(value));
+    return (unsigned int)this->code.constants.size() - 1;
+}
+
+unsigned int Compiler::addGlobal(MALSymbolType* name)
+{
+    this->code.globals.push_back(Bytecode::GlobalRef{ globalReference(this->scope, name), SIZE_MAX, nullptr });
+    return (unsigned int)this->code.globals.size() - 1;
+}
+
+// callSite is that of a call the local is the callee of, plus one.
+void Compiler::emitLocal(MALSymbolType* name, unsigned int depth, unsigned int slot, unsigned int callSite)
+{
+    this->code.locals.push_back(localReference(this->scope, name, depth, slot));
+    this->emit(OpCode::Local, (unsigned int)this->code.locals.size() - 1, callSite);
+}
+
+void Compiler::emitReturnIf(bool tail)
+{
+    if (tail) {
+        this->emit(OpCode::Return);
+    }
+}
+
+void Compiler::compile(const MALValue& ast, bool tail)
+{
+    switch (ast.type()) {
+    case MALType::Types::Symbol:
+        this->compileSymbol(ast.asSymbol()->canonical, tail);
+        return;
+    case MALType::Types::List:
+        this->compileList(ast.asList(), tail);
+        return;
+    case MALType::Types::Vector: {
+        auto vector = malCast<MALVectorType>(ast);
+        auto values = vector->toVector();
+        for (auto& value : values) {
+            this->compile(value, false);
+        }
+        this->emit(OpCode::MakeVector, (unsigned int)values.size());
+        break;
+    }
+    case MALType::Types::HashMap: {
+        auto map = malCast<MALHashMapType>(ast);
+        auto entries = map->entries();
+        for (auto& entry : entries) {
+            this->emit(OpCode::Constant, this->addConstant(entry.first));
+            this->compile(entry.second, false);
+        }
+        this->emit(OpCode::MakeHashMap, (unsigned int)entries.size());
+        break;
+    }
+    default:
+        this->emit(OpCode::Constant, this->addConstant(ast));
+        break;
+    }
+    this->emitReturnIf(tail);
+}
+
+void Compiler::compileSymbol(MALSymbolType* name, bool tail)
+{
+    unsigned int depth, slot;
+    if (findLocal(this->scope, name, depth, slot)) {
+        this->emitLocal(name, depth, slot);
+    }
+    else {
+        this->emit(OpCode::Global, this->addGlobal(name));
+    }
+    this->emitReturnIf(tail);
+}
+
+void Compiler::compileList(const MALListTypePtr& list, bool tail)
+{
+    if (list->size() == 0) {
+        this->emit(OpCode::Constant, this->addConstant(list));
+        this->emitReturnIf(tail);
+        return;
+    }
+    MALSymbolTypePtr head;
+    if (!list->getAt(0).tryAsSymbol(head)) {
+        this->compileCall(list, tail);
+        return;
+    }
+    auto name = head->canonical;
+    if (findMacro(this->scope, name, this->globalEnv) != nullptr) {
+        this->compileMacroCall(list, tail);
+        return;
+    }
+    if (name == defBangSymbol.get()) {
+        this->compileDefinition(list, OpCode::Define, tail);
+    }
+    else if (name == letStarSymbol.get()) {
+        this->compileLet(list, tail);
+    }
+    else if (name == doSymbol.get()) {
+        this->compileDo(list, tail);
+    }
+    else if (name == ifSymbol.get()) {
+        this->compileIf(list, tail);
+    }
+    else if (name == fnStarSymbol.get()) {
+        this->compileClosure(list, tail);
+    }
+    else if (name == quoteSymbol.get() && list->size() == 2) {
+        this->emit(OpCode::Constant, this->addConstant(list->getAt(1)));
+        this->emitReturnIf(tail);
+    }
+    else if (name == quasiquoteSymbol.get() && list->size() == 2) {
+        this->compile(quasiquote(list->getAt(1)), tail);
+    }
+    else if (name == quasiquoteExpandSymbol.get() && list->size() == 2) {
+        this->emit(OpCode::Constant, this->addConstant(quasiquote(list->getAt(1))));
+        this->emitReturnIf(tail);
+    }
+    else if (name == defMacroSymbol.get()) {
+        this->compileDefinition(list, OpCode::DefineMacro, tail);
+    }
+    else if (name == tryStarSymbol.get()) {
+        this->compileTry(list, tail);
+    }
+    //macroexpand sees the macros of the frames it runs in
+    else if (name == quoteSymbol.get() || name == quasiquoteSymbol.get() || name == quasiquoteExpandSymbol.get() || name == macroexpandSymbol.get()) {
+        this->compileInterpreted(list, tail);
+    }
+    else {
+        this->compileCall(list, tail);
+    }
+}
+
+// The callee named by a symbol is checked for a macro, a global one defined
+// after the call was compiled or a local one, before the arguments are
+// evaluated; the form is then handed to EVAL to expand.
+void Compiler::compileCall(const MALListTypePtr& list, bool tail)
+{
+    auto site = (unsigned int)this->code.callSites.size();
+    this->code.callSites.push_back(Bytecode::CallSite{ list, 0 });
+    auto head = list->getAt(0);
+    MALSymbolTypePtr headSymbol;
+    unsigned int depth, slot;
+    bool namedHead = head.tryAsSymbol(headSymbol);
+    bool globalHead = namedHead && !findLocal(this->scope, headSymbol->canonical, depth, slot);
+    if (globalHead) {
+        this->emit(OpCode::Global, this->addGlobal(headSymbol->canonical), site + 1);
+    }
+    else if (namedHead) {
+        this->emitLocal(headSymbol->canonical, depth, slot, site + 1);
+    }
+    else {
+        this->compile(head, false);
+    }
+    auto argc = (unsigned int)list->size() - 1;
+    for (auto p = ++list->begin(); p != list->end(); p++) {
+        this->compile(*p, false);
+    }
+    auto primitive = globalHead && argc == 2 ? findPrimitive(headSymbol.get()) : primitiveCount;
+    if (primitive < primitiveCount) {
+        this->code.callSites[site].callPc = this->emit((OpCode)((size_t)OpCode::Add + primitive), site);
+        this->emitReturnIf(tail);
+        return;
+    }
+    this->code.callSites[site].callPc = this->emit(tail ? OpCode::TailCall : OpCode::Call, argc, site);
+    //where a macro expanded in place of the tail call returns from
+    this->emitReturnIf(tail);
+}
+
+// The call is expanded when it runs, so it gets the macro bound to its head
+// then, and the expansion, with its errors and side effects, happens then.
+void Compiler::compileMacroCall(const MALListTypePtr& list, bool tail)
+{
+    this->code.expansions.push_back(Bytecode::Expansion{ MacroCallSite(list, frameNamesOf(this->scope)), nullptr });
+    this->emit(OpCode::Expand, (unsigned int)this->code.expansions.size() - 1, tail ? 1 : 0);
+}
+
+void Compiler::compileDefinition(const MALListTypePtr& form, OpCode op, bool tail)
+{
+    MALSymbolTypePtr symbol;
+    if (form->size() < 3 || (op == OpCode::DefineMacro && form->size() != 3) || !form->getAt(1).tryAsSymbol(symbol)) {
+        this->compileInterpreted(form, tail);
+        return;
+    }
+    this->compile(form->getAt(2), false);
+    this->emit(op, this->addConstant(MALSymbolTypePtr(symbol->canonical)));
+    this->emitReturnIf(tail);
+}
+
+void Compiler::compileDo(const MALListTypePtr& form, bool tail)
+{
+    if (form->size() <= 1) {
+        this->emit(OpCode::Constant, this->addConstant(MALValue::nil()));
+        this->emitReturnIf(tail);
+        return;
+    }
+    auto p = ++form->begin();
+    for (size_t i = 1; i < form->size() - 1; i++, p++) {
+        this->compile(*p, false);
+        this->emit(OpCode::Pop);
+    }
+    this->compile(*p, tail);
+}
+
+// Branches in tail position end in a return of their own.
+void Compiler::compileIf(const MALListTypePtr& form, bool tail)
+{
+    if (form->size() < 3) {
+        this->compileInterpreted(form, tail);
+        return;
+    }
+    this->compile(form->getAt(1), false);
+    auto toElse = this->emit(OpCode::JumpIfFalse);
+    this->compile(form->getAt(2), tail);
+    auto toEnd = tail ? 0 : this->emit(OpCode::Jump);
+    this->code.instructions[toElse].a = (unsigned int)this->code.instructions.size();
+    if (form->size() > 3) {
+        this->compile(form->getAt(3), tail);
+    }
+    else {
+        this->emit(OpCode::Constant, this->addConstant(MALValue::nil()));
+        this->emitReturnIf(tail);
+    }
+    if (!tail) {
+        this->code.instructions[toEnd].a = (unsigned int)this->code.instructions.size();
+    }
+}
+
+void Compiler::compileLet(const MALListTypePtr& form, bool tail)
+{
+    LetBindings let;
+    if (!let.read(form)) {
+        this->compileInterpreted(form, tail);
+        return;
+    }
+    Scope letScope(this->scope, let.names);
+    this->emit(OpCode::PushFrame, this->addConstant(let.names));
+    auto outerScope = this->scope;
+    this->scope = &letScope;
+    for (size_t i = 0; i < let.bindings->size(); i += 2) {
+        this->compile(let.bindings->getAt(i + 1), false);
+        this->emit(OpCode::SetLocal, let.bindingSlots[i / 2]);
+    }
+    this->compile(form->getAt(2), tail);
+    this->scope = outerScope;
+    if (!tail) {
+        this->emit(OpCode::PopFrame);
+    }
+}
+
+void Compiler::compileClosure(const MALListTypePtr& form, bool tail)
+{
+    Parameters parameters;
+    if (!parameters.read(form)) {
+        this->compileInterpreted(form, tail);
+        return;
+    }
+    Ref<Bytecode> function(new Bytecode());
+    function->names = parameters.names;
+    function->requiredArgs = parameters.requiredArgs;
+    function->variadic = parameters.variadic;
+    function->params = parameters.params;
+    function->body = form->getAt(2);
+    Scope callScope(this->scope, function->names);
+    function->name = form->to_string(true);
+    Compiler(this->globalEnv, *function, &callScope).compile(function->body, true);
+    this->code.functions.push_back(function);
+    this->emit(OpCode::Closure, (unsigned int)this->code.functions.size() - 1);
+    this->emitReturnIf(tail);
+}
+
+// The body runs with a handler pushed; the catch* body runs in a frame of its
+// own binding the error.
+void Compiler::compileTry(const MALListTypePtr& form, bool tail)
+{
+    CatchClause clause;
+    if (!clause.read(form)) {
+        this->compileInterpreted(form, tail);
+        return;
+    }
+    auto pushHandler = this->emit(OpCode::PushHandler, 0, this->addConstant(form->getAt(1)));
+    this->compile(form->getAt(1), false);
+    this->emit(OpCode::PopHandler);
+    auto toEnd = this->emit(tail ? OpCode::Return : OpCode::Jump);
+    this->code.instructions[pushHandler].a = (unsigned int)this->code.instructions.size();
+    Ref<MALListType> names(new MALListType({ MALSymbolTypePtr(clause.name) }));
+    Scope catchScope(this->scope, names);
+    this->emit(OpCode::PushFrame, this->addConstant(names));
+    this->emit(OpCode::SetLocal, 0);
+    auto outerScope = this->scope;
+    this->scope = &catchScope;
+    this->compile(clause.form->getAt(2), tail);
+    this->scope = outerScope;
+    if (!tail) {
+        this->emit(OpCode::PopFrame);
+        this->code.instructions[toEnd].a = (unsigned int)this->code.instructions.size();
+    }
+}
+
+void Compiler::compileInterpreted(const MALValue& form, bool tail)
+{
+    this->emit(OpCode::Interpret, this->addConstant(form));
+    this->emitReturnIf(tail);
+}
+
+void Compiler::compileExpansion(const MacroCallSite& site)
+{
+    if (site.isCall()) {
+        this->compileCall(site.form, true);
+    }
+    else {
+        this->compile(site.expansion(), true);
+    }
+}
+
+Ref<Bytecode> compileExpansion(const MacroCallSite& site, const EnvPtr& globalEnv)
+{
+    ScopeChain scopes(site.frames);
+    Ref<Bytecode> code(new Bytecode());
+    Compiler(globalEnv, *code, scopes.innermost()).compileExpansion(site);
+    return code;
+}
+
+Ref<Bytecode> compileTopLevel(const MALValue& ast, const EnvPtr& globalEnv)
+{
+    Ref<Bytecode> code(new Bytecode());
+    Compiler(globalEnv, *code, nullptr).compile(ast, true);
+    return code;
+}
@@ -0,0 +1,11 @@
+#pragma once
+#include "Type.h"
+#include "Env.h"
+#include "VM.h"
+
+// Compiles a top-level form, to run with the global environment as its frame.
+// The macro calls in it are left to expand when they run.
+Ref<Bytecode> compileTopLevel(const MALValue& ast, const EnvPtr& globalEnv);
+// Compiles the expansion of a macro call, to run in the frame of the call and
+// return its value.
+Ref<Bytecode> compileExpansion(const MacroCallSite& site, const EnvPtr& globalEnv);
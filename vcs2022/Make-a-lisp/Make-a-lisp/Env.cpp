@@ -1,63 +1,329 @@
 #include "Env.h"
 
-std::shared_ptr<MALSymbolType> listArgsSymbol(new MALSymbolType("&"));
+Ref<MALSymbolType> listArgsSymbol = MALSymbolType::intern("&");
 
-Env::Env(EnvPtr outer) : outer(outer) {}
+MALValue* EnvTable::find(MALSymbolType* symbol)
+{
+    if (this->count == 0) {
+        return nullptr;
+    }
+    auto mask = this->capacity - 1;
+    auto hash = symbol->nameHash;
+    for (size_t bucket = hash & mask, probes = 0;; bucket = (bucket + 1) & mask, probes++) {
+        auto& entry = this->entries[bucket];
+        if (entry.key == symbol) {
+            return &entry.value;
+        }
+        //an entry closer to home than we have come means the key is absent
+        if (entry.key == nullptr || this->distance(bucket, entry.hash) < probes) {
+            return nullptr;
+        }
+    }
+}
+
+void EnvTable::set(MALSymbolType* symbol, MALValue value)
+{
+    //grow at a load of 7/8
+    if ((this->count + 1) * 8 > this->capacity * 7) {
+        this->grow();
+    }
+    auto mask = this->capacity - 1;
+    auto hash = symbol->nameHash;
+    for (size_t bucket = hash & mask, probes = 0;; bucket = (bucket + 1) & mask, probes++) {
+        auto& resident = this->entries[bucket];
+        if (resident.key == symbol) {
+            resident.value = std::move(value);
+            return;
+        }
+        if (resident.key == nullptr || this->distance(bucket, resident.hash) < probes) {
+            //the key is absent: take this bucket and move its entry on
+            this->count++;
+            this->place(Entry{ symbol, hash, std::move(value) }, bucket, probes);
+            return;
+        }
+    }
+}
+
+void EnvTable::place(Entry entry, size_t bucket, size_t probes)
+{
+    auto mask = this->capacity - 1;
+    for (;; bucket = (bucket + 1) & mask, probes++) {
+        auto& resident = this->entries[bucket];
+        if (resident.key == nullptr) {
+            resident = std::move(entry);
+            return;
+        }
+        auto residentProbes = this->distance(bucket, resident.hash);
+        if (residentProbes < probes) {
+            std::swap(resident, entry);
+            probes = residentProbes;
+        }
+    }
+}
+
+void EnvTable::grow()
+{
+    auto oldEntries = this->entries;
+    auto oldCapacity = this->capacity;
+    this->capacity = oldCapacity == 0 ? 8 : oldCapacity * 2;
+    this->entries = static_cast<Entry*>(Pool::allocate(this->capacity * sizeof(Entry)));
+    for (size_t i = 0; i < this->capacity; i++) {
+        new (&this->entries[i]) Entry{ nullptr, 0, MALValue() };
+    }
+    auto mask = this->capacity - 1;
+    for (size_t i = 0; i < oldCapacity; i++) {
+        if (oldEntries[i].key != nullptr) {
+            this->place(std::move(oldEntries[i]), oldEntries[i].hash & mask, 0);
+        }
+        oldEntries[i].~Entry();
+    }
+    if (oldEntries != nullptr) {
+        Pool::deallocate(oldEntries, oldCapacity * sizeof(Entry));
+    }
+}
 
-Env::Env(EnvPtr outer, std::shared_ptr<MALSequenceType> bindings, std::vector<MALTypePtr> exprs) : outer(outer)
+void EnvTable::clear()
 {
-    bool foundSpecialChar = false;
+    for (size_t i = 0; i < this->capacity; i++) {
+        this->entries[i].~Entry();
+    }
+    if (this->entries != nullptr) {
+        Pool::deallocate(this->entries, this->capacity * sizeof(Entry));
+    }
+    this->entries = nullptr;
+    this->capacity = 0;
+    this->count = 0;
+}
+
+static Env::Stats frameStats = {};
+//frames left empty by recycle, for callFrame and letFrame to take
+static std::vector<EnvPtr> spareFrames;
+static const size_t spareFrameLimit = 64;
+
+size_t Env::definitionEpoch = 0;
+bool Env::localDefinitions = false;
+
+Env::Env(EnvPtr outer) : Collectable(Kind::Env), outer(outer)
+{
+    frameStats.created++;
+}
+
+Env::Env(EnvPtr outer, Ref<MALSequenceType> bindings, MALValue* args, size_t argc) : Collectable(Kind::Env), names(bindings), stride(1), outer(outer)
+{
+    frameStats.created++;
+    this->bindArguments(args, argc);
+}
+
+Env::Env(EnvPtr outer, Ref<MALSequenceType> names, unsigned int stride) : Collectable(Kind::Env), names(names), stride(stride), outer(outer)
+{
+    frameStats.created++;
+    this->slots.resize(names->size() / stride);
+}
+
+void Env::bindArguments(MALValue* args, size_t argc)
+{
+    auto& bindings = this->names;
     int realBindingsSize = 0;
     for (int i = 0; i < bindings->size(); i++) {
-        auto symbol = bindings->getAt(i)->asSymbol();
-        if (symbol->isEqualTo(listArgsSymbol)) {
+        auto symbol = bindings->getAt(i).asSymbol();
+        if (symbol->canonical == listArgsSymbol.get()) {
             break;
         }
         realBindingsSize++;
     }
-    if (exprs.size() < realBindingsSize) {
+    if (argc < realBindingsSize) {
         throw std::runtime_error("Error: Number of parameters don't match function's parameters list size.");
     }
+    this->slots.resize(bindings->size());
     for (int i = 0; i < bindings->size(); i++) {
-        auto symbol = bindings->getAt(i)->asSymbol();
-        if (symbol->isEqualTo(listArgsSymbol)) {
+        auto symbol = bindings->getAt(i).asSymbol();
+        if (symbol->canonical == listArgsSymbol.get()) {
             if (i + 1 >= bindings->size()) {
                 throw std::runtime_error("Error: Missing binding name after special character '&'");
             }
-            auto argsList = std::shared_ptr<MALListType>(new MALListType());
-            for (int j = i; j < exprs.size(); j++) {
-                argsList->values.push_back(exprs[j]);
+            auto argsList = Ref<MALListType>(new MALListType());
+            for (size_t j = i; j < argc; j++) {
+                argsList->push_back(std::move(args[j]));
             }
-            auto argsListSym = bindings->getAt(i + 1)->asSymbol();
-            this->set(argsListSym, argsList);
+            this->slots[i + 1] = argsList;
+            return;
+        }
+        this->slots[i] = std::move(args[i]);
+    }
+}
+
+void Env::reset()
+{
+    this->data.clear();
+    this->slots.clear();
+    this->names = nullptr;
+    this->stride = 0;
+    this->outer = nullptr;
+}
+
+void Env::rebind(EnvPtr outer, Ref<MALSequenceType> bindings, MALValue* args, size_t argc)
+{
+    frameStats.reused++;
+    auto previousOuter = std::move(this->outer);
+    this->reset();
+    this->names = std::move(bindings);
+    this->stride = 1;
+    this->outer = std::move(outer);
+    //the frame the call was made from is often the only holder of its outer
+    //frame, as for a tail call out of a let*
+    recycle(previousOuter);
+    this->bindArguments(args, argc);
+}
+
+void Env::rebindSlots(EnvPtr outer, Ref<MALSequenceType> names)
+{
+    frameStats.reused++;
+    auto previousOuter = std::move(this->outer);
+    this->reset();
+    this->slots.resize(names->size());
+    this->names = std::move(names);
+    this->stride = 1;
+    this->outer = std::move(outer);
+    recycle(previousOuter);
+}
+
+void Env::recycle(EnvPtr& frame)
+{
+    if (frame.useCount() != 1 || frame->isGlobal() || spareFrames.size() == spareFrameLimit) {
+        frame = nullptr;
+        return;
+    }
+    auto outer = std::move(frame->outer);
+    frame->reset();
+    spareFrames.push_back(std::move(frame));
+    recycle(outer);
+}
+
+EnvPtr Env::callFrame(EnvPtr outer, Ref<MALSequenceType> bindings, MALValue* args, size_t argc)
+{
+    if (spareFrames.empty()) {
+        return EnvPtr(new Env(std::move(outer), std::move(bindings), args, argc));
+    }
+    frameStats.reused++;
+    auto frame = std::move(spareFrames.back());
+    spareFrames.pop_back();
+    frame->names = std::move(bindings);
+    frame->stride = 1;
+    frame->outer = std::move(outer);
+    frame->bindArguments(args, argc);
+    return frame;
+}
+
+EnvPtr Env::letFrame(EnvPtr outer, Ref<MALSequenceType> names, unsigned int stride)
+{
+    if (spareFrames.empty()) {
+        return EnvPtr(new Env(std::move(outer), std::move(names), stride));
+    }
+    frameStats.reused++;
+    auto frame = std::move(spareFrames.back());
+    spareFrames.pop_back();
+    frame->slots.resize(names->size() / stride);
+    frame->names = std::move(names);
+    frame->stride = stride;
+    frame->outer = std::move(outer);
+    return frame;
+}
+
+Env::Stats Env::stats()
+{
+    return frameStats;
+}
+
+MALSymbolType* Env::slotName(size_t slot) const
+{
+    return static_cast<MALSymbolType*>(this->names->getAt(slot * this->stride).ptr().get())->canonical;
+}
+
+ptrdiff_t Env::findSlot(MALSymbolType* symbol) const
+{
+    //the latest binding of a name wins, as in (let* [a 1 a 2] a)
+    for (ptrdiff_t i = (ptrdiff_t)this->slots.size() - 1; i >= 0; i--) {
+        if (this->slots[i] != nullptr && this->slotName(i) == symbol) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+void Env::set(MALSymbolTypePtr symbol, MALValue malType)
+{
+    MALSymbolTypePtr key(symbol->canonical);
+    if (this->stride != 0) {
+        auto slot = this->findSlot(key.get());
+        if (slot >= 0) {
+            this->slots[slot] = malType;
             return;
         }
-        this->set(bindings->getAt(i)->asSymbol(), exprs[i]);
     }
+    definitionEpoch++;
+    if (!this->isGlobal()) {
+        localDefinitions = true;
+    }
+    this->data.set(key.get(), std::move(malType));
 }
 
-void Env::set(MALSymbolTypePtr symbol, MALTypePtr malType)
+MALValue Env::find(MALSymbolTypePtr symbol)
 {
-    auto got = this->data.find(symbol);
-    if (got != this->data.end()) {
-        this->data.erase(symbol);
+    if (symbol->isResolved()) {
+        return this->findResolved(static_cast<MALResolvedSymbolType&>(*symbol));
     }
-    this->data.insert(std::pair<MALSymbolTypePtr, MALTypePtr>(symbol, malType));
+    for (Env* env = this; env != nullptr; env = env->outer.get()) {
+        if (env->stride != 0) {
+            auto slot = env->findSlot(symbol.get());
+            if (slot >= 0) {
+                return env->slots[slot];
+            }
+        }
+        if (!env->data.empty()) {
+            if (auto got = env->data.find(symbol.get())) {
+                return *got;
+            }
+        }
+    }
+    return nullptr;
 }
 
-MALTypePtr Env::find(MALSymbolTypePtr symbol)
+MALValue Env::findResolved(const MALResolvedSymbolType& symbol)
 {
-    auto got = this->data.find(symbol);
-    if (got != this->data.end()) {
-        return got->second;
+    Env* env = this;
+    for (unsigned int hops = 0; hops < symbol.depth; hops++) {
+        //a def! in a frame on the way shadows the binding
+        if (!env->data.empty()) {
+            if (auto got = env->data.find(symbol.canonical)) {
+                return *got;
+            }
+        }
+        env = env->outer.get();
+        //a frame of a let* that was not resolved is not one the reference
+        //was resolved against: a macro moved it there
+        if (env == nullptr || env->stride == 2) {
+            return this->find(symbol.symbol);
+        }
     }
-    if (this->outer == nullptr) {
-        return nullptr;
+    if (symbol.isGlobal()) {
+        if (env->isGlobal()) {
+            auto got = env->data.find(symbol.canonical);
+            return got != nullptr ? *got : nullptr;
+        }
+    }
+    else if (env->names == symbol.names && symbol.slot < env->slots.size() && env->slots[symbol.slot] != nullptr) {
+        return env->slots[symbol.slot];
     }
-    return  this->outer->find(symbol);
+    //the reference is evaluated away from where it was resolved
+    return this->find(symbol.symbol);
+}
+
+MALValue Env::getEmptySlot(size_t slot)
+{
+    return this->get(MALSymbolTypePtr(this->slotName(slot)));
 }
 
-MALTypePtr Env::get(MALSymbolTypePtr symbol)
+MALValue Env::get(MALSymbolTypePtr symbol)
 {
     auto result = this->find(symbol);
     if (result == nullptr) {
@@ -71,14 +337,14 @@ std::string Env::print()
     std::string result = "";
     auto size = this->data.size();
     int i = 0;
-    for (auto p = this->data.begin(); p != this->data.end(); p++, i++) {
-        auto pair = *p;
-        result += pair.first->to_string(true) + " ";
-        result += pair.second->to_string(true);
+    this->data.forEach([&](EnvTable::Entry& entry) {
+        result += entry.key->to_string(true) + " ";
+        result += entry.value.to_string(true);
         if (i != size - 1) {
             result += " ";
         }
-    }
+        i++;
+    });
     std::cout << "AAAAAAAAAAA" << std::endl;
     return "{" + result + "}";
 }
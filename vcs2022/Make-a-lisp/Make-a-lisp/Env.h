@@ -9,42 +9,142 @@
 #include <unordered_map>
 
 #include "Type.h"
+#include "Pool.h"
 
-#define EnvPtr std::shared_ptr<Env>
-struct SymbolHash {
-	std::size_t operator()(MALSymbolTypePtr const& symbolKey) const noexcept
-	{
-		return std::hash<std::string> {}(symbolKey->name);
-	}
-};
-struct SymbolEqualPred {
-	bool operator()(const MALSymbolTypePtr lhs, const MALSymbolTypePtr rhs) const
-	{
-		return lhs->name == rhs->name;
+#define EnvPtr Ref<Env>
+// Table of the names bound in a table frame: open addressing with linear
+// probing, kept in Robin Hood order (an entry never sits further from its home
+// bucket than the entry it displaced), so a lookup stops at the first entry
+// closer to home than the one looked for. Entries are stored inline with the
+// hash of their key, and set inserts or assigns in a single probe. Keys are
+// interned symbols, which live for the whole run. There is no erase: mal
+// cannot unbind a name.
+class EnvTable {
+public:
+	struct Entry {
+		MALSymbolType* key;
+		size_t hash;
+		MALValue value;
+	};
+	EnvTable() = default;
+	EnvTable(const EnvTable&) = delete;
+	EnvTable& operator=(const EnvTable&) = delete;
+	~EnvTable() { this->clear(); }
+	// The value bound to symbol, or nullptr.
+	MALValue* find(MALSymbolType* symbol);
+	void set(MALSymbolType* symbol, MALValue value);
+	bool empty() const { return this->count == 0; }
+	size_t size() const { return this->count; }
+	void clear();
+	// Calls visit with each entry, in no particular order.
+	template<class F>
+	void forEach(F&& visit) {
+		for (size_t i = 0; i < this->capacity; i++) {
+			if (this->entries[i].key != nullptr) {
+				visit(this->entries[i]);
+			}
+		}
 	}
+private:
+	Entry* entries = nullptr;
+	size_t capacity = 0;
+	size_t count = 0;
+
+	size_t distance(size_t bucket, size_t hash) const { return (bucket - hash) & (this->capacity - 1); }
+	void grow();
+	// Places an entry for a key known to be absent, probing on from bucket,
+	// which is probes buckets from the entry's home.
+	void place(Entry entry, size_t bucket, size_t probes);
 };
 
-using EnvTable = std::unordered_map<MALSymbolTypePtr, MALTypePtr, SymbolHash, SymbolEqualPred>;
+using EnvSlots = std::vector<MALValue, PoolAllocator<MALValue>>;
 
-class Env {
+// A frame is either a slot frame, for a function call or a let*, or a table
+// frame. A slot frame keeps the value of the i-th name of its names list in
+// slots[i]; names are stride apart in the list: 1 for parameter lists and the
+// names of a resolved let*, 2 for the binding list of a let* that was not
+// resolved. Table frames (the global environment, catch*) and names added to
+// a slot frame with def! go to data.
+class Env : public RefCounted, public Collectable {
+	friend class Collector;
+	Ref<MALSequenceType> names;
+	unsigned int stride = 0;
+	EnvSlots slots;
 	EnvTable data;
 	EnvPtr outer = nullptr;
+
+	MALSymbolType* slotName(size_t slot) const;
+	// Latest set slot bound to the symbol, or -1.
+	ptrdiff_t findSlot(MALSymbolType* symbol) const;
+	MALValue findResolved(const MALResolvedSymbolType& symbol);
+	// Fills the slots of a function call frame from its argc arguments, moving
+	// them out of args.
+	void bindArguments(MALValue* args, size_t argc);
+	// Drops every binding and the outer frame.
+	void reset();
+	// Value of slot while it is still empty: the name's binding further out.
+	MALValue getEmptySlot(size_t slot);
+
+	static size_t definitionEpoch;
+	static bool localDefinitions;
 public:
 	Env(EnvPtr outer = nullptr);
-	Env(EnvPtr outer, std::shared_ptr<MALSequenceType> bindings, std::vector<MALTypePtr> exprs);
+	Env(EnvPtr outer, Ref<MALSequenceType> bindings, MALValue* args, size_t argc);
+	// Frame of a let*: one empty slot per name, filled in order with setSlot.
+	Env(EnvPtr outer, Ref<MALSequenceType> names, unsigned int stride);
+	void setSlot(size_t slot, MALValue value) { this->slots[slot] = std::move(value); }
+	MALValue getSlot(size_t slot) { return this->slots[slot] != nullptr ? this->slots[slot] : this->getEmptySlot(slot); }
+	Env* outerFrame() const { return this->outer.get(); }
+	// Makes this frame the frame of a new function call, as the constructor
+	// taking arguments would. Only for a frame nothing else holds: the
+	// evaluator uses it for tail calls from a frame no closure, atom or caller
+	// refers to.
+	void rebind(EnvPtr outer, Ref<MALSequenceType> bindings, MALValue* args, size_t argc);
+	// The same for a frame like letFrame(outer, names, 1), whose slots the
+	// caller fills.
+	void rebindSlots(EnvPtr outer, Ref<MALSequenceType> names);
+	// Clears frame. If nothing else held it, it is emptied and kept for
+	// callFrame and letFrame to hand out again, and so is its outer frame if
+	// the frame was the only holder of that one.
+	static void recycle(EnvPtr& frame);
+	// The frame of a function call, like Env(outer, bindings, args, argc), or of a
+	// let*, like Env(outer, names, stride); a recycled frame when there is one.
+	static EnvPtr callFrame(EnvPtr outer, Ref<MALSequenceType> bindings, MALValue* args, size_t argc);
+	static EnvPtr letFrame(EnvPtr outer, Ref<MALSequenceType> names, unsigned int stride);
+	bool isGlobal() const { return this->outer == nullptr; }
 	// takes a symbol key and a mal value and adds to the data structure
-	void set(MALSymbolTypePtr symbol, MALTypePtr funType);
+	void set(MALSymbolTypePtr symbol, MALValue funType);
 	/*takes a symbol key and if the current environment contains that key then return the environment. 
 	If no key is found and outer is not nil then call find (recurse) on the outer environment.*/
-	MALTypePtr find(MALSymbolTypePtr symbol);
+	MALValue find(MALSymbolTypePtr symbol);
 	/*takes a symbol key and uses the find method to locate the environment with the key, then returns the matching value. 
 	If no key is found up the outer chain, then throws/raises a "not found" error.*/
-	MALTypePtr get(MALSymbolTypePtr symbol);
+	MALValue get(MALSymbolTypePtr symbol);
 	std::string print();
+
+	// Changes with every def! that adds or rebinds a name in a table frame, so
+	// a global looked up at one epoch is still bound to the same value while
+	// the epoch is unchanged...
+	static size_t definitions() { return definitionEpoch; }
+	// ...unless a def! bound a name in a frame other than the global
+	// environment, where it can shadow the global for some callers only.
+	static bool hasLocalDefinitions() { return localDefinitions; }
+
+	struct Stats {
+		// Frames allocated, including the global environment.
+		size_t created;
+		// Frames used again: taken over by a tail call made from them, or
+		// recycled and handed out by callFrame or letFrame.
+		size_t reused;
+	};
+	static Stats stats();
 };
 
+// Returned by value: a result never outlives the EVAL step that asked for it,
+// so it needs no allocation.
 struct HandleSpecialFormResult {
 	bool tco; //tail call optimisation flag
 	EnvPtr env;
-	MALTypePtr ast;
+	MALValue ast;
+	HandleSpecialFormResult(bool tco, EnvPtr env, MALValue ast) : tco(tco), env(std::move(env)), ast(std::move(ast)) {}
 };
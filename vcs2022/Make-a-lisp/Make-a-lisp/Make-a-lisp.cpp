@@ -10,46 +10,56 @@
 #include "Type.h"
 #include "Env.h"
 #include "SpecFormHandler.h"
+#include "VM.h"
+#include "Analyzer.h"
 #include "core.h"
 
-MALTypePtr READ(std::string input) {
+MALValue READ(std::string input) {
     return read_str(input);
 }
 
-MALTypePtr EVAL(MALTypePtr ast, EnvPtr env);
+MALValue EVAL(MALValue ast, EnvPtr env);
 
 EnvPtr replEnv(new Env());
+// The engine top-level forms run on: EVAL, unless the command line picks the
+// analyzer (--analyze) or the bytecode engine (--vm).
+enum class Engine { Eval, Analyzer, Bytecode };
+Engine engine = Engine::Eval;
 
-MALTypePtr eval_ast(MALTypePtr ast, EnvPtr env) {
-    switch (ast->type()) {
+MALValue eval_ast(MALValue ast, EnvPtr env) {
+    switch (ast.type()) {
     case MALType::Types::Symbol: {
-        auto symbol = std::dynamic_pointer_cast<MALSymbolType>(ast);
+        auto symbol = malCast<MALSymbolType>(ast);
         return env->get(symbol);
     }
     case MALType::Types::List: {
-        auto list = std::dynamic_pointer_cast<MALListType>(ast);
-        std::shared_ptr<MALListType> newList(new MALListType());
-        for (int i = 0; i < list->values.size(); i++) {
-            newList->values.push_back(EVAL(list->values[i], env));
+        auto list = malCast<MALListType>(ast);
+        std::vector<MALValue> values;
+        values.reserve(list->size());
+        for (auto p = list->begin(); p != list->end(); p++) {
+            values.push_back(EVAL(*p, env));
         }
-        return newList;
+        return Ref<MALListType>(new MALListType(std::move(values)));
         break;
     }
     case MALType::Types::Vector: {
-        auto vector = std::dynamic_pointer_cast<MALVectorType>(ast);
-        std::shared_ptr<MALVectorType> newList(new MALVectorType());
-        for (int i = 0; i < vector->values.size(); i++) {
-            newList->values.push_back(EVAL(vector->values[i], env));
+        auto vector = malCast<MALVectorType>(ast);
+        Ref<MALVectorType> newList(new MALVectorType());
+        auto values = vector->toVector();
+        for (auto p = values.begin(); p != values.end(); p++) {
+            newList->push_back(EVAL(*p, env));
         }
         return newList;
         break;
     }
     case MALType::Types::HashMap: {
-        auto map = std::dynamic_pointer_cast<MALHashMapType>(ast);
-        for (auto p = map->values.begin(); p != map->values.end(); p++) {
-            map->values[p->first] = EVAL(p->second, env);
+        auto map = malCast<MALHashMapType>(ast);
+        Ref<MALHashMapType> newMap(new MALHashMapType());
+        auto entries = map->entries();
+        for (auto p = entries.begin(); p != entries.end(); p++) {
+            newMap->set(p->first, EVAL(p->second, env));
         }
-        return map;
+        return newMap;
         break;
     }
     default:
@@ -58,70 +68,125 @@ MALTypePtr eval_ast(MALTypePtr ast, EnvPtr env) {
     }
 }
 
-MALTypePtr EVAL(MALTypePtr ast, EnvPtr env) {
+// Hands the frame an EVAL ends in to Env::recycle when the EVAL returns or
+// throws.
+struct FrameRecycler {
+    EnvPtr& frame;
+    ~FrameRecycler() { Env::recycle(frame); }
+};
+
+// The arguments of the calls EVAL is making, those of a nested call above
+// those of the call it is an argument of.
+static std::vector<MALValue> arguments;
+
+// Drops the arguments a call pushed once they are bound, or when the call
+// throws.
+struct ArgumentsMark {
+    size_t height;
+    ~ArgumentsMark() { arguments.resize(this->height); }
+};
+
+MALValue EVAL(MALValue ast, EnvPtr env) {
     if (env == nullptr) {
         env = replEnv;
     }
     EnvPtr currentEnv = env;
-    MALTypePtr currentAst = ast;
+    FrameRecycler recycler{ currentEnv };
+    MALValue currentAst = ast;
     for (;;) {
-        if (currentAst->type() != MALType::Types::List) {
+        Collector::collectIfNeeded();
+        if (currentAst.type() != MALType::Types::List) {
             return eval_ast(currentAst, currentEnv);
         }
-        auto astAsList = std::dynamic_pointer_cast<MALListType>(currentAst);
-        if (astAsList->values.size() == 0) {
+        auto astAsList = currentAst.asList();
+        if (astAsList->size() == 0) {
             return currentAst;
         }
-        if (astAsList->values[0]->type() == MALType::Types::Symbol) {
-            std::shared_ptr<HandleSpecialFormResult> result = handleSpecialForms(astAsList, currentEnv);
-            if (result->tco) {
-                currentEnv = result->env;
-                currentAst = result->ast;
+        if (astAsList->getAt(0).type() == MALType::Types::Symbol) {
+            auto result = handleSpecialForms(astAsList, currentEnv);
+            if (result.tco) {
+                currentEnv = std::move(result.env);
+                currentAst = std::move(result.ast);
                 continue;
             }
-            if (result->ast != nullptr) {
-                return result->ast;
+            if (result.ast != nullptr) {
+                return result.ast;
             }
         }
 
-        auto evalList = std::dynamic_pointer_cast<MALListType>(eval_ast(astAsList, currentEnv));
-        if (evalList->values[0]->type() != MALType::Types::Function) {
-            throw std::runtime_error("Error: function not found with name '" + astAsList->values[0]->to_string(true) + "' in '" + astAsList->to_string(true) + "'");
+        auto head = EVAL(astAsList->getAt(0), currentEnv);
+        //the arguments go on the argument stack, from which a function call
+        //moves them into the slots of its frame
+        ArgumentsMark mark{ arguments.size() };
+        for (auto p = ++astAsList->begin(); p != astAsList->end(); p++) {
+            arguments.push_back(EVAL(*p, currentEnv));
+        }
+        if (head.type() != MALType::Types::Function) {
+            throw std::runtime_error("Error: function not found with name '" + astAsList->getAt(0).to_string(true) + "' in '" + astAsList->to_string(true) + "'");
         }
-        auto callable = std::dynamic_pointer_cast<MALCallableType>(evalList->values[0]);
+        auto callable = malCast<MALCallableType>(head);
         if (callable->type() != MALType::Types::Function) {
             return currentAst;
         }
 
-        //make args as a copy of the original MALTypes list
-        auto args = evalList->values;
-        args.erase(args.begin());
+        auto args = arguments.data() + mark.height;
+        auto argc = arguments.size() - mark.height;
         if (callable->isBuiltin()) {
-            auto builtinFunc = std::dynamic_pointer_cast<MALBuiltinFuncType>(evalList->values[0]);
-            return builtinFunc->fn(args, currentEnv);
+            return static_cast<MALBuiltinFuncType*>(callable.get())->call(args, argc, currentEnv);
         }
         else {
-            auto func = std::dynamic_pointer_cast<MALFuncType>(evalList->values[0]);
-            EnvPtr newEnv(new Env(func->env, func->bindingsList, args));
-            currentEnv = newEnv;
+            auto func = malCast<MALFuncType>(head);
+            if (func->code != nullptr) {
+                return VM::apply(func.get(), std::vector<MALValue>(std::make_move_iterator(args), std::make_move_iterator(args + argc)));
+            }
+            if (func->lambda != nullptr) {
+                return Analyzer::apply(func.get(), std::vector<MALValue>(std::make_move_iterator(args), std::make_move_iterator(args + argc)));
+            }
+            //nothing else holds the frame the tail call is made from: reuse it
+            if (currentEnv.useCount() == 1 && !currentEnv->isGlobal()) {
+                currentEnv->rebind(func->env, func->bindingsList, args, argc);
+            }
+            else {
+                currentEnv = Env::callFrame(func->env, func->bindingsList, args, argc);
+            }
             currentAst = func->funcBody;
             continue;
         }
     }
 }
 
-void PRINT(MALTypePtr result) {
-    if (result->type() == MALType::Types::String) {
-        std::cout << "\033[32m=> \"" << pr_str(result, true) << "\"\033[0m" << std::endl;
+void PRINT(MALValue result) {
+    std::string output = "\033[32m=> ";
+    if (result.type() == MALType::Types::String) {
+        output += '"';
+        pr_str(output, result, true);
+        output += '"';
     }
     else {
-        std::cout << "\033[32m=> " << pr_str(result, true) << "\033[0m" << std::endl;
+        pr_str(output, result, true);
     }
+    output += "\033[0m\n";
+    std::cout.write(output.data(), output.size());
+    std::cout.flush();
 }
 
-MALTypePtr readEval(std::string input, EnvPtr env) {
+MALValue evalTopLevel(MALValue ast, EnvPtr env) {
+    if (env == nullptr) {
+        env = replEnv;
+    }
+    switch (engine) {
+    case Engine::Analyzer:
+        return Analyzer::eval(ast, env);
+    case Engine::Bytecode:
+        return VM::eval(ast, env);
+    default:
+        return EVAL(ast, env);
+    }
+}
+
+MALValue readEval(std::string input, EnvPtr env) {
     auto ast = READ(input);
-    return EVAL(ast, env);
+    return evalTopLevel(ast, env);
 }
 
 void rep(std::string input, EnvPtr env) {
@@ -132,7 +197,7 @@ void rep(std::string input, EnvPtr env) {
         }
     }
     catch (MALException& e) {
-        std::cout << "\033[31mError: " << e.errorValue->to_string(true) << "\033[0m" << std::endl;
+        std::cout << "\033[31mError: " << e.errorValue.to_string(true) << "\033[0m" << std::endl;
     }
     catch (const std::exception& e) {
         std::cout << "\033[31mError:" << e.what() << "\033[0m" << std::endl;
@@ -151,17 +216,15 @@ void installBuiltInOps(EnvPtr env)
 {
     addBuiltInOperationsToEnv(env);
     readEval("(def! not (fn* (a) (if a false true)))", env);
-    readEval("(def! load-file (fn* (filename) \
-        (eval (read-string (str \"(do \" (slurp filename) \"\nnil)\")))))", env);
     readEval("(defmacro! cond (fn* (& xs) (if (> (count xs) 0) (list 'if (first xs) (if (> (count xs) 1) (nth xs 1) (throw \"odd number of forms to cond\")) (cons 'cond (rest (rest xs)))))))", env);
 }
 
 void installBuiltInSymbols(EnvPtr env, int argc, char* argv[])
 {
     MALListTypePtr astList(new MALListType());
-    env->set(std::shared_ptr<MALSymbolType>(new MALSymbolType("*ARGV*")), astList);
+    env->set(MALSymbolType::intern("*ARGV*"), astList);
     for (int i = 0; i < argc; i++) {
-        astList->values.push_back(std::shared_ptr<MALStringType>(new MALStringType(std::string(argv[i]))));
+        astList->push_back(Ref<MALStringType>(new MALStringType(std::string(argv[i]))));
     }
 }
 
@@ -185,11 +248,22 @@ int main(int argc, char* argv[]) {
     linenoise::LoadHistory(history_path);
     std::string input;
 
+    if (argc >= 2 && (std::string(argv[1]) == "--vm" || std::string(argv[1]) == "--analyze")) {
+        engine = std::string(argv[1]) == "--vm" ? Engine::Bytecode : Engine::Analyzer;
+        //the flag is not one of the script's arguments
+        argv[1] = argv[0];
+        argc--;
+        argv++;
+    }
     installBuiltInOps(replEnv);
     installBuiltInSymbols(replEnv, argc, argv);
 
     if (argc >= 2) {
         std::string fileName(argv[1]);
+        if (fileName == "-") {
+            evalStream(std::cin);
+            return 0;
+        }
         readEval("(load-file \"" + fileName + "\")", replEnv);
         return 0;
     }
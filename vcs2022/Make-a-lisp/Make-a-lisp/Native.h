@@ -0,0 +1,151 @@
+#pragma once
+#include <cstddef>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+#include "Type.h"
+#include "Env.h"
+#include "assert.h"
+
+// Builtins are defined with defnative, from a function or a lambda without
+// captures. Its parameters say what the builtin takes:
+//   double          a number
+//   MALValue        any value
+//   Ref<T>          a value of type T: a string, an atom, a hash map...
+//   NativeArgs      last parameter only: the arguments after the others
+//   const EnvPtr&   first parameter only: the environment of the call, which
+//                   takes no argument
+// and it returns a MALValue (or a Ref), a double or a bool. defnative keeps
+// the function pointer along with a thunk made for its signature, which
+// checks the number of arguments and their types, converts them and makes
+// the call: a builtin gets its arguments straight from the caller's argument
+// stack, with no std::function or vector in between.
+
+// The arguments a builtin taking NativeArgs gets after its other parameters.
+// They are on the caller's argument stack, which a nested evaluation can
+// move: a builtin that evaluates reads them first.
+class NativeArgs {
+public:
+	NativeArgs(MALValue* values, size_t count) : values(values), count(count) {}
+	MALValue* begin() const { return this->values; }
+	MALValue* end() const { return this->values + this->count; }
+	size_t size() const { return this->count; }
+	MALValue& operator[](size_t i) const { return this->values[i]; }
+private:
+	MALValue* values;
+	size_t count;
+};
+
+// Name of T in the error for an argument of another type.
+template<class T> struct NativeTypeName;
+template<> struct NativeTypeName<MALStringType> { static constexpr const char* name = "String"; };
+template<> struct NativeTypeName<MALAtomType> { static constexpr const char* name = "Atom"; };
+template<> struct NativeTypeName<MALHashMapType> { static constexpr const char* name = "HashMap"; };
+template<> struct NativeTypeName<MALCallableType> { static constexpr const char* name = "Function"; };
+template<> struct NativeTypeName<MALVectorType> { static constexpr const char* name = "Vector"; };
+
+// Converts an argument to the type of the parameter it is passed to. The
+// argument is moved from: the caller drops it after the call.
+template<class T> struct NativeParam;
+
+template<> struct NativeParam<MALValue> {
+	static MALValue from(MALValue& arg) { return std::move(arg); }
+};
+
+template<> struct NativeParam<double> {
+	static double from(MALValue& arg) {
+		if (arg.type() != MALType::Types::Number) {
+			assertMalType(arg, MALType::Types::Number);
+		}
+		return arg.asNumber();
+	}
+};
+
+template<class T> struct NativeParam<Ref<T>> {
+	static Ref<T> from(MALValue& arg) {
+		if (!arg.isHeap() || !isMALType<T>(arg.type(), arg.ptr().get())) {
+			throw std::runtime_error("ERROR: Expected '" + std::string(NativeTypeName<T>::name) + "', but found '" + MALType::typeToString(arg.type()) + "' in '" + arg.to_string(true) + "'");
+		}
+		return malCast<T>(arg);
+	}
+};
+
+template<class T> constexpr bool isNativeEnv = std::is_same<std::decay_t<T>, EnvPtr>::value;
+template<class T> constexpr bool isNativeRest = std::is_same<std::decay_t<T>, NativeArgs>::value;
+// Whether a parameter of type T takes an argument of its own.
+template<class T> constexpr bool takesNativeArg = !isNativeEnv<T> && !isNativeRest<T>;
+
+template<class R, class... Params>
+class NativeThunk {
+	using Target = R (*)(Params...);
+	static constexpr size_t fixedArgs = (size_t(0) + ... + (takesNativeArg<Params> ? 1 : 0));
+	static constexpr bool variadic = (false || ... || isNativeRest<Params>);
+
+	// Index of the argument of the I-th parameter: the number of parameters
+	// before it that take one.
+	template<size_t I>
+	static constexpr size_t argIndex() {
+		constexpr bool takes[] = { takesNativeArg<Params>..., false };
+		size_t index = 0;
+		for (size_t i = 0; i < I; i++) {
+			index += takes[i] ? 1 : 0;
+		}
+		return index;
+	}
+
+	template<class P, size_t Index>
+	static decltype(auto) param(MALValue* args, size_t argc, const EnvPtr& env) {
+		if constexpr (isNativeEnv<P>) {
+			return (env);
+		}
+		else if constexpr (isNativeRest<P>) {
+			return NativeArgs(args + Index, argc - Index);
+		}
+		else {
+			return NativeParam<std::decay_t<P>>::from(args[Index]);
+		}
+	}
+
+	template<size_t... I>
+	static MALValue invoke(Target target, MALValue* args, size_t argc, const EnvPtr& env, std::index_sequence<I...>) {
+		if constexpr (std::is_same<R, double>::value) {
+			return MALValue::number(target(param<Params, argIndex<I>()>(args, argc, env)...));
+		}
+		else if constexpr (std::is_same<R, bool>::value) {
+			return MALValue::boolean(target(param<Params, argIndex<I>()>(args, argc, env)...));
+		}
+		else {
+			return target(param<Params, argIndex<I>()>(args, argc, env)...);
+		}
+	}
+public:
+	static MALValue call(const MALBuiltinFuncType& builtin, MALValue* args, size_t argc, const EnvPtr& env) {
+		if (variadic ? argc < fixedArgs : argc != fixedArgs) {
+			if (variadic) {
+				checkArgsIsAtLeast(builtin.name, (int)fixedArgs, (int)argc);
+			}
+			checkArgsNumber(builtin.name, (int)fixedArgs, (int)argc);
+		}
+		return invoke(reinterpret_cast<Target>(builtin.target), args, argc, env, std::index_sequence_for<Params...>());
+	}
+};
+
+// A builtin of the core namespace, as made by defnative.
+struct NativeDefinition {
+	const char* name;
+	MALNativeTarget target;
+	MALNative thunk;
+};
+
+template<class R, class... Params>
+NativeDefinition defnative(const char* name, R (*target)(Params...))
+{
+	return NativeDefinition{ name, reinterpret_cast<MALNativeTarget>(target), &NativeThunk<R, Params...>::call };
+}
+
+template<class F>
+NativeDefinition defnative(const char* name, F target)
+{
+	return defnative(name, +target);
+}
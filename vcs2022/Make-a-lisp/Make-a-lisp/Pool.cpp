@@ -0,0 +1,90 @@
+#include "Pool.h"
+#include <new>
+
+static const size_t granularity = 16;
+static const size_t sizeClassCount = 16;
+// Requests above this size bypass the pool.
+static const size_t largestPooledSize = granularity * sizeClassCount;
+static const size_t slabSize = 16 * 1024;
+
+namespace {
+    struct FreeBlock {
+        FreeBlock* next;
+    };
+
+    struct ThreadPool {
+        FreeBlock* freeLists[sizeClassCount] = {};
+        Pool::Stats stats = {};
+    };
+}
+
+static thread_local ThreadPool threadPool;
+
+static size_t sizeClass(size_t size)
+{
+    return (size + granularity - 1) / granularity - 1;
+}
+
+// Carves a new slab into blocks of the given class and puts them on its free list.
+static void refill(ThreadPool& pool, size_t index)
+{
+    size_t blockSize = (index + 1) * granularity;
+    auto slab = static_cast<char*>(::operator new(slabSize));
+    pool.stats.retainedBytes += slabSize;
+    FreeBlock* head = pool.freeLists[index];
+    //push from the end, so blocks are handed out in address order
+    for (size_t offset = slabSize / blockSize * blockSize; offset > 0; offset -= blockSize) {
+        auto block = reinterpret_cast<FreeBlock*>(slab + offset - blockSize);
+        block->next = head;
+        head = block;
+    }
+    pool.freeLists[index] = head;
+}
+
+void* Pool::allocate(size_t size)
+{
+    ThreadPool& pool = threadPool;
+    pool.stats.liveBytes += size;
+#ifdef MAL_SYSTEM_ALLOCATOR
+    return ::operator new(size);
+#else
+    if (size == 0 || size > largestPooledSize) {
+        pool.stats.misses++;
+        return ::operator new(size);
+    }
+    auto index = sizeClass(size);
+    if (pool.freeLists[index] == nullptr) {
+        pool.stats.misses++;
+        refill(pool, index);
+    }
+    else {
+        pool.stats.hits++;
+    }
+    FreeBlock* block = pool.freeLists[index];
+    pool.freeLists[index] = block->next;
+    return block;
+#endif
+}
+
+void Pool::deallocate(void* memory, size_t size)
+{
+    ThreadPool& pool = threadPool;
+    pool.stats.liveBytes -= size;
+#ifdef MAL_SYSTEM_ALLOCATOR
+    ::operator delete(memory);
+#else
+    if (size == 0 || size > largestPooledSize) {
+        ::operator delete(memory);
+        return;
+    }
+    auto index = sizeClass(size);
+    auto block = static_cast<FreeBlock*>(memory);
+    block->next = pool.freeLists[index];
+    pool.freeLists[index] = block;
+#endif
+}
+
+Pool::Stats Pool::stats()
+{
+    return threadPool.stats;
+}
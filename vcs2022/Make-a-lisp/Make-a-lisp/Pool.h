@@ -0,0 +1,50 @@
+#pragma once
+#include <cstddef>
+
+// Thread-local pool for the small objects the evaluator keeps creating and
+// destroying: values, environments and special form results. Requests are
+// rounded up to a 16 byte size class; each class keeps a free list that is
+// refilled a slab at a time, so steady-state allocation never reaches malloc.
+// Slabs are kept for the life of the process.
+//
+// Define MAL_SYSTEM_ALLOCATOR to send every allocation straight to operator
+// new instead (this also turns off the reader's arena), so that sanitizers
+// and heap profilers see each object.
+class Pool
+{
+public:
+	static void* allocate(size_t size);
+	// size must be the one given to allocate.
+	static void deallocate(void* memory, size_t size);
+
+	struct Stats {
+		// Allocations served from a free list.
+		size_t hits;
+		// Allocations that had to go to operator new: slab refills and
+		// objects too big for any size class.
+		size_t misses;
+		// Bytes held in slabs, whether in use or free.
+		size_t retainedBytes;
+		// Bytes handed out and not yet given back, pooled or not.
+		size_t liveBytes;
+	};
+	// Counters of the calling thread.
+	static Stats stats();
+};
+
+// Standard allocator over the Pool, for containers and shared_ptr control
+// blocks.
+template<class T>
+struct PoolAllocator
+{
+	using value_type = T;
+	PoolAllocator() = default;
+	template<class U>
+	PoolAllocator(const PoolAllocator<U>&) {}
+	T* allocate(size_t count) { return static_cast<T*>(Pool::allocate(count * sizeof(T))); }
+	void deallocate(T* memory, size_t count) { Pool::deallocate(memory, count * sizeof(T)); }
+	template<class U>
+	bool operator==(const PoolAllocator<U>&) const { return true; }
+	template<class U>
+	bool operator!=(const PoolAllocator<U>&) const { return false; }
+};
@@ -1,5 +1,6 @@
 #include "Reader.h"
 #include <stdexcept>
+#include <charconv>
 
 void replaceAll(std::string& input, std::string match, std::string replaceWith) {
     int i = 0;
@@ -33,32 +34,209 @@ bool Reader::isEOF()
     return this->tokenIndex >= this->tokens.size();
 }
 
-MALTypePtr read_str(std::string& input)
+MALValue read_str(std::string& input)
 {
     auto reader = Reader();
     tokenize(input, reader);
+    ReadArena arena;
     return read_form(reader);
 }
 
-void tokenize(std::string& input, Reader& reader)
+static bool isWhitespace(char c)
 {
-    //token regexp [\s,\n]*(~@|[\[\]{}()'`~^@]|"(?:\\.|[^\\"])*"?|;.*|[^\s\[\]{}('"`,;)]*)
-    std::regex word_regex("[\\s,]*(~@|[\\[\\]{}()'`~^@]|\"(?:\\\\.|[^\\\\\"])*\"?|;.*|[^\\s\\[\\]{}('\"`,;)]*)");
-    auto words_begin = std::sregex_iterator(input.begin(), input.end(), word_regex);
-    auto words_end = std::sregex_iterator();
-    for (std::sregex_iterator i = words_begin; i != words_end; ++i) {
-        std::smatch match = *i;
-        std::string match_str = match[1];
-        if (match_str.length() > 0 && match_str[0] != ';') {
-            reader.tokens.push_back(match_str);
+    return c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' || c == '\r' || c == ',';
+}
+
+static bool isLineEnd(char c)
+{
+    return c == '\n' || c == '\r';
+}
+
+static bool isSpecialChar(char c)
+{
+    switch (c) {
+    case '[': case ']': case '{': case '}': case '(': case ')':
+    case '\'': case '`': case '~': case '^': case '@':
+        return true;
+    default:
+        return false;
+    }
+}
+
+static bool isAtomChar(char c)
+{
+    switch (c) {
+    case '[': case ']': case '{': case '}': case '(': case ')':
+    case '\'': case '"': case '`': case ';':
+        return false;
+    default:
+        return !isWhitespace(c);
+    }
+}
+
+void tokenize(const std::string& input, Reader& reader)
+{
+    //Single pass over the same grammar as the token regexp
+    //[\s,]*(~@|[\[\]{}()'`~^@]|"(?:\\.|[^\\"])*"?|;.*|[^\s\[\]{}('"`,;)]*)
+    const char* text = input.data();
+    const size_t size = input.size();
+    size_t i = 0;
+    while (i < size) {
+        char c = text[i];
+        if (isWhitespace(c)) {
+            i++;
+            continue;
+        }
+        size_t start = i;
+        if (c == '~' && i + 1 < size && text[i + 1] == '@') {
+            i += 2;
+        }
+        else if (isSpecialChar(c)) {
+            i++;
+        }
+        else if (c == '"') {
+            i++;
+            while (i < size && text[i] != '"') {
+                if (text[i] == '\\') {
+                    if (i + 1 >= size || isLineEnd(text[i + 1])) {
+                        break;
+                    }
+                    i++;
+                }
+                i++;
+            }
+            if (i < size && text[i] == '"') {
+                i++;
+            }
+        }
+        else if (c == ';') {
+            while (i < size && !isLineEnd(text[i])) {
+                i++;
+            }
+            continue;
+        }
+        else {
+            while (i < size && isAtomChar(text[i])) {
+                i++;
+            }
+        }
+        reader.tokens.push_back(Token(text + start, i - start));
+    }
+}
+
+void StreamReader::skipWhitespaceAndComments()
+{
+    for (;;) {
+        int c = this->input->sgetc();
+        if (c == EOF) {
+            return;
+        }
+        if (c == ';') {
+            while (c != EOF && !isLineEnd((char)c)) {
+                c = this->input->snextc();
+            }
+        }
+        else if (isWhitespace((char)c)) {
+            this->input->sbumpc();
+        }
+        else {
+            return;
+        }
+    }
+}
+
+void StreamReader::readString()
+{
+    this->formText += (char)this->input->sbumpc();
+    for (;;) {
+        int c = this->input->sgetc();
+        if (c == EOF) {
+            return;
+        }
+        this->formText += (char)this->input->sbumpc();
+        if (c == '"') {
+            return;
+        }
+        if (c == '\\') {
+            int escaped = this->input->sgetc();
+            if (escaped == EOF || isLineEnd((char)escaped)) {
+                return;
+            }
+            this->formText += (char)this->input->sbumpc();
         }
     }
 }
 
-MALTypePtr read_form(Reader& reader)
+void StreamReader::readAtom()
+{
+    int c = this->input->sgetc();
+    while (c != EOF && isAtomChar((char)c)) {
+        this->formText += (char)c;
+        c = this->input->snextc();
+    }
+}
+
+void StreamReader::readForm()
+{
+    //Reader macros ('x `x ~x ~@x @x) are followed by the form they apply to.
+    for (;;) {
+        this->skipWhitespaceAndComments();
+        int c = this->input->sgetc();
+        if (c != '\'' && c != '`' && c != '~' && c != '@') {
+            break;
+        }
+        this->formText += (char)this->input->sbumpc();
+        if (c == '~' && this->input->sgetc() == '@') {
+            this->formText += (char)this->input->sbumpc();
+        }
+        this->formText += ' ';
+    }
+
+    int depth = 0;
+    do {
+        this->skipWhitespaceAndComments();
+        int c = this->input->sgetc();
+        if (c == EOF) {
+            return; //read_form reports the unbalanced input
+        }
+        if (c == '"') {
+            this->readString();
+        }
+        else if (isSpecialChar((char)c)) {
+            this->formText += (char)this->input->sbumpc();
+            if (c == '~' && this->input->sgetc() == '@') {
+                this->formText += (char)this->input->sbumpc();
+            }
+            else if (c == '(' || c == '[' || c == '{') {
+                depth++;
+            }
+            else if (c == ')' || c == ']' || c == '}') {
+                depth--;
+            }
+        }
+        else {
+            this->readAtom();
+        }
+        this->formText += ' ';
+    } while (depth > 0);
+}
+
+bool StreamReader::next(MALValue& form)
+{
+    this->skipWhitespaceAndComments();
+    if (this->input->sgetc() == EOF) {
+        return false;
+    }
+    this->formText.clear();
+    this->readForm();
+    form = read_str(this->formText);
+    return true;
+}
+
+MALValue read_form(Reader& reader)
 {
     if (reader.tokens.size() <= 0) {
-        return MALNilType::Nil;
+        return MALValue::nil();
     }
     auto token = reader.peek();
     switch (token[0])
@@ -81,9 +259,9 @@ MALTypePtr read_form(Reader& reader)
     }
 }
 
-MALTypePtr read_list(Reader& reader)
+MALValue read_list(Reader& reader)
 {
-    auto malList = std::shared_ptr<MALListType>(new MALListType());
+    auto malList = Ref<MALListType>(new MALListType());
     reader.next();
     for (;;) {
         Token token;
@@ -100,7 +278,7 @@ MALTypePtr read_list(Reader& reader)
             return malList;
             break;
         default:
-            malList->values.push_back(read_form(reader));
+            malList->push_back(read_form(reader));
             break;
         }
     }
@@ -108,10 +286,10 @@ MALTypePtr read_list(Reader& reader)
     return nullptr;
 }
 
-MALTypePtr read_vector(Reader& reader)
+MALValue read_vector(Reader& reader)
 {
-    auto malVector = std::shared_ptr<MALVectorType>(new MALVectorType());
-    //auto malVector = std::shared_ptr<MALListType>(new MALListType());
+    auto malVector = Ref<MALVectorType>(new MALVectorType());
+    //auto malVector = Ref<MALListType>(new MALListType());
     //malVector->isVector = true;
     reader.next();
     for (;;) {
@@ -129,7 +307,7 @@ MALTypePtr read_vector(Reader& reader)
             return malVector;
             break;
         default:
-            malVector->values.push_back(read_form(reader));
+            malVector->push_back(read_form(reader));
             break;
         }
     }
@@ -137,27 +315,26 @@ MALTypePtr read_vector(Reader& reader)
     return nullptr;
 }
 
-std::shared_ptr<MALHashMapType> vectorToMalMap(std::vector<MALTypePtr>& hashMapInitializer) {
+Ref<MALHashMapType> vectorToMalMap(std::vector<MALValue>& hashMapInitializer) {
     if (hashMapInitializer.size() % 2 != 0) {
         throw std::runtime_error("Error parsing: Odd number of keys. Mssing last value.");
     }
 
-    auto malMap = std::shared_ptr<MALHashMapType>(new MALHashMapType());
+    auto malMap = Ref<MALHashMapType>(new MALHashMapType());
     for (int i = 0; i < hashMapInitializer.size(); i += 2) {
-        if (hashMapInitializer[i]->isContainer()) {
+        if (hashMapInitializer[i].isContainer()) {
             throw std::runtime_error("Error parsing HashMap: Keys can't be of conpound type.");
         }
         auto key = hashMapInitializer[i];
         auto value = hashMapInitializer[i+1];
-        malMap->values.erase(key);
-        malMap->values.insert(std::pair<MALTypePtr, MALTypePtr>(key, value));
+        malMap->set(key, value);
     }
     return malMap;
 }
 
-MALTypePtr read_map(Reader& reader)
+MALValue read_map(Reader& reader)
 {
-    auto malVector = std::shared_ptr<MALVectorType>(new MALVectorType());
+    std::vector<MALValue> hashMapInitializer;
     reader.next();
     for (;;) {
         Token token;
@@ -171,10 +348,10 @@ MALTypePtr read_map(Reader& reader)
         {
         case '}':
             reader.next();
-            return vectorToMalMap(malVector->values);
+            return vectorToMalMap(hashMapInitializer);
             break;
         default:
-            malVector->values.push_back(read_form(reader));
+            hashMapInitializer.push_back(read_form(reader));
             break;
         }
     }
@@ -182,76 +359,115 @@ MALTypePtr read_map(Reader& reader)
     return nullptr;
 }
 
-MALTypePtr read_deref_shortcut(Reader& reader)
+MALValue read_deref_shortcut(Reader& reader)
 {
-    auto malVector = std::shared_ptr<MALVectorType>(new MALVectorType());
     reader.next();
-    std::string token = reader.next();
+    auto token = reader.next();
     MALListTypePtr ast(new MALListType());
-    ast->values.push_back(MALSymbolTypePtr(new MALSymbolType("deref")));
-    ast->values.push_back(MALSymbolTypePtr(new MALSymbolType(token)));
+    ast->push_back(MALSymbolType::intern("deref"));
+    ast->push_back(MALSymbolType::intern(token));
     return ast;
 }
 
-MALTypePtr read_atom(Reader& reader)
+static bool isDigit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+// Matches -?[0-9]+(.[0-9]+)? and converts it without allocating.
+static bool parseNumber(Token token, double& result)
+{
+    size_t i = 0;
+    if (i < token.size() && token[i] == '-') {
+        i++;
+    }
+    size_t intStart = i;
+    while (i < token.size() && isDigit(token[i])) {
+        i++;
+    }
+    if (i == intStart) {
+        return false;
+    }
+    if (i < token.size() && token[i] == '.') {
+        size_t fracStart = ++i;
+        while (i < token.size() && isDigit(token[i])) {
+            i++;
+        }
+        if (i == fracStart) {
+            return false;
+        }
+    }
+    if (i != token.size()) {
+        return false;
+    }
+    auto end = token.data() + token.size();
+    return std::from_chars(token.data(), end, result).ptr == end;
+}
+
+MALValue read_atom(Reader& reader)
 {
     auto token = reader.next();
 
-    std::regex intRegex("^[-]?[0-9]+(.[0-9]+)?$", std::regex_constants::ECMAScript);
-    if (std::regex_search(token, intRegex)) {
-        return std::shared_ptr<MALNumberType>(new MALNumberType(stod(token)));
+    double number;
+    if (parseNumber(token, number)) {
+        return MALValue::number(number);
     }
     else if (token[0] == '"') {
         token = token.substr(1, token.size() - 2);
-        return std::shared_ptr<MALStringType>(new MALStringType(token));
+        return Ref<MALStringType>(new MALStringType(std::string(token)));
     }
     else if (token[0] == ':') {
-        return std::shared_ptr<MalKeywordType>(new MalKeywordType(token.substr(1)));
+        return MalKeywordType::intern(token.substr(1));
     }
 
     else if (token[0] == '\'') {
         auto result = MALListTypePtr(new MALListType);
-        result->values.push_back(MALSymbolTypePtr(new MALSymbolType("quote")));
-        result->values.push_back(read_form(reader));
+        result->push_back(MALSymbolType::intern("quote"));
+        result->push_back(read_form(reader));
         return result;
     }
     else if (token[0] == '`') {
         auto result = MALListTypePtr(new MALListType);
-        result->values.push_back(MALSymbolTypePtr(new MALSymbolType("quasiquote")));
-        result->values.push_back(read_form(reader));
+        result->push_back(MALSymbolType::intern("quasiquote"));
+        result->push_back(read_form(reader));
         return result;
     }
     else if (token[0] == '~') {
         if (token == "~@") {
             auto result = MALListTypePtr(new MALListType);
-            result->values.push_back(MALSymbolTypePtr(new MALSymbolType("splice-unquote")));
-            result->values.push_back(read_form(reader));
+            result->push_back(MALSymbolType::intern("splice-unquote"));
+            result->push_back(read_form(reader));
             return result;
         }
         else {
             auto result = MALListTypePtr(new MALListType);
-            result->values.push_back(MALSymbolTypePtr(new MALSymbolType("unquote")));
-            result->values.push_back(read_form(reader));
+            result->push_back(MALSymbolType::intern("unquote"));
+            result->push_back(read_form(reader));
             return result;
         }
     }
 
     else if (token == "true") {
-        return std::shared_ptr<MALBoolType>(new MALBoolType(true));
+        return MALValue::boolean(true);
     }
     else if (token == "false") {
-        return std::shared_ptr<MALBoolType>(new MALBoolType(false));
+        return MALValue::boolean(false);
     }
     else if (token == "nil") {
-        return MALNilType::Nil;
+        return MALValue::nil();
     }
     else {
-        return std::shared_ptr<MALSymbolType>(new MALSymbolType(token));
+        return MALSymbolType::intern(token);
     }
     return nullptr;
 }
 
-std::string pr_str(MALTypePtr malType, bool print_readably)
+std::string pr_str(MALValue malType, bool print_readably)
+{
+    return malType.to_string(print_readably);
+}
+
+void pr_str(std::string& out, const MALValue& malType, bool print_readably)
 {
-    return malType->to_string(print_readably);
+    malType.print(out, print_readably);
 }
@@ -4,14 +4,16 @@
 #include <fstream>
 #include <vector>
 #include <regex>
+#include <string_view>
 
 #include "Type.h"
 
-using Token = std::string;
+// Tokens are slices of the text handed to tokenize(), which must outlive the Reader.
+using Token = std::string_view;
 
 class Reader
 {
-    int tokenIndex = 0;
+    size_t tokenIndex = 0;
 public:
     std::vector<Token> tokens;
     Token next();
@@ -19,13 +21,31 @@ public:
     bool isEOF();
 };
 
+// Pulls one top-level form at a time out of a stream, so only the text of the
+// form being read is held in memory.
+class StreamReader
+{
+    std::streambuf* input;
+    std::string formText;
+    void skipWhitespaceAndComments();
+    void readString();
+    void readAtom();
+    void readForm();
+public:
+    StreamReader(std::istream& input) : input(input.rdbuf()) {}
+    // Reads the next top-level form into 'form'. Returns false once the input is exhausted.
+    bool next(MALValue& form);
+};
+
 
-MALTypePtr read_str(std::string& input);
-void tokenize(std::string& input, Reader& reader);
-MALTypePtr read_form(Reader& reader);
-MALTypePtr read_list(Reader& reader);
-MALTypePtr read_vector(Reader& reader);
-MALTypePtr read_map(Reader& reader);
-MALTypePtr read_deref_shortcut(Reader& reader);
-MALTypePtr read_atom(Reader& reader);
-std::string pr_str(MALTypePtr malType, bool print_readably);
+MALValue read_str(std::string& input);
+void tokenize(const std::string& input, Reader& reader);
+MALValue read_form(Reader& reader);
+MALValue read_list(Reader& reader);
+MALValue read_vector(Reader& reader);
+MALValue read_map(Reader& reader);
+MALValue read_deref_shortcut(Reader& reader);
+MALValue read_atom(Reader& reader);
+std::string pr_str(MALValue malType, bool print_readably);
+// Prints into out instead of returning a new string.
+void pr_str(std::string& out, const MALValue& malType, bool print_readably);
@@ -0,0 +1,90 @@
+#pragma once
+#include <cstddef>
+#include <utility>
+#include <atomic>
+
+#include "Arena.h"
+
+// The interpreter runs on a single thread, so reference counts are plain
+// integers. Define MAL_ATOMIC_REFCOUNT to share values between threads.
+#ifdef MAL_ATOMIC_REFCOUNT
+using RefCount = std::atomic<unsigned int>;
+#else
+using RefCount = unsigned int;
+#endif
+
+// Base for heap objects owned through Ref<T>. The count lives in the object
+// itself, so there is no separate control block and a Ref can be rebuilt
+// from a plain `this` pointer.
+class RefCounted
+{
+	template<class T> friend class Ref;
+	friend class Collector;
+	mutable RefCount refCount = 0;
+protected:
+	RefCounted() = default;
+	RefCounted(const RefCounted&) {}
+	RefCounted& operator=(const RefCounted&) { return *this; }
+	~RefCounted() = default;
+public:
+	// Placed in the active ReadArena while the reader runs, in the Pool
+	// otherwise.
+	static void* operator new(size_t size) { return ReadArena::allocate(size); }
+	static void operator delete(void* object, size_t size) { ReadArena::deallocate(object, size); }
+};
+
+// Intrusive reference counted handle: a single pointer, shared_ptr-like API.
+template<class T>
+class Ref
+{
+	template<class U> friend class Ref;
+	T* object;
+
+	void retain() const {
+		if (object != nullptr) {
+			object->refCount++;
+		}
+	}
+	void release() const {
+		if (object != nullptr && --object->refCount == 0) {
+			delete object;
+		}
+	}
+public:
+	Ref() : object(nullptr) {}
+	Ref(std::nullptr_t) : object(nullptr) {}
+	Ref(T* object) : object(object) { retain(); }
+	Ref(const Ref& other) : object(other.object) { retain(); }
+	Ref(Ref&& other) noexcept : object(other.object) { other.object = nullptr; }
+	template<class U>
+	Ref(const Ref<U>& other) : object(other.object) { retain(); }
+	template<class U>
+	Ref(Ref<U>&& other) noexcept : object(other.object) { other.object = nullptr; }
+	~Ref() { release(); }
+
+	// The old object is released last, when the temporary goes away: it may
+	// own the one being assigned.
+	Ref& operator=(const Ref& other) {
+		Ref copy(other);
+		std::swap(object, copy.object);
+		return *this;
+	}
+	Ref& operator=(Ref&& other) noexcept {
+		Ref moved(std::move(other));
+		std::swap(object, moved.object);
+		return *this;
+	}
+
+	T* get() const { return object; }
+	unsigned int useCount() const { return object != nullptr ? (unsigned int)object->refCount : 0; }
+	T* operator->() const { return object; }
+	T& operator*() const { return *object; }
+	explicit operator bool() const { return object != nullptr; }
+
+	template<class U>
+	bool operator==(const Ref<U>& other) const { return object == other.object; }
+	template<class U>
+	bool operator!=(const Ref<U>& other) const { return object != other.object; }
+	bool operator==(std::nullptr_t) const { return object == nullptr; }
+	bool operator!=(std::nullptr_t) const { return object != nullptr; }
+};
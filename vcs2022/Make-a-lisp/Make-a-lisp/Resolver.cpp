@@ -0,0 +1,255 @@
+#include "Resolver.h"
+#include "Scope.h"
+
+static const MALSymbolTypePtr defBangSymbol = MALSymbolType::intern("def!");
+static const MALSymbolTypePtr letStarSymbol = MALSymbolType::intern("let*");
+static const MALSymbolTypePtr doSymbol = MALSymbolType::intern("do");
+static const MALSymbolTypePtr ifSymbol = MALSymbolType::intern("if");
+static const MALSymbolTypePtr fnStarSymbol = MALSymbolType::intern("fn*");
+static const MALSymbolTypePtr quoteSymbol = MALSymbolType::intern("quote");
+static const MALSymbolTypePtr quasiquoteSymbol = MALSymbolType::intern("quasiquote");
+static const MALSymbolTypePtr quasiquoteExpandSymbol = MALSymbolType::intern("quasiquoteexpand");
+static const MALSymbolTypePtr defMacroSymbol = MALSymbolType::intern("defmacro!");
+static const MALSymbolTypePtr macroexpandSymbol = MALSymbolType::intern("macroexpand");
+static const MALSymbolTypePtr tryStarSymbol = MALSymbolType::intern("try*");
+static const MALSymbolTypePtr unquoteSymbol = MALSymbolType::intern("unquote");
+static const MALSymbolTypePtr spliceUnquoteSymbol = MALSymbolType::intern("splice-unquote");
+
+namespace {
+    // A frame the analysed code will run in.
+    struct Frame {
+        const Frame* outer;
+        // The list the frame is built from.
+        Ref<MALSequenceType> names;
+        // Set for a catch* frame, a table frame binding only this name.
+        MALSymbolType* catchName;
+    };
+
+    class Resolver
+    {
+        EnvPtr globalEnv;
+
+        MALValue resolveSymbol(const MALSymbolTypePtr& symbol, const Frame* scope);
+        MALValue resolveHead(const MALListTypePtr& form, const Frame* scope);
+        MALValue withResolvedHead(const MALListTypePtr& form, const Frame* scope);
+        bool resolvesToGlobal(MALSymbolType* symbol, const Frame* scope);
+        bool isMacro(MALSymbolType* symbol);
+        MALValue resolveList(const MALListTypePtr& list, const Frame* scope);
+        MALValue resolveTemplate(const MALValue& ast, const Frame* scope);
+        MALValue resolveClosure(const MALListTypePtr& form, const Frame* scope);
+        MALValue resolveTry(const MALListTypePtr& form, const Frame* scope);
+    public:
+        Resolver(EnvPtr globalEnv) : globalEnv(std::move(globalEnv)) {}
+        MALValue resolve(const MALValue& ast, const Frame* scope);
+        MALValue resolveLet(const MALListTypePtr& form, const Frame* scope);
+    };
+}
+
+MALValue Resolver::resolveSymbol(const MALSymbolTypePtr& symbol, const Frame* scope)
+{
+    auto name = symbol->canonical;
+    unsigned int depth = 0;
+    for (; scope != nullptr; scope = scope->outer, depth++) {
+        if (scope->catchName != nullptr) {
+            if (scope->catchName == name) {
+                break;
+            }
+            continue;
+        }
+        //a slot still empty when the reference is evaluated, as for a name
+        //bound later in the same let*, is looked up by name
+        for (size_t slot = scope->names->size(); slot-- > 0;) {
+            MALSymbolTypePtr bound;
+            if (scope->names->getAt(slot).tryAsSymbol(bound) && bound->canonical == name) {
+                return Ref<MALResolvedSymbolType>(new MALResolvedSymbolType(MALSymbolTypePtr(name), depth, (unsigned int)slot, scope->names));
+            }
+        }
+    }
+    if (scope != nullptr) {
+        return MALSymbolTypePtr(name);
+    }
+    return Ref<MALResolvedSymbolType>(new MALResolvedSymbolType(MALSymbolTypePtr(name), depth, 0, nullptr));
+}
+
+// The head symbol of a form is resolved like any other, for the evaluator to
+// know where its binding is when it checks for a macro; special forms are
+// recognised by the interned symbol the reference is to.
+MALValue Resolver::resolveHead(const MALListTypePtr& form, const Frame* scope)
+{
+    return this->resolveSymbol(form->getAt(0).asSymbol(), scope);
+}
+
+// The form with only its head resolved.
+MALValue Resolver::withResolvedHead(const MALListTypePtr& form, const Frame* scope)
+{
+    auto values = form->toVector();
+    values[0] = this->resolveHead(form, scope);
+    return Ref<MALListType>(new MALListType(std::move(values)));
+}
+
+bool Resolver::resolvesToGlobal(MALSymbolType* symbol, const Frame* scope)
+{
+    auto resolved = this->resolveSymbol(MALSymbolTypePtr(symbol), scope).asSymbol();
+    return resolved->isResolved() && static_cast<MALResolvedSymbolType*>(resolved.get())->isGlobal();
+}
+
+// Only macros defined by the time the code is analysed are known.
+bool Resolver::isMacro(MALSymbolType* symbol)
+{
+    auto value = this->globalEnv->find(MALSymbolTypePtr(symbol));
+    Ref<MALCallableType> callable;
+    return value != nullptr && value.tryAsCallable(callable) && callable->is_macro;
+}
+
+MALValue Resolver::resolve(const MALValue& ast, const Frame* scope)
+{
+    switch (ast.type()) {
+    case MALType::Types::Symbol:
+        return this->resolveSymbol(ast.asSymbol(), scope);
+    case MALType::Types::List:
+        return this->resolveList(ast.asList(), scope);
+    case MALType::Types::Vector: {
+        auto vector = malCast<MALVectorType>(ast);
+        Ref<MALVectorType> result(new MALVectorType());
+        for (size_t i = 0; i < vector->size(); i++) {
+            result->push_back(this->resolve(vector->getAt(i), scope));
+        }
+        return result;
+    }
+    case MALType::Types::HashMap: {
+        auto map = malCast<MALHashMapType>(ast);
+        Ref<MALHashMapType> result(new MALHashMapType());
+        for (auto& entry : map->entries()) {
+            result->set(entry.first, this->resolve(entry.second, scope));
+        }
+        return result;
+    }
+    default:
+        return ast;
+    }
+}
+
+MALValue Resolver::resolveList(const MALListTypePtr& list, const Frame* scope)
+{
+    if (list->size() == 0) {
+        return list;
+    }
+    MALSymbolTypePtr head;
+    if (list->getAt(0).tryAsSymbol(head)) {
+        auto name = head->canonical;
+        if (name == quoteSymbol.get() || name == quasiquoteExpandSymbol.get() || name == macroexpandSymbol.get()) {
+            return this->withResolvedHead(list, scope);
+        }
+        if (name == quasiquoteSymbol.get() && list->size() == 2) {
+            return Ref<MALListType>(new MALListType({ this->resolveHead(list, scope), this->resolveTemplate(list->getAt(1), scope) }));
+        }
+        if ((name == defBangSymbol.get() || name == defMacroSymbol.get()) && list->size() == 3) {
+            return Ref<MALListType>(new MALListType({ this->resolveHead(list, scope), list->getAt(1), this->resolve(list->getAt(2), scope) }));
+        }
+        if (name == letStarSymbol.get()) {
+            return this->resolveLet(list, scope);
+        }
+        if (name == fnStarSymbol.get()) {
+            return this->resolveClosure(list, scope);
+        }
+        if (name == tryStarSymbol.get()) {
+            return this->resolveTry(list, scope);
+        }
+        //the arguments of a macro call are left as they are
+        if (this->isMacro(name) && this->resolvesToGlobal(name, scope)) {
+            return this->withResolvedHead(list, scope);
+        }
+    }
+    std::vector<MALValue> values;
+    values.reserve(list->size());
+    for (auto& element : *list) {
+        values.push_back(this->resolve(element, scope));
+    }
+    return Ref<MALListType>(new MALListType(std::move(values)));
+}
+
+// Only the unquoted parts of a quasiquote template are evaluated.
+MALValue Resolver::resolveTemplate(const MALValue& ast, const Frame* scope)
+{
+    if (ast.type() == MALType::Types::List) {
+        auto list = ast.asList();
+        MALSymbolTypePtr head;
+        if (list->size() == 2 && list->getAt(0).tryAsSymbol(head) && (head == unquoteSymbol || head == spliceUnquoteSymbol)) {
+            return Ref<MALListType>(new MALListType({ list->getAt(0), this->resolve(list->getAt(1), scope) }));
+        }
+        std::vector<MALValue> values;
+        values.reserve(list->size());
+        for (auto& element : *list) {
+            values.push_back(this->resolveTemplate(element, scope));
+        }
+        return Ref<MALListType>(new MALListType(std::move(values)));
+    }
+    if (ast.type() == MALType::Types::Vector) {
+        auto vector = malCast<MALVectorType>(ast);
+        Ref<MALVectorType> result(new MALVectorType());
+        for (size_t i = 0; i < vector->size(); i++) {
+            result->push_back(this->resolveTemplate(vector->getAt(i), scope));
+        }
+        return result;
+    }
+    return ast;
+}
+
+// Malformed forms are returned as they are, for the evaluator to report.
+MALValue Resolver::resolveClosure(const MALListTypePtr& form, const Frame* scope)
+{
+    Ref<MALSequenceType> params;
+    if (form->size() != 3 || !form->getAt(1).tryAsSequence(params)) {
+        return form;
+    }
+    for (size_t i = 0; i < params->size(); i++) {
+        if (params->getAt(i).type() != MALType::Types::Symbol) {
+            return form;
+        }
+    }
+    Frame closureScope{ scope, params, nullptr };
+    return Ref<MALListType>(new MALListType({ this->resolveHead(form, scope), form->getAt(1), this->resolve(form->getAt(2), &closureScope) }));
+}
+
+MALValue Resolver::resolveLet(const MALListTypePtr& form, const Frame* scope)
+{
+    LetBindings let;
+    if (!let.read(form)) {
+        return form;
+    }
+    if (isMALType<MALLetBindingsType>(let.bindings->type(), let.bindings.get())) {
+        return form; //already resolved
+    }
+    Frame letScope{ scope, let.names, nullptr };
+    std::vector<MALValue> resolvedBindings;
+    resolvedBindings.reserve(let.bindings->size());
+    for (size_t i = 0; i < let.bindings->size(); i += 2) {
+        resolvedBindings.push_back(let.bindings->getAt(i));
+        resolvedBindings.push_back(this->resolve(let.bindings->getAt(i + 1), &letScope));
+    }
+    Ref<MALListType> resolvedBindingList(new MALLetBindingsType(std::move(resolvedBindings), let.names, std::move(let.bindingSlots)));
+    return Ref<MALListType>(new MALListType({ this->resolveHead(form, scope), resolvedBindingList, this->resolve(form->getAt(2), &letScope) }));
+}
+
+MALValue Resolver::resolveTry(const MALListTypePtr& form, const Frame* scope)
+{
+    CatchClause clause;
+    if (!clause.read(form)) {
+        return form;
+    }
+    Frame catchScope{ scope, nullptr, clause.name };
+    auto& catchForm = clause.form;
+    MALListTypePtr resolvedCatch(new MALListType({ catchForm->getAt(0), catchForm->getAt(1), this->resolve(catchForm->getAt(2), &catchScope) }));
+    return Ref<MALListType>(new MALListType({ this->resolveHead(form, scope), this->resolve(form->getAt(1), scope), resolvedCatch }));
+}
+
+MALValue resolveClosureBody(const Ref<MALSequenceType>& params, const MALValue& body, const EnvPtr& globalEnv)
+{
+    Frame closureScope{ nullptr, params, nullptr };
+    return Resolver(globalEnv).resolve(body, &closureScope);
+}
+
+MALListTypePtr resolveLetStar(const MALListTypePtr& form, const EnvPtr& globalEnv)
+{
+    return Resolver(globalEnv).resolveLet(form, nullptr).asList();
+}
@@ -0,0 +1,35 @@
+#pragma once
+#include "Type.h"
+#include "Env.h"
+
+// Lexical addressing. When a fn* or let* is evaluated in the global
+// environment, its body is analysed once: every reference to a parameter or a
+// let* binding is replaced with a MALResolvedSymbolType that records the frame
+// depth and slot of the binding, so evaluating it is depth pointer hops and an
+// array index, with no hashing. A reference to a global records the depth of
+// the global environment and is looked up there, without searching the frames
+// in between. fn* and let* forms nested in the body are resolved in the same
+// pass. Names bound by catch* stay plain symbols and are looked up by name, and
+// so is a name given to def! in a local frame, which shadows the resolved
+// binding. Quoted data and the arguments of macro calls are left as they are.
+
+// Binding list of a resolved let*. Its frames are built from names, which holds
+// each name once, so the local references to them do not keep the binding
+// values alive in a cycle. The value of the i-th binding goes to slot
+// bindingSlots[i]; a name bound twice keeps a single slot.
+class MALLetBindingsType : public MALListType {
+public:
+	MALLetBindingsType(std::vector<MALValue> bindings, Ref<MALListType> names, std::vector<unsigned int> bindingSlots)
+		: MALListType(std::move(bindings)), names(std::move(names)), bindingSlots(std::move(bindingSlots)) {}
+	const Ref<MALListType> names;
+	const std::vector<unsigned int> bindingSlots;
+	virtual bool isLetBindings() const override { return true; }
+};
+template<> inline bool isMALType<MALLetBindingsType>(MALType::Types tag, MALType* value) {
+	return tag == MALType::Types::List && static_cast<MALListType*>(value)->isLetBindings();
+}
+
+// Returns the body with its local references resolved.
+MALValue resolveClosureBody(const Ref<MALSequenceType>& params, const MALValue& body, const EnvPtr& globalEnv);
+// Returns the let* form with its bindings and body resolved.
+MALListTypePtr resolveLetStar(const MALListTypePtr& form, const EnvPtr& globalEnv);
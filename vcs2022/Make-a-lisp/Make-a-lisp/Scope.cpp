@@ -0,0 +1,218 @@
+#include "Scope.h"
+#include "SpecFormHandler.h"
+#include "VM.h"
+#include "Analyzer.h"
+
+static const MALSymbolTypePtr doSymbol = MALSymbolType::intern("do");
+static const MALSymbolTypePtr catchStarSymbol = MALSymbolType::intern("catch*");
+static const MALSymbolTypePtr restParamSymbol = MALSymbolType::intern("&");
+
+static const char* const primitiveNames[] = { "+", "-", "*", "/", "<", "<=", ">", ">=", "=" };
+static_assert(sizeof(primitiveNames) / sizeof(primitiveNames[0]) == primitiveCount, "a name for each primitive");
+
+MALValue primitiveFunctions[primitiveCount];
+
+Scope::Scope(const Scope* outer, Ref<MALSequenceType> frameNames) : outer(outer), frameNames(std::move(frameNames))
+{
+    for (size_t i = 0; i < this->frameNames->size(); i++) {
+        this->names.push_back(this->frameNames->getAt(i).asSymbol()->canonical);
+    }
+}
+
+bool findLocal(const Scope* scope, MALSymbolType* name, unsigned int& depth, unsigned int& slot)
+{
+    depth = 0;
+    for (auto frame = scope; frame != nullptr; frame = frame->outer, depth++) {
+        for (size_t i = 0; i < frame->names.size(); i++) {
+            if (frame->names[i] == name) {
+                slot = (unsigned int)i;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+Ref<MALResolvedSymbolType> localReference(const Scope* scope, MALSymbolType* name, unsigned int depth, unsigned int slot)
+{
+    auto frame = scope;
+    for (unsigned int hops = 0; hops < depth; hops++) {
+        frame = frame->outer;
+    }
+    return Ref<MALResolvedSymbolType>(new MALResolvedSymbolType(MALSymbolTypePtr(name), depth, slot, frame->frameNames));
+}
+
+Ref<MALResolvedSymbolType> globalReference(const Scope* scope, MALSymbolType* name)
+{
+    unsigned int depth = 0;
+    for (auto frame = scope; frame != nullptr; frame = frame->outer) {
+        depth++;
+    }
+    return Ref<MALResolvedSymbolType>(new MALResolvedSymbolType(MALSymbolTypePtr(name), depth, 0, nullptr));
+}
+
+std::vector<Ref<MALSequenceType>> frameNamesOf(const Scope* scope)
+{
+    std::vector<Ref<MALSequenceType>> frames;
+    for (auto frame = scope; frame != nullptr; frame = frame->outer) {
+        frames.push_back(frame->frameNames);
+    }
+    return frames;
+}
+
+//outermost first, so each scope is made after the one it is in; the space is
+//reserved for the outer pointers to stay valid
+ScopeChain::ScopeChain(const std::vector<Ref<MALSequenceType>>& frames)
+{
+    this->scopes.reserve(frames.size());
+    for (size_t i = frames.size(); i-- > 0;) {
+        this->scopes.emplace_back(this->scopes.empty() ? nullptr : &this->scopes.back(), frames[i]);
+    }
+}
+
+bool Parameters::read(const MALListTypePtr& form)
+{
+    if (form->size() != 3 || !form->getAt(1).tryAsSequence(this->params)) {
+        return false;
+    }
+    this->names = Ref<MALListType>(new MALListType());
+    for (size_t i = 0; i < this->params->size(); i++) {
+        MALSymbolTypePtr param;
+        if (!this->params->getAt(i).tryAsSymbol(param)) {
+            return false;
+        }
+        if (param->canonical == restParamSymbol.get()) {
+            //a single name must follow the '&'
+            if (i + 2 != this->params->size()) {
+                return false;
+            }
+            this->variadic = true;
+            continue;
+        }
+        this->names->push_back(MALSymbolTypePtr(param->canonical));
+    }
+    this->requiredArgs = (unsigned int)this->names->size() - (this->variadic ? 1 : 0);
+    return true;
+}
+
+bool LetBindings::read(const MALListTypePtr& form)
+{
+    if (form->size() < 3 || !form->getAt(1).tryAsSequence(this->bindings) || this->bindings->size() % 2 != 0) {
+        return false;
+    }
+    for (size_t i = 0; i < this->bindings->size(); i += 2) {
+        if (this->bindings->getAt(i).type() != MALType::Types::Symbol) {
+            return false;
+        }
+    }
+    this->names = Ref<MALListType>(new MALListType());
+    std::vector<MALSymbolType*> slots;
+    for (size_t i = 0; i < this->bindings->size(); i += 2) {
+        auto name = this->bindings->getAt(i).asSymbol()->canonical;
+        unsigned int slot = 0;
+        while (slot < slots.size() && slots[slot] != name) {
+            slot++;
+        }
+        if (slot == slots.size()) {
+            slots.push_back(name);
+            this->names->push_back(MALSymbolTypePtr(name));
+        }
+        this->bindingSlots.push_back(slot);
+    }
+    return true;
+}
+
+bool CatchClause::read(const MALListTypePtr& tryForm)
+{
+    MALSymbolTypePtr catchHead;
+    MALSymbolTypePtr catchName;
+    if (tryForm->size() != 3 || !tryForm->getAt(2).tryAsList(this->form) || this->form->size() != 3 ||
+        !this->form->getAt(0).tryAsSymbol(catchHead) || catchHead != catchStarSymbol || !this->form->getAt(1).tryAsSymbol(catchName)) {
+        return false;
+    }
+    this->name = catchName->canonical;
+    return true;
+}
+
+static MALValue applyMacro(const Ref<MALFuncType>& macro, const MALListTypePtr& form)
+{
+    std::vector<MALValue> args(++form->begin(), form->end());
+    if (macro->code != nullptr) {
+        return VM::apply(macro.get(), std::move(args));
+    }
+    if (macro->lambda != nullptr) {
+        return Analyzer::apply(macro.get(), std::move(args));
+    }
+    return EVAL(macro->funcBody, Env::callFrame(macro->env, macro->bindingsList, args.data(), args.size()));
+}
+
+Ref<MALFuncType> findGlobalMacro(MALSymbolType* name, const EnvPtr& globalEnv)
+{
+    auto value = globalEnv->find(MALSymbolTypePtr(name));
+    Ref<MALCallableType> callable;
+    if (value == nullptr || !value.tryAsCallable(callable) || !callable->is_macro || callable->isBuiltin()) {
+        return nullptr;
+    }
+    return malCast<MALFuncType>(value);
+}
+
+Ref<MALFuncType> findMacro(const Scope* scope, MALSymbolType* name, const EnvPtr& globalEnv)
+{
+    unsigned int depth, slot;
+    if (findLocal(scope, name, depth, slot)) {
+        return nullptr;
+    }
+    return findGlobalMacro(name, globalEnv);
+}
+
+MALValue expandMacros(MALValue ast, const EnvPtr& globalEnv)
+{
+    MALListTypePtr list;
+    MALSymbolTypePtr head;
+    while (ast.tryAsList(list) && list->size() > 0 && list->getAt(0).tryAsSymbol(head)) {
+        auto macro = findGlobalMacro(head->canonical, globalEnv);
+        if (macro == nullptr) {
+            break;
+        }
+        ast = applyMacro(macro, list);
+    }
+    return ast;
+}
+
+EnvPtr globalFrame(const EnvPtr& frame)
+{
+    Env* env = frame.get();
+    while (!env->isGlobal()) {
+        env = env->outerFrame();
+    }
+    return EnvPtr(env);
+}
+
+size_t findPrimitive(const MALSymbolType* name)
+{
+    size_t primitive = 0;
+    while (primitive < primitiveCount && name->name != primitiveNames[primitive]) {
+        primitive++;
+    }
+    return primitive;
+}
+
+MALValue evalTopLevel(MALValue ast, const EnvPtr& globalEnv, MALValue (*evalForm)(const MALValue& ast, const EnvPtr& globalEnv))
+{
+    if (primitiveFunctions[0] == nullptr) {
+        for (size_t i = 0; i < primitiveCount; i++) {
+            primitiveFunctions[i] = globalEnv->find(MALSymbolType::intern(primitiveNames[i]));
+        }
+    }
+    ast = expandMacros(std::move(ast), globalEnv);
+    MALListTypePtr list;
+    MALSymbolTypePtr head;
+    if (ast.tryAsList(list) && list->size() > 0 && list->getAt(0).tryAsSymbol(head) && head->canonical == doSymbol.get()) {
+        MALValue result = MALValue::nil();
+        for (auto p = ++list->begin(); p != list->end(); p++) {
+            result = evalTopLevel(*p, globalEnv, evalForm);
+        }
+        return result;
+    }
+    return evalForm(ast, globalEnv);
+}
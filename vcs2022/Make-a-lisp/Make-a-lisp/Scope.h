@@ -0,0 +1,125 @@
+#pragma once
+#include <vector>
+
+#include "Type.h"
+#include "Env.h"
+
+// The front end the bytecode compiler and the analyzer share: the frames the
+// code they make will run in, with the slot each name bound by a fn*, let* or
+// catch* gets, the core functions they call in place, and the way a top-level
+// form is handed to them. The resolver reads let* and catch* forms through it
+// too, so a let* frame has the same slots whichever engine built it.
+
+// A frame the compiled or analyzed code will run in: the frame of a call, a
+// let* or a catch*.
+struct Scope {
+	Scope(const Scope* outer, Ref<MALSequenceType> frameNames);
+	const Scope* outer;
+	std::vector<MALSymbolType*> names;
+	// The list the frame is built from.
+	Ref<MALSequenceType> frameNames;
+};
+
+// Finds the frame depth and slot of a name bound in scope or a scope around it.
+bool findLocal(const Scope* scope, MALSymbolType* name, unsigned int& depth, unsigned int& slot);
+// The reference records the frame it was resolved against, for Env::find to
+// check when a def! may have shadowed it.
+Ref<MALResolvedSymbolType> localReference(const Scope* scope, MALSymbolType* name, unsigned int depth, unsigned int slot);
+// The reference records the depth of the global environment, to be looked up
+// there when it is not cached.
+Ref<MALResolvedSymbolType> globalReference(const Scope* scope, MALSymbolType* name);
+// The lists the frames of scope are built from, innermost first, as a
+// MacroCallSite keeps them.
+std::vector<Ref<MALSequenceType>> frameNamesOf(const Scope* scope);
+
+// The scopes of the frames a macro call is in, made again from the lists the
+// call site keeps, for its expansion to be compiled or analyzed against.
+class ScopeChain {
+	std::vector<Scope> scopes;
+public:
+	ScopeChain(const std::vector<Ref<MALSequenceType>>& frames);
+	ScopeChain(const ScopeChain&) = delete;
+	ScopeChain& operator=(const ScopeChain&) = delete;
+	const Scope* innermost() const { return this->scopes.empty() ? nullptr : &this->scopes.back(); }
+};
+
+// The parameters of a fn*: the call frame has a slot for each name, the '&'
+// left out, the last one taking the rest of the arguments when variadic.
+struct Parameters {
+	Ref<MALSequenceType> params;
+	Ref<MALListType> names;
+	unsigned int requiredArgs = 0;
+	bool variadic = false;
+	// Returns false for a malformed fn*, which EVAL reports when it is run.
+	bool read(const MALListTypePtr& form);
+};
+
+// The bindings of a let*. As in the AST walker, every name of a let* is in
+// scope from the start, so a function bound early can call one bound later; a
+// name still unbound when it is looked up is looked up further out. The frame
+// has a slot for each of names, which holds a name bound twice once, and the
+// value of the i-th binding goes to slot bindingSlots[i].
+struct LetBindings {
+	Ref<MALSequenceType> bindings;
+	Ref<MALListType> names;
+	std::vector<unsigned int> bindingSlots;
+	// Returns false for a malformed let*, which EVAL reports when it is run.
+	bool read(const MALListTypePtr& form);
+};
+
+// The catch* of a try*, whose body runs in a frame binding the error in its
+// only slot.
+struct CatchClause {
+	// The (catch* name body) form.
+	MALListTypePtr form;
+	MALSymbolType* name = nullptr;
+	// Returns false for a malformed try*, which EVAL reports when it is run.
+	bool read(const MALListTypePtr& tryForm);
+};
+
+// The macro the global name is bound to, or nullptr.
+Ref<MALFuncType> findGlobalMacro(MALSymbolType* name, const EnvPtr& globalEnv);
+// The macro the name is bound to when it is not bound in scope: only a global
+// can name a macro in the code the engines make, and only one defined by now.
+Ref<MALFuncType> findMacro(const Scope* scope, MALSymbolType* name, const EnvPtr& globalEnv);
+// Expands the form while it is a call of a global macro.
+MALValue expandMacros(MALValue ast, const EnvPtr& globalEnv);
+// The global environment frame is in.
+EnvPtr globalFrame(const EnvPtr& frame);
+
+// The core functions two-argument calls of which the engines make in place,
+// while the callee is still that function and the arguments are numbers:
+// + - * / < <= > >= =, in this order.
+const size_t primitiveCount = 9;
+extern MALValue primitiveFunctions[primitiveCount];
+// The primitive a global name is, or primitiveCount.
+size_t findPrimitive(const MALSymbolType* name);
+
+// Sets result to the value of the call of callee with x and y, when callee is
+// the core function of primitive and x and y are numbers.
+inline bool applyPrimitive(size_t primitive, const MALValue& callee, const MALValue& x, const MALValue& y, MALValue& result)
+{
+	if (!callee.isHeap() || callee.ptr().get() != primitiveFunctions[primitive].ptr().get() ||
+		x.type() != MALType::Types::Number || y.type() != MALType::Types::Number) {
+		return false;
+	}
+	double a = x.asNumber();
+	double b = y.asNumber();
+	switch (primitive) {
+	case 0: result = MALValue::number(a + b); break;
+	case 1: result = MALValue::number(a - b); break;
+	case 2: result = MALValue::number(a * b); break;
+	case 3: result = MALValue::number(a / b); break;
+	case 4: result = MALValue::boolean(a < b); break;
+	case 5: result = MALValue::boolean(a <= b); break;
+	case 6: result = MALValue::boolean(a > b); break;
+	case 7: result = MALValue::boolean(a >= b); break;
+	default: result = MALValue::boolean(a == b); break;
+	}
+	return true;
+}
+
+// Evaluates a top-level form with evalForm, once the global macro calls at its
+// head are expanded. The forms of a top-level do are evaluated one at a time,
+// so a macro one of them defines is expanded in the next.
+MALValue evalTopLevel(MALValue ast, const EnvPtr& globalEnv, MALValue (*evalForm)(const MALValue& ast, const EnvPtr& globalEnv));
@@ -1,91 +1,106 @@
 #include "SpecFormHandler.h"
+#include "Resolver.h"
 #include "assert.h"
 
-std::shared_ptr<HandleSpecialFormResult> handleLetStar(MALListTypePtr astList, EnvPtr env)
+static const MALSymbolTypePtr defBangSymbol = MALSymbolType::intern("def!");
+static const MALSymbolTypePtr letStarSymbol = MALSymbolType::intern("let*");
+static const MALSymbolTypePtr doSymbol = MALSymbolType::intern("do");
+static const MALSymbolTypePtr ifSymbol = MALSymbolType::intern("if");
+static const MALSymbolTypePtr fnStarSymbol = MALSymbolType::intern("fn*");
+static const MALSymbolTypePtr quoteSymbol = MALSymbolType::intern("quote");
+static const MALSymbolTypePtr quasiquoteSymbol = MALSymbolType::intern("quasiquote");
+static const MALSymbolTypePtr quasiquoteExpandSymbol = MALSymbolType::intern("quasiquoteexpand");
+static const MALSymbolTypePtr defMacroSymbol = MALSymbolType::intern("defmacro!");
+static const MALSymbolTypePtr macroexpandSymbol = MALSymbolType::intern("macroexpand");
+static const MALSymbolTypePtr tryStarSymbol = MALSymbolType::intern("try*");
+static const MALSymbolTypePtr catchStarSymbol = MALSymbolType::intern("catch*");
+static const MALSymbolTypePtr unquoteSymbol = MALSymbolType::intern("unquote");
+static const MALSymbolTypePtr spliceUnquoteSymbol = MALSymbolType::intern("splice-unquote");
+static const MALSymbolTypePtr concatSymbol = MALSymbolType::intern("concat");
+static const MALSymbolTypePtr consSymbol = MALSymbolType::intern("cons");
+static const MALSymbolTypePtr vecSymbol = MALSymbolType::intern("vec");
+
+static ExpansionStats stats = { 0, 0 };
+
+HandleSpecialFormResult handleLetStar(MALListTypePtr astList, EnvPtr env)
 {
-    checkArgsIsAtLeast("let*", astList, 3, astList->values.size());
-    EnvPtr newEnv(new Env(env));
-    if (!astList->values[1]->isSequence()) {
+    checkArgsIsAtLeast("let*", astList, 3, astList->size());
+    if (env->isGlobal()) {
+        astList = resolveLetStar(astList, env);
+    }
+    if (!astList->getAt(1).isSequence()) {
         throw std::runtime_error("ERROR: 'let*' binding list must be of type list or vector.");
     }
-    auto bindingList = std::dynamic_pointer_cast<MALSequenceType>(astList->values[1]);
+    auto bindingList = malCast<MALSequenceType>(astList->getAt(1));
     if (bindingList->size() % 2 != 0) {
         throw std::runtime_error("ERROR: Mismatched number of elements in binding list: '" + bindingList->to_string(true) + "'.");
     }
+    Ref<MALLetBindingsType> resolvedBindings;
+    if (isMALType<MALLetBindingsType>(bindingList->type(), bindingList.get())) {
+        resolvedBindings = malCast<MALLetBindingsType>(bindingList);
+    }
+    auto newEnv = resolvedBindings != nullptr ? Env::letFrame(env, resolvedBindings->names, 1) : Env::letFrame(env, bindingList, 2);
     for (int i = 0; i < bindingList->size(); i += 2) {
-        if (bindingList->getAt(i)->type() != MALType::Types::Symbol) {
-            throw std::runtime_error("ERROR: First element in a binding pair must be a symbol. Found '" + bindingList->getAt(i)->to_string(true) + "' instead.");
+        if (bindingList->getAt(i).type() != MALType::Types::Symbol) {
+            throw std::runtime_error("ERROR: First element in a binding pair must be a symbol. Found '" + bindingList->getAt(i).to_string(true) + "' instead.");
         }
-        auto symbol = std::dynamic_pointer_cast<MALSymbolType>(bindingList->getAt(i));
         auto evaledValue = EVAL(bindingList->getAt(i + 1), newEnv);
-        newEnv->set(symbol, evaledValue);
+        newEnv->setSlot(resolvedBindings != nullptr ? resolvedBindings->bindingSlots[i / 2] : i / 2, evaledValue);
     }
-    auto sfr = new HandleSpecialFormResult{true, newEnv, astList->values[2] };
-    std::shared_ptr<HandleSpecialFormResult> result(sfr);
-    return result;
+    return HandleSpecialFormResult(true, newEnv, astList->getAt(2));
 }
 
-std::shared_ptr<HandleSpecialFormResult> handleDefBang(MALListTypePtr astList, EnvPtr env)
+HandleSpecialFormResult handleDefBang(MALListTypePtr astList, EnvPtr env)
 {
-    checkArgsIsAtLeast("def!", astList, 2, astList->values.size());
-    if (astList->values[1]->type() != MALType::Types::Symbol) {
+    checkArgsIsAtLeast("def!", astList, 2, astList->size());
+    if (astList->getAt(1).type() != MALType::Types::Symbol) {
         throw std::runtime_error("ERROR: 'def!' first param must be a symbol.");
     }
-    auto symbol = std::dynamic_pointer_cast<MALSymbolType>(astList->values[1]);
-    auto evaledValue = EVAL(astList->values[2], env);
+    auto symbol = malCast<MALSymbolType>(astList->getAt(1));
+    auto evaledValue = EVAL(astList->getAt(2), env);
     env->set(symbol, evaledValue);
 
-    auto sfr = new HandleSpecialFormResult{ false, env, evaledValue };
-    std::shared_ptr<HandleSpecialFormResult> result(sfr);
-    return result;
+    return HandleSpecialFormResult(false, env, evaledValue);
 }
 
-std::shared_ptr<HandleSpecialFormResult> handleDo(MALListTypePtr astList, EnvPtr env)
+HandleSpecialFormResult handleDo(MALListTypePtr astList, EnvPtr env)
 {
     if (astList->size() <= 1) {
-        auto sfr = new HandleSpecialFormResult{ false, env, MALNilType::Nil };
-        std::shared_ptr<HandleSpecialFormResult> result(sfr);
-        return result;
+        return HandleSpecialFormResult(false, env, MALValue::nil());
     }
     //Evaluate all the elements of the list using eval and return the final evaluated element.
-    for (int i = 1; i < astList->values.size() - 1; i++) {
-        EVAL(astList->values[i], env);
+    auto p = ++astList->begin();
+    for (size_t i = 1; i < astList->size() - 1; i++, p++) {
+        EVAL(*p, env);
     }
-    MALTypePtr lastValue(astList->values.size() > 0 ? astList->values[astList->values.size() - 1] : MALNilType::Nil);
+    MALValue lastValue(*p);
 
-    auto sfr = new HandleSpecialFormResult{ true, env, lastValue };
-    std::shared_ptr<HandleSpecialFormResult> result(sfr);
-    return result;
+    return HandleSpecialFormResult(true, env, lastValue);
 }
 
-std::shared_ptr<HandleSpecialFormResult> handleIf(MALListTypePtr astList, EnvPtr env)
+HandleSpecialFormResult handleIf(MALListTypePtr astList, EnvPtr env)
 {
     /*Evaluate the first parameter (second element). If the result (condition) is anything other than nil or false,
     then evaluate the second parameter (third element of the list) and return the result. Otherwise, evaluate the third
     parameter (fourth element) and return the result. If condition is false and there is no third parameter,
     then just return nil.*/
-    checkArgsIsAtLeast("if", astList, 3, astList->values.size());
-    auto conditionResult = EVAL(astList->values[1], env);
-    auto conditionResultType = conditionResult->type();
-    auto isConditionResultNil = conditionResultType == MALType::Types::Nil;
-    auto isConditionResultFalse = conditionResultType == MALType::Types::Bool && !(std::dynamic_pointer_cast<MALBoolType>(conditionResult)->value);
-    auto isConditionResultTrue = !isConditionResultNil && !isConditionResultFalse;
-    MALTypePtr astToEval;
+    checkArgsIsAtLeast("if", astList, 3, astList->size());
+    auto conditionResult = EVAL(astList->getAt(1), env);
+    auto isConditionResultTrue = conditionResult.isTruthy();
+    MALValue astToEval;
     if (isConditionResultTrue) {
-        astToEval = astList->values[2];
+        astToEval = astList->getAt(2);
     }
-    else if (astList->values.size() <= 3) { //if false bu there's nof alse branch, retunr nil
-        astToEval = MALNilType::Nil;
+    else if (astList->size() <= 3) { //if false bu there's nof alse branch, retunr nil
+        astToEval = MALValue::nil();
     } else{ //continue eval on false branch
-        astToEval = astList->values[3];
+        astToEval = astList->getAt(3);
     }
-    auto sfr = new HandleSpecialFormResult{ true, env, astToEval };
-    std::shared_ptr<HandleSpecialFormResult> result(sfr);
-    return result;
+    return HandleSpecialFormResult(true, env, astToEval);
 }
 
 
-std::shared_ptr<HandleSpecialFormResult> handleClosure(MALListTypePtr astList, EnvPtr env)
+HandleSpecialFormResult handleClosure(MALListTypePtr astList, EnvPtr env)
 {
     /*Return a new function closure. The body of that closure does the following:
     - Create a new environment using env (closed over from outer scope) as the outer parameter,
@@ -94,83 +109,83 @@ std::shared_ptr<HandleSpecialFormResult> handleClosure(MALListTypePtr astList, E
     - Call EVAL on the second parameter (third list element of ast from outer scope), using the new environment.
     Use the result as the return value of the closure.
     */
-    checkArgsIs("fn*", astList, 3, astList->values.size());
-    if (!astList->values[1]->isSequence()) {
-        throw std::runtime_error("Error: First parameter of 'fn*' must be a sequence (e.g. list or vector). Found: " + astList->values[1]->to_string(true));
+    checkArgsIs("fn*", astList, 3, astList->size());
+    if (!astList->getAt(1).isSequence()) {
+        throw std::runtime_error("Error: First parameter of 'fn*' must be a sequence (e.g. list or vector). Found: " + astList->getAt(1).to_string(true));
     }
-    auto bindingsList = astList->values[1]->asSequence();
+    auto bindingsList = astList->getAt(1).asSequence();
     for (auto i = 0; i < bindingsList->size(); i++) {
         auto element = bindingsList->getAt(i);
-        if (element->type() != MALType::Types::Symbol) {
-            throw std::runtime_error("ERROR: All elements of the binding list of 'fn*' must be symbols. Found: " + element->to_string(true));
+        if (element.type() != MALType::Types::Symbol) {
+            throw std::runtime_error("ERROR: All elements of the binding list of 'fn*' must be symbols. Found: " + element.to_string(true));
         }
     }
 
-    auto funcBody = astList->values[2]; //also called the "ast"
-    auto func = std::shared_ptr<MALFuncType>(new MALFuncType(
+    auto funcBody = astList->getAt(2); //also called the "ast"
+    if (env->isGlobal()) {
+        funcBody = resolveClosureBody(bindingsList, funcBody, env);
+    }
+    auto func = Ref<MALFuncType>(new MALFuncType(
         astList->to_string(true),
         env,
         bindingsList,
         funcBody
     ));
 
-    auto sfr = new HandleSpecialFormResult{ false, env, func };
-    std::shared_ptr<HandleSpecialFormResult> result(sfr);
-    return result;
+    return HandleSpecialFormResult(false, env, func);
 }
 
-std::shared_ptr<HandleSpecialFormResult> handleQuote(MALListTypePtr astList, EnvPtr env) {
+HandleSpecialFormResult handleQuote(MALListTypePtr astList, EnvPtr env) {
     checkArgsNumber("quote", 1, astList->size() - 1);
-    auto sfr = new HandleSpecialFormResult{ false, env, astList->values[1]};
-    std::shared_ptr<HandleSpecialFormResult> result(sfr);
-    return result;
+    return HandleSpecialFormResult(false, env, astList->getAt(1));
 }
 
-MALTypePtr quasiquote(MALTypePtr ast, bool ignoreUnquote = false) {
-    auto astAsList = ast->asList();
-    std::shared_ptr<MALSymbolType> argAsSymbol(nullptr);
-    std::shared_ptr<MALListType> argAsList(nullptr);
-    if (ast->type() == MALType::Types::List)
+MALValue quasiquote(MALValue ast, bool ignoreUnquote) {
+    auto astAsList = ast.asList();
+    Ref<MALSymbolType> argAsSymbol(nullptr);
+    Ref<MALListType> argAsList(nullptr);
+    if (ast.type() == MALType::Types::List)
     {
-        if (astAsList->size() > 0 && astAsList->values[0]->tryAsSymbol(argAsSymbol) && argAsSymbol->name == "unquote" && !ignoreUnquote) {
-            return astAsList->values[1];
+        if (astAsList->size() > 0 && astAsList->getAt(0).tryAsSymbol(argAsSymbol) && argAsSymbol == unquoteSymbol && !ignoreUnquote) {
+            return astAsList->getAt(1);
         }
         else {
             MALListTypePtr result(new MALListType());
-            for (int i = astAsList->size() - 1; i >= 0; i--) {
-                if (astAsList->values[i]->tryAsList(argAsList) && argAsList->size() > 0 && argAsList->values[0]->tryAsSymbol(argAsSymbol) && argAsSymbol->name == "splice-unquote") {
+            auto elements = astAsList->toVector();
+            for (int i = elements.size() - 1; i >= 0; i--) {
+                if (elements[i].tryAsList(argAsList) && argAsList->size() > 0 && argAsList->getAt(0).tryAsSymbol(argAsSymbol) && argAsSymbol == spliceUnquoteSymbol) {
                     auto oldResult = result;
                     result = MALListTypePtr(new MALListType());
-                    result->values.push_back(MALSymbolTypePtr(new MALSymbolType("concat")));
-                    result->values.push_back(argAsList->values[1]);
-                    result->values.push_back(oldResult);
+                    result->push_back(concatSymbol);
+                    result->push_back(argAsList->getAt(1));
+                    result->push_back(oldResult);
                 }
                 else {
                     auto oldResult = result;
                     result = MALListTypePtr(new MALListType());
-                    result->values.push_back(MALSymbolTypePtr(new MALSymbolType("cons")));
-                    result->values.push_back(quasiquote(astAsList->values[i]));
-                    result->values.push_back(oldResult);
+                    result->push_back(consSymbol);
+                    result->push_back(quasiquote(elements[i]));
+                    result->push_back(oldResult);
                 }
             }
             return result;
         }
     }
-    else if (ast->type() == MALType::Types::Vector) {
+    else if (ast.type() == MALType::Types::Vector) {
         MALListTypePtr result(new MALListType());
-        result->values.push_back(MALSymbolTypePtr(new MALSymbolType("vec")));
+        result->push_back(vecSymbol);
         MALListTypePtr vector2List(new MALListType());
-        auto vector = ast->asSequence();
+        auto vector = ast.asSequence();
         for (int i = 0; i < vector->size(); i++) {
-            vector2List->values.push_back(vector->getAt(i));
+            vector2List->push_back(vector->getAt(i));
         }
-        result->values.push_back(quasiquote(vector2List, true));
+        result->push_back(quasiquote(vector2List, true));
         return result;
     }
-    else if (ast->type() == MALType::Types::HashMap || ast->type() == MALType::Types::Symbol) {
+    else if (ast.type() == MALType::Types::HashMap || ast.type() == MALType::Types::Symbol) {
         MALListTypePtr result(new MALListType());
-        result->values.push_back(MALSymbolTypePtr(new MALSymbolType("quote")));
-        result->values.push_back(ast);
+        result->push_back(quoteSymbol);
+        result->push_back(ast);
         return result;
     }
     else {
@@ -178,171 +193,270 @@ MALTypePtr quasiquote(MALTypePtr ast, bool ignoreUnquote = false) {
     }
 }
 
-std::shared_ptr<HandleSpecialFormResult> handleQuasiquoteExpand(MALListTypePtr astList, EnvPtr env) {
+HandleSpecialFormResult handleQuasiquoteExpand(MALListTypePtr astList, EnvPtr env) {
     checkArgsNumber("quasiquoteexpand", 1, astList->size() - 1);
-    auto sfr = new HandleSpecialFormResult{ false, env, quasiquote(astList->values[1]) };
-    std::shared_ptr<HandleSpecialFormResult> result(sfr);
-    return result;
+    return HandleSpecialFormResult(false, env, quasiquote(astList->getAt(1)));
 }
 
-std::shared_ptr<HandleSpecialFormResult> handleQuasiquote(MALListTypePtr astList, EnvPtr env) {
+HandleSpecialFormResult handleQuasiquote(MALListTypePtr astList, EnvPtr env) {
     checkArgsNumber("quasiquote", 1, astList->size() - 1);
-    auto sfr = new HandleSpecialFormResult{ true, env, quasiquote(astList->values[1]) };
-    std::shared_ptr<HandleSpecialFormResult> result(sfr);
-    return result;
+    //the template can't change, and neither can the code that builds it
+    if (astList->expansion == nullptr) {
+        astList->expansion = Ref<FormExpansion>(new FormExpansion());
+    }
+    auto& quasiquoted = astList->expansion->quasiquoted;
+    if (quasiquoted == nullptr) {
+        quasiquoted = quasiquote(astList->getAt(1));
+        stats.expanded++;
+    }
+    else {
+        stats.reused++;
+    }
+    return HandleSpecialFormResult(true, env, quasiquoted);
 }
 
-bool isMacroCall(MALTypePtr ast, EnvPtr env) {
+bool isMacroCall(MALValue ast, EnvPtr env) {
     MALListTypePtr astAsList;
     MALSymbolTypePtr astAsSymbol;
-    std::shared_ptr<MALCallableType> astAsCallable;
-    if (ast->tryAsList(astAsList) && astAsList->size() > 0 && astAsList->getAt(0)->tryAsSymbol(astAsSymbol)) {
+    Ref<MALCallableType> astAsCallable;
+    if (ast.tryAsList(astAsList) && astAsList->size() > 0 && astAsList->getAt(0).tryAsSymbol(astAsSymbol)) {
         auto envValue = env->find(astAsSymbol);
-        return envValue != nullptr && envValue->tryAsCallable(astAsCallable) && astAsCallable->is_macro;
+        return envValue != nullptr && envValue.tryAsCallable(astAsCallable) && astAsCallable->is_macro;
     }
     return false;
 }
 
-MALTypePtr macroexpand(MALTypePtr ast, EnvPtr env) {
+// Calls macro with the arguments of the macro call form.
+static MALValue expandOnce(const MALListTypePtr& form, const Ref<MALCallableType>& macro) {
+    std::vector<MALValue> args(++form->begin(), form->end());
+    auto func = malCast<MALFuncType>(macro);
+    auto newEnv = Env::callFrame(func->env, func->bindingsList, args.data(), args.size());
+    return EVAL(func->funcBody, newEnv);
+}
+
+MALValue macroexpand(MALValue ast, EnvPtr env) {
     MALListTypePtr astAsList;
     MALSymbolTypePtr astAsSymbol;
-    std::shared_ptr<MALCallableType> astAsCallable;
+    Ref<MALCallableType> astAsCallable;
     while (isMacroCall(ast, env)) {
-        if (!ast->tryAsList(astAsList)) {
+        if (!ast.tryAsList(astAsList)) {
             throw std::runtime_error("ERROR: Macroexpand: ast is not a list.");
         }
-        if (!astAsList->getAt(0)->tryAsSymbol(astAsSymbol)) {
+        if (!astAsList->getAt(0).tryAsSymbol(astAsSymbol)) {
             throw std::runtime_error("ERROR: Macroexpand: first element needs to be a Symbol.");
         }
         auto envValue = env->get(astAsSymbol);
-        if (!envValue->tryAsCallable(astAsCallable)) {
+        if (!envValue.tryAsCallable(astAsCallable)) {
             throw std::runtime_error("ERROR: Macroexpand: Value of key '" + astAsSymbol->to_string(true) + "' it's not a function bu it must be.");
         }
-        MALListTypePtr args(new MALListType());
-        for (int i = 1; i < astAsList->size(); i++) {
-            args->push_back(astAsList->getAt(i));
+        ast = expandOnce(astAsList, astAsCallable);
+    }
+    return ast;
+}
+
+// The expansion of form, a list starting with a symbol, one step: the form the
+// macro bound to the head makes of it, or nullptr when the head is not bound to
+// a macro. What the head was bound to is kept on the form, with the expansion;
+// macros are expected to depend on their arguments only, as the expansion of a
+// form is used again for as long as the same macro is bound to its head.
+// The binding is looked up again unless the head was found in the global
+// environment, directly or through a reference resolved to it, and no def!
+// has been made since.
+static MALValue expandCached(const MALListTypePtr& form, const EnvPtr& env) {
+    auto head = form->getAt(0).asSymbol();
+    bool globalLookup = env->isGlobal() || (head->isResolved() && static_cast<MALResolvedSymbolType*>(head.get())->isGlobal());
+    Ref<FormExpansion> cached = form->expansion;
+    if (cached != nullptr && globalLookup && cached->definitionEpoch == Env::definitions() && !Env::hasLocalDefinitions()) {
+        if (cached->macro != nullptr) {
+            stats.reused++;
+        }
+        return cached->result;
+    }
+    auto definitionEpoch = globalLookup && !Env::hasLocalDefinitions() ? Env::definitions() : SIZE_MAX;
+    auto value = env->find(head);
+    Ref<MALCallableType> macro;
+    if (value == nullptr || !value.tryAsCallable(macro) || !macro->is_macro) {
+        macro = nullptr;
+    }
+    if (cached == nullptr) {
+        //a form that isn't a macro call is only worth remembering when the
+        //lookup can be skipped next time
+        if (macro == nullptr && definitionEpoch == SIZE_MAX) {
+            return nullptr;
         }
-        auto func = std::dynamic_pointer_cast<MALFuncType>(astAsCallable);
-        EnvPtr newEnv(new Env(func->env, func->bindingsList, args->values));
-        ast = EVAL(func->funcBody, newEnv);
+        cached = Ref<FormExpansion>(new FormExpansion());
+        form->expansion = cached;
+    }
+    if (macro == nullptr) {
+        cached->macro = nullptr;
+        cached->result = nullptr;
+    }
+    else if (macro == cached->macro) {
+        stats.reused++;
+    }
+    else {
+        //a def! the macro makes leaves the epoch behind, so the head is looked
+        //up again next time
+        cached->result = expandOnce(form, macro);
+        cached->macro = std::move(macro);
+        stats.expanded++;
+    }
+    cached->definitionEpoch = definitionEpoch;
+    return cached->result;
+}
+
+// macroexpand, with the expansions kept on the forms expanded.
+static MALValue macroexpandCached(MALValue ast, const EnvPtr& env) {
+    MALListTypePtr list;
+    MALSymbolTypePtr head;
+    while (ast.tryAsList(list) && list->size() > 0 && list->getAt(0).tryAsSymbol(head)) {
+        auto expansion = expandCached(list, env);
+        if (expansion == nullptr) {
+            break;
+        }
+        ast = std::move(expansion);
     }
     return ast;
 }
 
-std::shared_ptr<HandleSpecialFormResult> handleDefMacro(MALListTypePtr astList, EnvPtr env) {
+ExpansionStats expansionStats() {
+    return stats;
+}
+
+// The head is not a local of the code the call is in, so its binding holds
+// until the next def!, unless a def! made in a frame could shadow it. The
+// form is expanded one step, through the expansion kept on it: a macro call
+// in the expansion is a call site of its own.
+bool MacroCallSite::expand(const EnvPtr& frame) {
+    if (this->definitionEpoch == Env::definitions() && !Env::hasLocalDefinitions()) {
+        return false;
+    }
+    auto definitionEpoch = Env::hasLocalDefinitions() ? SIZE_MAX : Env::definitions();
+    auto expansion = expandCached(this->form, frame);
+    if (expansion == nullptr) {
+        expansion = this->form;
+    }
+    bool changed = this->expanded == nullptr || (expansion.isHeap()
+        ? !this->expanded.isHeap() || expansion.ptr().get() != this->expanded.ptr().get()
+        : !expansion.isEqualTo(this->expanded));
+    this->expanded = std::move(expansion);
+    this->definitionEpoch = definitionEpoch;
+    return changed;
+}
+
+HandleSpecialFormResult handleDefMacro(MALListTypePtr astList, EnvPtr env) {
     /* This is very similar to the def! form, but before the evaluated value (mal function) 
     is set in the environment, the is_macro attribute should be set to true.*/
-    checkArgsIs("defmacro!", astList, 2, astList->values.size() - 1);
-    if (astList->values[1]->type() != MALType::Types::Symbol) {
+    checkArgsIs("defmacro!", astList, 2, astList->size() - 1);
+    if (astList->getAt(1).type() != MALType::Types::Symbol) {
         throw std::runtime_error("ERROR: 'defmacro!' first param must be a symbol.");
     }
-    auto symbol = std::dynamic_pointer_cast<MALSymbolType>(astList->values[1]);
-    auto evaledValue = EVAL(astList->values[2], env);
+    auto symbol = malCast<MALSymbolType>(astList->getAt(1));
+    auto evaledValue = EVAL(astList->getAt(2), env);
+    Ref<MALCallableType> evaledCallable;
+    if (!evaledValue.tryAsCallable(evaledCallable)) {
+        throw std::runtime_error("ERROR: 'defmacro!' second param must evaluate to a function.");
+    }
     env->set(symbol, evaledValue);
-    evaledValue->is_macro = true;
-    auto sfr = new HandleSpecialFormResult{ false, env, evaledValue };
-    std::shared_ptr<HandleSpecialFormResult> result(sfr);
-    return result;
+    evaledCallable->is_macro = true;
+    return HandleSpecialFormResult(false, env, evaledValue);
 
 }
 
-std::shared_ptr<HandleSpecialFormResult> handleMacroexpand(MALListTypePtr astList, EnvPtr env) {
+HandleSpecialFormResult handleMacroexpand(MALListTypePtr astList, EnvPtr env) {
     checkArgsNumber("macroexpand", 1, astList->size() - 1);
-    auto sfr = new HandleSpecialFormResult{ false, env, macroexpand(astList->values[1], env) };
-    std::shared_ptr<HandleSpecialFormResult> result(sfr);
-    return result;
+    return HandleSpecialFormResult(false, env, macroexpand(astList->getAt(1), env));
 }
 
-std::shared_ptr<HandleSpecialFormResult> handleTryCatch(MALListTypePtr astList, EnvPtr env) {
+HandleSpecialFormResult handleTryCatch(MALListTypePtr astList, EnvPtr env) {
     checkArgsNumber("try*/catch*", 2, astList->size() - 1);
     MALSymbolTypePtr astAsSymbol;
     MALListTypePtr astAsList;
 
-    if (!( astList->getAt(2)->tryAsList(astAsList) && astAsList->size() == 3)) {
+    if (!( astList->getAt(2).tryAsList(astAsList) && astAsList->size() == 3)) {
         throw std::runtime_error("ERROR: try* second parameter must be a list of size 3");
     }
-    if (!(astAsList->getAt(0)->tryAsSymbol(astAsSymbol) && astAsSymbol->name == "catch*")) {
+    if (!(astAsList->getAt(0).tryAsSymbol(astAsSymbol) && astAsSymbol == catchStarSymbol)) {
         throw std::runtime_error("ERROR: try* second parameter must be a list of size 3, with its first element being the symbol 'catch*'");
     }
-    if (!(astAsList->getAt(1)->tryAsSymbol(astAsSymbol))) {
+    if (!(astAsList->getAt(1).tryAsSymbol(astAsSymbol))) {
         throw std::runtime_error("ERROR: try* second parameter must be a list of size 3, with its second element being a symbol");
     }
 
     auto catchBindingValue = astAsSymbol;
     auto catchBody = astAsList->getAt(2);
 
-    auto sfr = new HandleSpecialFormResult{ false, env, astList->values[1] };
-    std::shared_ptr<MALType> error(new MALStringType(""));
-    auto errorAsString = std::dynamic_pointer_cast<MALStringType>(error);
+    MALValue error;
     try {
-        sfr->ast = EVAL(astList->values[1], env);
-        std::shared_ptr<HandleSpecialFormResult> result(sfr);
-        return result;
+        return HandleSpecialFormResult(false, env, EVAL(astList->getAt(1), env));
     }
     catch (MALException& e) {
         error = e.errorValue;
     }
     catch (std::string& e) {
-        errorAsString->value = e + ", in:\n\t" + astList->values[1]->to_string(false);
+        error = Ref<MALStringType>(new MALStringType(e + ", in:\n\t" + astList->getAt(1).to_string(false)));
     }
     catch (std::exception& e) {
-        errorAsString->value = std::string(e.what()) + ", in:\n\t" + astList->values[1]->to_string(false);
+        error = Ref<MALStringType>(new MALStringType(std::string(e.what()) + ", in:\n\t" + astList->getAt(1).to_string(false)));
     }
     catch (...) {
-        errorAsString->value = "Unknown error. Something went wrong running:\n\t" + astList->values[1]->to_string(false);
+        error = Ref<MALStringType>(new MALStringType("Unknown error. Something went wrong running:\n\t" + astList->getAt(1).to_string(false)));
     }
     //If execution reach this, we had an exception.
-    sfr->ast = catchBody; //run catch body
     EnvPtr newEnv = EnvPtr(new Env(env)); //create new env
     newEnv->set(catchBindingValue, error); //bind catch error value to catch binding symbol
-    sfr->env = newEnv; //run with new env
-    sfr->tco = true; //this makes sure that the new Env is going to be used
-    std::shared_ptr<HandleSpecialFormResult> result(sfr);
-    return result;
+    //run catch body in the new env; tco makes sure that the new Env is going to be used
+    return HandleSpecialFormResult(true, newEnv, catchBody);
 }
 
-std::shared_ptr<HandleSpecialFormResult> handleSpecialForms(MALListTypePtr astList, EnvPtr env) {
-    auto macroedAstList = macroexpand(astList, env);
-    if (!macroedAstList->tryAsList(astList) || astList->size() <= 0) {
-        auto sfr = new HandleSpecialFormResult{ false, env, eval_ast(macroedAstList, env) };
-        std::shared_ptr<HandleSpecialFormResult> result(sfr);
-        return result;
-    }
-    auto lookupSymbol = std::dynamic_pointer_cast<MALSymbolType>(astList->values[0]);
-    if (lookupSymbol->name == "def!") {
+HandleSpecialFormResult handleSpecialForms(MALListTypePtr astList, EnvPtr env) {
+    auto form = astList.get();
+    auto macroedAstList = macroexpandCached(astList, env);
+    if (!macroedAstList.tryAsList(astList) || astList->size() <= 0) {
+        return HandleSpecialFormResult(false, env, eval_ast(macroedAstList, env));
+    }
+    MALSymbolTypePtr headSymbol;
+    if (!astList->getAt(0).tryAsSymbol(headSymbol)) {
+        return HandleSpecialFormResult(true, env, astList);
+    }
+    //the head may be a reference the resolver made
+    auto lookupSymbol = headSymbol->canonical;
+    if (lookupSymbol == defBangSymbol.get()) {
         return handleDefBang(astList, env);
     }
-    else if (lookupSymbol->name == "let*") {
+    else if (lookupSymbol == letStarSymbol.get()) {
         return handleLetStar(astList, env);
     }
-    else if (lookupSymbol->name == "do") {
+    else if (lookupSymbol == doSymbol.get()) {
         return handleDo(astList, env);
     }
-    else if (lookupSymbol->name == "if") {
+    else if (lookupSymbol == ifSymbol.get()) {
         return handleIf(astList, env);
     }
-    else if (lookupSymbol->name == "fn*") {
+    else if (lookupSymbol == fnStarSymbol.get()) {
         return handleClosure(astList, env);
     }
-    else if (lookupSymbol->name == "quote") {
+    else if (lookupSymbol == quoteSymbol.get()) {
         return handleQuote(astList, env);
     }
-    else if (lookupSymbol->name == "quasiquote") {
+    else if (lookupSymbol == quasiquoteSymbol.get()) {
         return handleQuasiquote(astList, env);
     }
-    else if (lookupSymbol->name == "quasiquoteexpand") {
+    else if (lookupSymbol == quasiquoteExpandSymbol.get()) {
         return handleQuasiquoteExpand(astList, env);
     }
-    else if (lookupSymbol->name == "defmacro!") {
+    else if (lookupSymbol == defMacroSymbol.get()) {
         return handleDefMacro(astList, env);
     }
-    else if (lookupSymbol->name == "macroexpand") {
+    else if (lookupSymbol == macroexpandSymbol.get()) {
         return handleMacroexpand(astList, env);
     }
-    else if (lookupSymbol->name == "try*") {
+    else if (lookupSymbol == tryStarSymbol.get()) {
         return handleTryCatch(astList, env);
     }
-    auto sfr = new HandleSpecialFormResult{ false, env, nullptr };
-    std::shared_ptr<HandleSpecialFormResult> result(sfr);
-    return result;
+    //a macro call that expanded to a function call: evaluate the expansion
+    if (astList.get() != form) {
+        return HandleSpecialFormResult(true, env, astList);
+    }
+    return HandleSpecialFormResult(false, nullptr, nullptr);
 }
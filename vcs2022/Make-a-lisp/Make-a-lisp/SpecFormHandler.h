@@ -10,11 +10,64 @@
 #include "Type.h"
 #include "Env.h"
 
-MALTypePtr EVAL(MALTypePtr ast, EnvPtr env);
-MALTypePtr eval_ast(MALTypePtr ast, EnvPtr env);
+MALValue EVAL(MALValue ast, EnvPtr env);
+MALValue eval_ast(MALValue ast, EnvPtr env);
 
 void REPL(std::string& input, const char* const& history_path);
 
-std::shared_ptr<HandleSpecialFormResult> handleSpecialForms(MALListTypePtr astList, EnvPtr env);
+HandleSpecialFormResult handleSpecialForms(MALListTypePtr astList, EnvPtr env);
+// Expands ast while it is a call of a macro bound in env.
+MALValue macroexpand(MALValue ast, EnvPtr env);
+// The form a quasiquote template stands for.
+MALValue quasiquote(MALValue ast, bool ignoreUnquote = false);
 
+// What the evaluator made of a form starting with a symbol, kept on the form
+// for the next time it is evaluated. A macro call is expanded once per macro
+// bound to its head, and a quasiquote template is turned into the code that
+// builds it once.
+class FormExpansion : public RefCounted {
+public:
+	// The macro the head was bound to, with the form it expanded to (one
+	// step); nullptr when the head was not bound to a macro.
+	Ref<MALCallableType> macro;
+	MALValue result;
+	// Env::definitions() when the head was looked up in the global
+	// environment without passing a frame that could bind it, so the lookup
+	// holds until the next def!; SIZE_MAX when the head must be looked up
+	// again.
+	size_t definitionEpoch = SIZE_MAX;
+	// For a quasiquote form: quasiquote of its template.
+	MALValue quasiquoted;
+};
 
+struct ExpansionStats {
+	// Macro calls expanded and quasiquote templates translated...
+	size_t expanded;
+	// ...and those that reused what an earlier evaluation of the form made.
+	size_t reused;
+};
+ExpansionStats expansionStats();
+
+// A macro call in the code the bytecode compiler or the analyzer made of a
+// function. It is expanded when it first runs, through the expansions kept on
+// the form, and what the engine made of the expansion is kept until the form
+// expands to something else, as when a def! binds its head to another macro.
+// The names of the frames around the call, innermost first, are kept for the
+// expansion to be compiled or analyzed against.
+class MacroCallSite {
+public:
+	MacroCallSite(MALListTypePtr form, std::vector<Ref<MALSequenceType>> frames) : form(std::move(form)), frames(std::move(frames)) {}
+	// Expands the form in frame, unless no def! was made since the last time;
+	// returns whether the expansion changed.
+	bool expand(const EnvPtr& frame);
+	const MALValue& expansion() const { return this->expanded; }
+	// Whether the macro no longer expands the form, which is then a call: its
+	// head may be bound to a function in a frame, in front of the global macro.
+	bool isCall() const { return this->expanded.isHeap() && this->expanded.ptr().get() == this->form.get(); }
+
+	MALListTypePtr form;
+	std::vector<Ref<MALSequenceType>> frames;
+private:
+	MALValue expanded;
+	size_t definitionEpoch = SIZE_MAX;
+};
@@ -1,6 +1,9 @@
 #include "Type.h"
-
-std::shared_ptr<MALNilType> MALNilType::Nil = std::shared_ptr<MALNilType>(new MALNilType());
+#include "Env.h"
+#include "VM.h"
+#include "Analyzer.h"
+#include "SpecFormHandler.h"
+#include <charconv>
 
 static void replaceAll(std::string& input, std::string match, std::string replaceWith) {
     int i = 0;
@@ -49,305 +52,1078 @@ std::string MALType::typeToString(Types t)
     }
 }
 
-MALTypePtr MALListType::deepCopy() {
-    auto result = std::shared_ptr<MALListType>(new MALListType());
-    for (auto p = this->values.begin(); p != this->values.end(); p++) {
-        auto malType = *p;
-        result->values.push_back(malType->deepCopy());
+size_t hashString(std::string_view text)
+{
+    size_t hash = 14695981039346656037ULL;
+    for (auto p = text.begin(); p != text.end(); p++) {
+        hash ^= (unsigned char)*p;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Mixes an element hash into the hash of an ordered collection.
+static size_t combineHash(size_t seed, size_t hash)
+{
+    return seed ^ (hash + 0x9e3779b97f4a7c15ULL + (seed << 6) + (seed >> 2));
+}
+
+static void printNumber(std::string& out, double value)
+{
+    auto dec = abs(value) - abs(floor(value));
+    if (dec != 0) {
+        out += std::to_string(value);
+        return;
+    }
+    char digits[16];
+    auto end = std::to_chars(digits, digits + sizeof(digits), (int)value).ptr;
+    out.append(digits, end);
+}
+
+void MALValue::print(std::string& out, bool print_readably) const
+{
+    switch (this->storage) {
+    case Storage::Heap:
+        this->heap->print(out, print_readably);
+        return;
+    case Storage::Empty:
+        return;
+    default:
+        break;
+    }
+    switch (this->tag) {
+    case MALType::Types::Number:
+        printNumber(out, this->numberValue);
+        break;
+    case MALType::Types::Bool:
+        out += this->boolValue ? "true" : "false";
+        break;
+    default:
+        out += "nil";
+        break;
+    }
+}
+
+bool MALValue::isEqualTo(const MALValue& other) const
+{
+    if (this->isHeap()) {
+        //atoms compare by content, so identity alone is enough for them too
+        if (other.isHeap() && other.heap == this->heap) {
+            return true;
+        }
+        return this->heap->isEqualTo(other);
+    }
+    if (other.tag != this->tag) {
+        return false;
+    }
+    switch (this->tag) {
+    case MALType::Types::Number:
+        return other.numberValue == this->numberValue;
+    case MALType::Types::Bool:
+        return other.boolValue == this->boolValue;
+    default:
+        return true;
+    }
+}
+
+size_t MALValue::hash() const
+{
+    switch (this->storage) {
+    case Storage::Heap:
+        return this->heap->hash();
+    case Storage::Empty:
+        return 0;
+    default:
+        break;
+    }
+    switch (this->tag) {
+    case MALType::Types::Number:
+        //-0.0 == 0.0, so both must hash the same
+        return std::hash<double> {}(this->numberValue == 0 ? 0.0 : this->numberValue);
+    case MALType::Types::Bool:
+        return this->boolValue ? 1231 : 1237;
+    default:
+        return 0;
+    }
+}
+
+bool MALValue::tryAsSymbol(Ref<MALSymbolType>& ptr) const
+{
+    if (type() != MALType::Types::Symbol) {
+        ptr = nullptr;
+        return false;
+    }
+    ptr = malCast<MALSymbolType>(*this);
+    return true;
+}
+
+bool MALValue::tryAsList(Ref<MALListType>& ptr) const
+{
+    if (type() != MALType::Types::List) {
+        ptr = nullptr;
+        return false;
+    }
+    ptr = malCast<MALListType>(*this);
+    return true;
+}
+
+bool MALValue::tryAsCallable(Ref<MALCallableType>& ptr) const
+{
+    if (type() != MALType::Types::Function) {
+        ptr = nullptr;
+        return false;
+    }
+    ptr = malCast<MALCallableType>(*this);
+    return true;
+}
+
+bool MALValue::tryAsSequence(Ref<MALSequenceType>& ptr) const
+{
+    if (!isSequence()) {
+        ptr = nullptr;
+        return false;
+    }
+    ptr = malCast<MALSequenceType>(*this);
+    return true;
+}
+
+Ref<MALSymbolType> MALValue::asSymbol() const
+{
+    if (type() != MALType::Types::Symbol) {
+        return nullptr;
+    }
+    return malCast<MALSymbolType>(*this);
+}
+
+Ref<MALSequenceType> MALValue::asSequence() const
+{
+    if (!isSequence()) {
+        return nullptr;
+    }
+    return malCast<MALSequenceType>(*this);
+}
+
+Ref<MALListType> MALValue::asList() const
+{
+    if (type() != MALType::Types::List) {
+        return nullptr;
+    }
+    return malCast<MALListType>(*this);
+}
+
+MALListType::MALListType() {}
+
+MALListType::MALListType(std::vector<MALValue> values, Ref<MALListType> next)
+{
+    if (values.empty()) {
+        //share the first segment of next instead of keeping an empty one
+        if (next != nullptr && next->length > 0) {
+            this->chunk = next->chunk;
+            this->from = next->from;
+            this->to = next->to;
+            this->next = next->next;
+            this->length = next->length;
+        }
+        return;
+    }
+    this->chunk = Ref<MALListChunk>(new MALListChunk());
+    this->chunk->values = std::move(values);
+    this->to = (unsigned int)this->chunk->values.size();
+    this->length = this->to;
+    if (next != nullptr && next->length > 0) {
+        this->next = next;
+        this->length += next->length;
+    }
+}
+
+MALListType::~MALListType()
+{
+    //free the segments this list owns one by one, so releasing a long cons
+    //chain doesn't recurse once per segment
+    Ref<MALListType> segment = std::move(this->next);
+    while (segment != nullptr && segment.useCount() == 1) {
+        Ref<MALListType> following = std::move(segment->next);
+        segment = std::move(following);
+    }
+}
+
+Ref<MALListType> MALListType::cons(MALValue first, Ref<MALListType> rest)
+{
+    std::vector<MALValue> values;
+    values.push_back(first);
+    return Ref<MALListType>(new MALListType(std::move(values), rest));
+}
+
+Ref<MALListType> MALListType::rest()
+{
+    if (this->length <= 1) {
+        return Ref<MALListType>(new MALListType());
+    }
+    if (this->from + 1 == this->to) {
+        return this->next;
     }
+    Ref<MALListType> result(new MALListType());
+    result->chunk = this->chunk;
+    result->from = this->from + 1;
+    result->to = this->to;
+    result->next = this->next;
+    result->length = this->length - 1;
     return result;
 }
 
-bool MALListType::isEqualTo(MALTypePtr other)
+void MALListType::makeSingleChunk()
 {
-    if (other->type() != this->type()) {
+    if (this->next == nullptr && this->chunk != nullptr && this->chunk.useCount() == 1 && this->to == this->chunk->values.size()) {
+        return;
+    }
+    Ref<MALListChunk> newChunk(new MALListChunk());
+    newChunk->values.reserve(this->length);
+    for (auto p = this->begin(); p != this->end(); p++) {
+        newChunk->values.push_back(*p);
+    }
+    this->chunk = newChunk;
+    this->from = 0;
+    this->to = (unsigned int)this->length;
+    this->next = nullptr;
+}
+
+MALValue MALListType::getAt(size_t pos)
+{
+    const MALListType* segment = this;
+    while (pos >= segment->to - segment->from) {
+        pos -= segment->to - segment->from;
+        segment = segment->next.get();
+    }
+    return segment->chunk->values[segment->from + pos];
+}
+
+void MALListType::setAt(size_t pos, MALValue value)
+{
+    this->invalidateHash();
+    this->expansion = nullptr;
+    this->makeSingleChunk();
+    this->chunk->values[this->from + pos] = value;
+}
+
+void MALListType::push_back(MALValue value)
+{
+    this->invalidateHash();
+    this->expansion = nullptr;
+    this->makeSingleChunk();
+    this->chunk->values.push_back(value);
+    this->to++;
+    this->length++;
+}
+
+MALValue MALListType::deepCopy() {
+    std::vector<MALValue> values;
+    values.reserve(this->length);
+    for (auto p = this->begin(); p != this->end(); p++) {
+        values.push_back(p->deepCopy());
+    }
+    return Ref<MALListType>(new MALListType(std::move(values)));
+}
+
+size_t MALContainerType::hash()
+{
+    if (this->cachedHash == 0) {
+        auto hash = this->computeHash();
+        this->cachedHash = hash != 0 ? hash : 1;
+    }
+    return this->cachedHash;
+}
+
+size_t MALListType::computeHash()
+{
+    size_t result = (size_t)MALType::Types::List;
+    for (auto p = this->begin(); p != this->end(); p++) {
+        result = combineHash(result, p->hash());
+    }
+    return result;
+}
+
+bool MALListType::isEqualTo(const MALValue& other)
+{
+    if (other.type() != this->type()) {
         return false;
     }
-    auto castOther = std::dynamic_pointer_cast<MALListType>(other);
-    if (castOther->size() != this->size()) {
+    auto castOther = malCast<MALListType>(other);
+    if (castOther->size() != this->size() || this->hashDiffers(castOther.get())) {
         return false;
     }
-    for (int i = 0; i < this->size(); i++) {
-        if (!(this->values[i]->isEqualTo(castOther->values[i]))) {
+    for (auto p = this->begin(), r = castOther->begin(); p != this->end(); p++, r++) {
+        if (!(p->isEqualTo(*r))) {
             return false;
         }
     }
     return true;
 }
 
-std::string MALListType::to_string(bool print_readably)
+void MALListType::print(std::string& out, bool print_readably)
 {
-    std::string result = "";
-    auto size = this->values.size();
-    for (int i = 0; i < size; i++) {
-        result += this->values[i]->to_string(print_readably);
-        if (i != size - 1) {
-            result += " ";
+    out += '(';
+    for (auto p = this->begin(); p != this->end(); p++) {
+        if (p != this->begin()) {
+            out += ' ';
         }
+        p->print(out, print_readably);
+    }
+    out += ')';
+}
+
+MALSymbolTypePtr MALSymbolType::intern(std::string_view name)
+{
+    //keys view the name owned by the interned symbol, which is never freed
+    static std::unordered_map<std::string_view, MALSymbolTypePtr> table;
+    auto got = table.find(name);
+    if (got != table.end()) {
+        return got->second;
     }
-    return "(" + result + ")";
+    //interned symbols live forever, keep them out of the reader's arena
+    ReadArenaPause pause;
+    MALSymbolTypePtr symbol(new MALSymbolType(std::string(name), table.size()));
+    table.insert(std::pair<std::string_view, MALSymbolTypePtr>(symbol->name, symbol));
+    return symbol;
 }
 
-MALTypePtr MALNumberType::deepCopy() {
-    return std::shared_ptr<MALNumberType>(new MALNumberType(this->value));
+MALValue MALSymbolType::deepCopy() {
+    return Ref<MALType>(this);
 }
 
-bool MALNumberType::isEqualTo(MALTypePtr other)
+bool MALSymbolType::isEqualTo(const MALValue& other)
 {
-    if (other->type() != this->type()) {
-        return false;
-    }
-    auto castOther = std::dynamic_pointer_cast<MALNumberType>(other);
-    return castOther->value == this->value;
+    return other.type() == MALType::Types::Symbol && static_cast<MALSymbolType*>(other.ptr().get())->canonical == this->canonical;
 }
 
-std::string MALNumberType::to_string(bool print_readably)
+void MALSymbolType::print(std::string& out, bool print_readably)
 {
-    auto dec = abs(this->value) - abs(floor(this->value));
-    if (dec != 0) {
-        return std::to_string(this->value);
+    out += this->name;
+}
+
+// Leaves up to this length are merged when they meet, so appending short
+// pieces one at a time does not leave one node per piece.
+static const size_t shortLeafLength = 256;
+
+Ref<MALStringNode> MALStringNode::leaf(Ref<MALStringBuffer> buffer, size_t from, size_t length)
+{
+    Ref<MALStringNode> result(new MALStringNode());
+    result->buffer = std::move(buffer);
+    result->from = from;
+    result->length = length;
+    return result;
+}
+
+Ref<MALStringNode> MALStringNode::leaf(std::string text)
+{
+    auto length = text.size();
+    return leaf(Ref<MALStringBuffer>(new MALStringBuffer(std::move(text))), 0, length);
+}
+
+static Ref<MALStringNode> joinNodes(const Ref<MALStringNode>& left, const Ref<MALStringNode>& right)
+{
+    Ref<MALStringNode> result(new MALStringNode());
+    result->left = left;
+    result->right = right;
+    result->length = left->length + right->length;
+    result->depth = std::max(left->depth, right->depth) + 1;
+    return result;
+}
+
+static Ref<MALStringNode> mergeLeaves(const Ref<MALStringNode>& left, const Ref<MALStringNode>& right)
+{
+    std::string text;
+    text.reserve(left->length + right->length);
+    text.append(left->leafText());
+    text.append(right->leafText());
+    return MALStringNode::leaf(std::move(text));
+}
+
+// Joins two balanced ropes whose depths differ by at most two, rotating the
+// deeper one when they differ by two.
+static Ref<MALStringNode> balanceNodes(const Ref<MALStringNode>& left, const Ref<MALStringNode>& right)
+{
+    if (left->depth > right->depth + 1) {
+        if (left->left->depth >= left->right->depth) {
+            return joinNodes(left->left, joinNodes(left->right, right));
+        }
+        return joinNodes(joinNodes(left->left, left->right->left), joinNodes(left->right->right, right));
     }
-    return std::to_string((int)this->value);
+    if (right->depth > left->depth + 1) {
+        if (right->right->depth >= right->left->depth) {
+            return joinNodes(joinNodes(left, right->left), right->right);
+        }
+        return joinNodes(joinNodes(left, right->left->left), joinNodes(right->left->right, right->right));
+    }
+    return joinNodes(left, right);
 }
 
-MALTypePtr MALSymbolType::deepCopy() {
-    return std::shared_ptr<MALSymbolType>(new MALSymbolType(this->name));
+Ref<MALStringNode> MALStringNode::concat(const Ref<MALStringNode>& left, const Ref<MALStringNode>& right)
+{
+    if (left->length == 0) {
+        return right;
+    }
+    if (right->length == 0) {
+        return left;
+    }
+    if (left->isLeaf() && right->isLeaf() && left->length + right->length <= shortLeafLength) {
+        return mergeLeaves(left, right);
+    }
+    //descend the deeper side until both are about as deep, as in an AVL join
+    if (left->depth > right->depth + 1) {
+        return balanceNodes(left->left, concat(left->right, right));
+    }
+    if (right->depth > left->depth + 1) {
+        return balanceNodes(concat(left, right->left), right->right);
+    }
+    if (!left->isLeaf() && right->isLeaf() && left->right->isLeaf() && left->right->length + right->length <= shortLeafLength) {
+        return balanceNodes(left->left, mergeLeaves(left->right, right));
+    }
+    if (left->isLeaf() && !right->isLeaf() && right->left->isLeaf() && left->length + right->left->length <= shortLeafLength) {
+        return balanceNodes(mergeLeaves(left, right->left), right->right);
+    }
+    return joinNodes(left, right);
 }
 
-bool MALSymbolType::isEqualTo(MALTypePtr other)
+void MALStringNode::appendTo(std::string& out) const
 {
-    if (other->type() != this->type()) {
-        return false;
+    if (this->isLeaf()) {
+        out.append(this->leafText());
+        return;
     }
-    auto castOther = std::dynamic_pointer_cast<MALSymbolType>(other);
-    return castOther->name == this->name;
+    this->left->appendTo(out);
+    this->right->appendTo(out);
+}
+
+MALStringType::MALStringType(std::string value) : rope(MALStringNode::leaf(std::move(value))) {}
+
+Ref<MALStringType> MALStringType::concat(const Ref<MALStringType>& left, const Ref<MALStringType>& right)
+{
+    return Ref<MALStringType>(new MALStringType(MALStringNode::concat(left->rope, right->rope)));
 }
 
-std::string MALSymbolType::to_string(bool print_readably)
+std::string_view MALStringType::value()
 {
-    return this->name;
+    if (!this->rope->isLeaf()) {
+        std::string text;
+        text.reserve(this->rope->length);
+        this->rope->appendTo(text);
+        this->rope = MALStringNode::leaf(std::move(text));
+    }
+    return this->rope->leafText();
 }
 
-MALTypePtr MALStringType::deepCopy() {
-    return std::shared_ptr<MALStringType>(new MALStringType(this->value));
+MALValue MALStringType::deepCopy() {
+    //the text is immutable, so the copy can share it
+    return Ref<MALStringType>(new MALStringType(this->rope));
 }
 
-bool MALStringType::isEqualTo(MALTypePtr other)
+bool MALStringType::isEqualTo(const MALValue& other)
 {
-    if (other->type() != this->type()) {
+    if (other.type() != this->type()) {
+        return false;
+    }
+    auto castOther = malCast<MALStringType>(other);
+    if (castOther->size() != this->size()) {
         return false;
     }
-    auto castOther = std::dynamic_pointer_cast<MALStringType>(other);
-    return castOther->value == this->value;
+    if (castOther->cachedHash != 0 && this->cachedHash != 0 && castOther->cachedHash != this->cachedHash) {
+        return false;
+    }
+    return castOther->value() == this->value();
+}
+
+size_t MALStringType::hash()
+{
+    if (this->cachedHash == 0) {
+        auto hash = hashString(this->value());
+        this->cachedHash = hash != 0 ? hash : 1;
+    }
+    return this->cachedHash;
 }
 
-std::string MALStringType::to_string(bool print_readably)
+void MALStringType::print(std::string& out, bool print_readably)
 {
-    if (print_readably) {
-        std::string result = this->value;
+    if (print_readably && this->value().find_first_of("\n\\\"") != std::string_view::npos) {
+        std::string result(this->value());
         replaceAll(result, "\n", "\\n");
         replaceAll(result, "\\", "\\\\");
         replaceAll(result, "\"", "\\\"");
-        return result;
+        out += result;
+    }
+    else if (print_readably) {
+        out += this->value();
     }
     else {
-        return this->value;
+        //no need to flatten the rope just to copy it out
+        this->rope->appendTo(out);
+    }
+}
+
+Ref<MalKeywordType> MalKeywordType::intern(std::string_view value)
+{
+    static std::unordered_map<std::string_view, Ref<MalKeywordType>> table;
+    auto got = table.find(value);
+    if (got != table.end()) {
+        return got->second;
     }
+    ReadArenaPause pause;
+    Ref<MalKeywordType> keyword(new MalKeywordType(std::string(value), table.size()));
+    table.insert(std::pair<std::string_view, Ref<MalKeywordType>>(keyword->value, keyword));
+    return keyword;
 }
 
-MALTypePtr MALNilType::deepCopy() {
-    return MALNilType::Nil;
+MALValue MalKeywordType::deepCopy() {
+    return Ref<MALType>(this);
 }
 
-bool MALNilType::isEqualTo(MALTypePtr other)
+bool MalKeywordType::isEqualTo(const MALValue& other)
 {
-    return other->type() == this->type();
+    return other.isHeap() && &*other.ptr() == this;
 }
 
-std::string MALNilType::to_string(bool print_readably)
+size_t MalKeywordType::hash()
 {
-    return "nil";
+    //keep :a apart from the string "a"
+    return combineHash((size_t)MALType::Types::Keyword, this->nameHash);
 }
 
-MALTypePtr MALBoolType::deepCopy() {
-    return std::shared_ptr<MALBoolType>(new MALBoolType(this->value));
+void MalKeywordType::print(std::string& out, bool print_readably)
+{
+    out += ':';
+    out += this->value;
 }
 
-bool MALBoolType::isEqualTo(MALTypePtr other)
+// Copies a node that other vectors still point to, so it can be changed.
+static void makeWritable(Ref<MALVectorNode>& node)
 {
-    if (other->type() != this->type()) {
-        return false;
+    if (node.useCount() != 1) {
+        node = Ref<MALVectorNode>(new MALVectorNode(*node));
     }
-    auto castOther = std::dynamic_pointer_cast<MALBoolType>(other);
-    return castOther->value == this->value;
 }
 
-std::string MALBoolType::to_string(bool print_readably)
+MALVectorType::MALVectorType(const std::vector<MALValue>& values) : MALVectorType()
 {
-    return this->value ? "true" : "false";
+    for (auto p = values.begin(); p != values.end(); p++) {
+        this->push_back(*p);
+    }
 }
 
-MALTypePtr MalKeywordType::deepCopy() {
-    return std::shared_ptr<MalKeywordType>(new MalKeywordType(this->value));
+MALVectorNode* MALVectorType::leafFor(size_t pos) const
+{
+    if (pos >= this->tailOffset()) {
+        return this->tail.get();
+    }
+    MALVectorNode* node = this->root.get();
+    for (unsigned int level = this->shift; level > 0; level -= bits) {
+        node = node->children[(pos >> level) & mask].get();
+    }
+    return node;
 }
 
-bool MalKeywordType::isEqualTo(MALTypePtr other)
+Ref<MALVectorNode> MALVectorType::newPath(unsigned int level, Ref<MALVectorNode> node)
 {
-    if (other->type() != this->type()) {
-        return false;
+    if (level == 0) {
+        return node;
+    }
+    Ref<MALVectorNode> branch(new MALVectorNode());
+    branch->children.push_back(newPath(level - bits, node));
+    return branch;
+}
+
+void MALVectorType::pushTail(unsigned int level, Ref<MALVectorNode>& parent, Ref<MALVectorNode> tailNode)
+{
+    makeWritable(parent);
+    size_t index = ((this->count - 1) >> level) & mask;
+    if (level == bits) {
+        parent->children.push_back(tailNode);
+    }
+    else if (index < parent->children.size()) {
+        this->pushTail(level - bits, parent->children[index], tailNode);
+    }
+    else {
+        parent->children.push_back(newPath(level - bits, tailNode));
+    }
+}
+
+void MALVectorType::push_back(MALValue value)
+{
+    this->invalidateHash();
+    if (this->count - this->tailOffset() < width) {
+        makeWritable(this->tail);
+        this->tail->values.push_back(value);
+        this->count++;
+        return;
+    }
+    //the tail is full: move it into the trie and start a new one
+    if ((this->count >> bits) > ((size_t)1 << this->shift)) {
+        Ref<MALVectorNode> newRoot(new MALVectorNode());
+        newRoot->children.push_back(this->root);
+        newRoot->children.push_back(newPath(this->shift, this->tail));
+        this->root = newRoot;
+        this->shift += bits;
+    }
+    else {
+        this->pushTail(this->shift, this->root, this->tail);
+    }
+    this->tail = Ref<MALVectorNode>(new MALVectorNode());
+    this->tail->values.push_back(value);
+    this->count++;
+}
+
+void MALVectorType::setAt(size_t pos, MALValue value)
+{
+    this->invalidateHash();
+    if (pos >= this->tailOffset()) {
+        makeWritable(this->tail);
+        this->tail->values[pos & mask] = value;
+        return;
+    }
+    Ref<MALVectorNode>* node = &this->root;
+    makeWritable(*node);
+    for (unsigned int level = this->shift; level > 0; level -= bits) {
+        node = &(*node)->children[(pos >> level) & mask];
+        makeWritable(*node);
     }
-    auto castOther = std::dynamic_pointer_cast<MalKeywordType>(other);
-    return castOther->value == this->value;
+    (*node)->values[pos & mask] = value;
+}
+
+Ref<MALVectorType> MALVectorType::conj(MALValue value)
+{
+    Ref<MALVectorType> result(new MALVectorType(*this));
+    result->push_back(value);
+    return result;
+}
+
+Ref<MALVectorType> MALVectorType::assocAt(size_t pos, MALValue value)
+{
+    Ref<MALVectorType> result(new MALVectorType(*this));
+    result->setAt(pos, value);
+    return result;
 }
 
-std::string MalKeywordType::to_string(bool print_readably)
+std::vector<MALValue> MALVectorType::toVector()
 {
-    return ":" + this->value;
+    std::vector<MALValue> result;
+    result.reserve(this->count);
+    for (size_t i = 0; i < this->count; i += width) {
+        auto leaf = this->leafFor(i);
+        result.insert(result.end(), leaf->values.begin(), leaf->values.end());
+    }
+    return result;
+}
+
+MALValue MALVectorType::deepCopy() {
+    auto result = Ref<MALVectorType>(new MALVectorType());
+    auto values = this->toVector();
+    for (auto p = values.begin(); p != values.end(); p++) {
+        result->push_back(p->deepCopy());
+    }
+    return result;
 }
 
-MALTypePtr MALVectorType::deepCopy() {
-    auto result = std::shared_ptr<MALVectorType>(new MALVectorType());
-    for (auto p = this->values.begin(); p != this->values.end(); p++) {
-        auto malType = *p;
-        result->values.push_back(malType->deepCopy());
+size_t MALVectorType::computeHash()
+{
+    size_t result = (size_t)MALType::Types::Vector;
+    for (size_t i = 0; i < this->count; i += width) {
+        auto leaf = this->leafFor(i);
+        for (auto p = leaf->values.begin(); p != leaf->values.end(); p++) {
+            result = combineHash(result, p->hash());
+        }
     }
     return result;
 }
 
-bool MALVectorType::isEqualTo(MALTypePtr other)
+bool MALVectorType::isEqualTo(const MALValue& other)
 {
-    if (other->type() != this->type()) {
+    if (other.type() != this->type()) {
         return false;
     }
-    auto castOther = std::dynamic_pointer_cast<MALVectorType>(other);
-    if (castOther->size() != this->size()) {
+    auto castOther = malCast<MALVectorType>(other);
+    if (castOther->size() != this->size() || this->hashDiffers(castOther.get())) {
         return false;
     }
-    for (int i = 0; i < this->size(); i++) {
-        if (!(this->values[i]->isEqualTo(castOther->values[i]))) {
-            return false;
+    for (size_t i = 0; i < this->count; i += width) {
+        auto leaf = this->leafFor(i);
+        auto otherLeaf = castOther->leafFor(i);
+        if (leaf == otherLeaf) {
+            continue;
+        }
+        for (size_t j = 0; j < leaf->values.size(); j++) {
+            if (!(leaf->values[j].isEqualTo(otherLeaf->values[j]))) {
+                return false;
+            }
         }
     }
     return true;
 }
 
-std::string MALVectorType::to_string(bool print_readably)
+void MALVectorType::print(std::string& out, bool print_readably)
 {
-    std::string result = "";
-    auto size = this->values.size();
-    for (int i = 0; i < size; i++) {
-        result += this->values[i]->to_string(print_readably);
-        if (i != size - 1) {
-            result += " ";
+    out += '[';
+    for (size_t i = 0; i < this->count; i += width) {
+        auto leaf = this->leafFor(i);
+        for (auto p = leaf->values.begin(); p != leaf->values.end(); p++) {
+            if (i > 0 || p != leaf->values.begin()) {
+                out += ' ';
+            }
+            p->print(out, print_readably);
         }
     }
-    return "[" + result + "]";
+    out += ']';
 }
 
-MALTypePtr MALHashMapType::deepCopy() {
-    auto result = std::shared_ptr<MALHashMapType>(new MALHashMapType());
-    for (auto p = this->values.begin(); p != this->values.end(); p++) {
-        auto malType = *p;
-        result->values.insert(std::pair<MALTypePtr, MALTypePtr>(p->first->deepCopy(), p->second->deepCopy()));
+static const unsigned int hashMapBits = 5;
+static const unsigned int hashBitCount = sizeof(size_t) * 8;
+
+static unsigned int bitCount(unsigned int bits)
+{
+    unsigned int result = 0;
+    for (; bits != 0; bits &= bits - 1) {
+        result++;
     }
     return result;
 }
 
-bool MALHashMapType::isEqualTo(MALTypePtr other)
+static unsigned int slotBit(size_t hash, unsigned int shift)
+{
+    return 1u << ((hash >> shift) & 31);
+}
+
+// Copies a node that other maps still point to, so it can be changed.
+static void makeWritable(Ref<MALHashMapNode>& node)
 {
-    if (other->type() != this->type()) {
+    if (node.useCount() != 1) {
+        node = Ref<MALHashMapNode>(new MALHashMapNode(*node));
+    }
+}
+
+static MALHashMapEntry* findEntry(MALHashMapNode* node, size_t hash, const MALValue& key)
+{
+    for (unsigned int shift = 0; ; shift += hashMapBits) {
+        if (shift >= hashBitCount) {
+            for (auto p = node->entries.begin(); p != node->entries.end(); p++) {
+                if (p->key.isEqualTo(key)) {
+                    return &*p;
+                }
+            }
+            return nullptr;
+        }
+        auto bit = slotBit(hash, shift);
+        if ((node->bitmap & bit) == 0) {
+            return nullptr;
+        }
+        auto& entry = node->entries[bitCount(node->bitmap & (bit - 1))];
+        if (entry.node == nullptr) {
+            return entry.hash == hash && entry.key.isEqualTo(key) ? &entry : nullptr;
+        }
+        node = entry.node.get();
+    }
+}
+
+// Returns true when the key was not in the trie yet.
+static bool assocEntry(Ref<MALHashMapNode>& node, unsigned int shift, size_t hash, const MALValue& key, const MALValue& value)
+{
+    makeWritable(node);
+    if (shift >= hashBitCount) {
+        for (auto p = node->entries.begin(); p != node->entries.end(); p++) {
+            if (p->key.isEqualTo(key)) {
+                p->value = value;
+                return false;
+            }
+        }
+        node->entries.push_back(MALHashMapEntry{ hash, key, value, nullptr });
+        return true;
+    }
+    auto bit = slotBit(hash, shift);
+    auto index = bitCount(node->bitmap & (bit - 1));
+    if ((node->bitmap & bit) == 0) {
+        node->entries.insert(node->entries.begin() + index, MALHashMapEntry{ hash, key, value, nullptr });
+        node->bitmap |= bit;
+        return true;
+    }
+    auto& entry = node->entries[index];
+    if (entry.node != nullptr) {
+        return assocEntry(entry.node, shift + hashMapBits, hash, key, value);
+    }
+    if (entry.hash == hash && entry.key.isEqualTo(key)) {
+        entry.value = value;
         return false;
     }
-    auto castOther = std::dynamic_pointer_cast<MALHashMapType>(other);
-    if (castOther->size() != this->size()) {
+    //two keys share this slot: move both one level down
+    Ref<MALHashMapNode> child(new MALHashMapNode());
+    assocEntry(child, shift + hashMapBits, entry.hash, entry.key, entry.value);
+    assocEntry(child, shift + hashMapBits, hash, key, value);
+    entry = MALHashMapEntry{ 0, nullptr, nullptr, child };
+    return true;
+}
+
+// The key must be in the trie.
+static void dissocEntry(Ref<MALHashMapNode>& node, unsigned int shift, size_t hash, const MALValue& key)
+{
+    makeWritable(node);
+    if (shift >= hashBitCount) {
+        for (auto p = node->entries.begin(); p != node->entries.end(); p++) {
+            if (p->key.isEqualTo(key)) {
+                node->entries.erase(p);
+                return;
+            }
+        }
+        return;
+    }
+    auto bit = slotBit(hash, shift);
+    auto index = bitCount(node->bitmap & (bit - 1));
+    auto& entry = node->entries[index];
+    if (entry.node != nullptr) {
+        dissocEntry(entry.node, shift + hashMapBits, hash, key);
+        auto& childEntries = entry.node->entries;
+        if (childEntries.size() > 1 || (childEntries.size() == 1 && childEntries[0].node != nullptr)) {
+            return;
+        }
+        if (childEntries.size() == 1) {
+            //a single pair left below: pull it up into this slot
+            MALHashMapEntry pair = childEntries[0];
+            entry = pair;
+            return;
+        }
+    }
+    node->entries.erase(node->entries.begin() + index);
+    node->bitmap &= ~bit;
+}
+
+// The shape of the trie only depends on the hashes of its keys, so tries
+// holding equal keys line up slot by slot. Subtries shared by both maps are
+// skipped; colliding keys at the bottom can be in any order.
+static bool sameEntries(MALHashMapNode* node, MALHashMapNode* other, unsigned int shift)
+{
+    if (node == other) {
+        return true;
+    }
+    if (shift >= hashBitCount) {
+        if (node->entries.size() != other->entries.size()) {
+            return false;
+        }
+        for (auto p = node->entries.begin(); p != node->entries.end(); p++) {
+            auto r = other->entries.begin();
+            while (r != other->entries.end() && !(r->key.isEqualTo(p->key))) {
+                r++;
+            }
+            if (r == other->entries.end() || !(p->value.isEqualTo(r->value))) {
+                return false;
+            }
+        }
+        return true;
+    }
+    if (node->bitmap != other->bitmap) {
         return false;
     }
-    auto r = castOther->values.begin();
-    for (auto p = this->values.begin(); p != this->values.end(); p++, r++) {
-        auto otherSymbol = std::dynamic_pointer_cast<MALType>(r->first);
-        auto got = this->values.find(otherSymbol);
-        //check if both have the same keys
-        if (got == this->values.end()) {
+    for (size_t i = 0; i < node->entries.size(); i++) {
+        auto& entry = node->entries[i];
+        auto& otherEntry = other->entries[i];
+        if ((entry.node == nullptr) != (otherEntry.node == nullptr)) {
             return false;
         }
-        //check if values are different
-        if (!(p->second->isEqualTo(r->second))) {
+        if (entry.node != nullptr) {
+            if (!sameEntries(entry.node.get(), otherEntry.node.get(), shift + hashMapBits)) {
+                return false;
+            }
+        }
+        else if (entry.hash != otherEntry.hash || !(entry.key.isEqualTo(otherEntry.key)) || !(entry.value.isEqualTo(otherEntry.value))) {
             return false;
         }
     }
     return true;
 }
 
-std::string MALHashMapType::to_string(bool print_readably)
+static void collectEntries(MALHashMapNode* node, std::vector<std::pair<MALValue, MALValue>>& result)
 {
-    std::string result = "";
-    auto size = this->values.size();
-    int i = 0;
-    for (auto p = this->values.begin(); p != this->values.end(); p++, i++) {
-        auto pair = *p;
-        result += pair.first->to_string(print_readably) + " ";
-        result += pair.second->to_string(print_readably);
-        if (i != size - 1) {
-            result += " ";
+    for (auto p = node->entries.begin(); p != node->entries.end(); p++) {
+        if (p->node != nullptr) {
+            collectEntries(p->node.get(), result);
+        }
+        else {
+            result.push_back(std::pair<MALValue, MALValue>(p->key, p->value));
         }
     }
-    return "{" + result + "}";
 }
 
-MALTypePtr MALFuncType::deepCopy() {
-    return std::shared_ptr<MALFuncType>(new MALFuncType(this->name, this->env, this->bindingsList, this->funcBody));
+MALValue MALHashMapType::get(const MALValue& key)
+{
+    auto entry = findEntry(this->root.get(), key.hash(), key);
+    return entry != nullptr ? entry->value : nullptr;
+}
+
+bool MALHashMapType::contains(const MALValue& key)
+{
+    return findEntry(this->root.get(), key.hash(), key) != nullptr;
+}
+
+void MALHashMapType::set(MALValue key, MALValue value)
+{
+    this->invalidateHash();
+    if (assocEntry(this->root, 0, key.hash(), key, value)) {
+        this->count++;
+    }
+}
+
+void MALHashMapType::remove(const MALValue& key)
+{
+    auto hash = key.hash();
+    if (findEntry(this->root.get(), hash, key) == nullptr) {
+        return;
+    }
+    this->invalidateHash();
+    dissocEntry(this->root, 0, hash, key);
+    this->count--;
+}
+
+Ref<MALHashMapType> MALHashMapType::assoc(MALValue key, MALValue value)
+{
+    Ref<MALHashMapType> result(new MALHashMapType(*this));
+    result->set(key, value);
+    return result;
+}
+
+Ref<MALHashMapType> MALHashMapType::dissoc(const MALValue& key)
+{
+    Ref<MALHashMapType> result(new MALHashMapType(*this));
+    result->remove(key);
+    return result;
+}
+
+std::vector<std::pair<MALValue, MALValue>> MALHashMapType::entries()
+{
+    std::vector<std::pair<MALValue, MALValue>> result;
+    result.reserve(this->count);
+    collectEntries(this->root.get(), result);
+    return result;
+}
+
+MALValue MALHashMapType::deepCopy() {
+    auto result = Ref<MALHashMapType>(new MALHashMapType());
+    auto entries = this->entries();
+    for (auto p = entries.begin(); p != entries.end(); p++) {
+        result->set(p->first.deepCopy(), p->second.deepCopy());
+    }
+    return result;
 }
 
-bool MALFuncType::isEqualTo(MALTypePtr other)
+bool MALHashMapType::isEqualTo(const MALValue& other)
 {
-    if (other->type() != this->type()) {
+    if (other.type() != this->type()) {
+        return false;
+    }
+    auto castOther = malCast<MALHashMapType>(other);
+    if (castOther->size() != this->size() || this->hashDiffers(castOther.get())) {
         return false;
     }
-    auto castOther = std::dynamic_pointer_cast<MALFuncType>(other);
+    return sameEntries(this->root.get(), castOther->root.get(), 0);
+}
 
-    return &(*other) == this;
+size_t MALHashMapType::computeHash()
+{
+    //entry order depends on the trie layout, so combine without order
+    size_t result = (size_t)MALType::Types::HashMap;
+    auto entries = this->entries();
+    for (auto p = entries.begin(); p != entries.end(); p++) {
+        result += combineHash(p->first.hash(), p->second.hash());
+    }
+    return result;
 }
 
-std::string MALFuncType::to_string(bool print_readably)
+static void printEntries(MALHashMapNode* node, std::string& out, bool print_readably, bool& first)
 {
-    return "<function:" + this->name + ">";
+    for (auto p = node->entries.begin(); p != node->entries.end(); p++) {
+        if (p->node != nullptr) {
+            printEntries(p->node.get(), out, print_readably, first);
+            continue;
+        }
+        if (!first) {
+            out += ' ';
+        }
+        first = false;
+        p->key.print(out, print_readably);
+        out += ' ';
+        p->value.print(out, print_readably);
+    }
 }
 
-MALTypePtr MALBuiltinFuncType::deepCopy()
+void MALHashMapType::print(std::string& out, bool print_readably)
 {
-    return std::shared_ptr<MALBuiltinFuncType>(new MALBuiltinFuncType(this->name, this->fn));
+    bool first = true;
+    out += '{';
+    printEntries(this->root.get(), out, print_readably, first);
+    out += '}';
+}
+
+MALFuncType::MALFuncType(std::string name, Ref<Env> env, Ref<MALSequenceType> bindingsList, MALValue funcBody)
+    : MALCallableType(name), env(env), bindingsList(bindingsList), funcBody(funcBody) {}
+
+MALFuncType::~MALFuncType() {}
+
+MALValue MALFuncType::deepCopy() {
+    Ref<MALFuncType> copy(new MALFuncType(this->name, this->env, this->bindingsList, this->funcBody));
+    copy->code = this->code;
+    copy->lambda = this->lambda;
+    return copy;
 }
 
-bool MALBuiltinFuncType::isEqualTo(MALTypePtr other)
+bool MALFuncType::isEqualTo(const MALValue& other)
 {
-    if (other->type() != this->type()) {
+    if (other.type() != this->type()) {
         return false;
     }
-    auto castOther = std::dynamic_pointer_cast<MALBuiltinFuncType>(other);
+    return other.isHeap() && &*other.ptr() == this;
+}
 
-    return &(*other) == this;
+void MALFuncType::print(std::string& out, bool print_readably)
+{
+    out += "<function:";
+    out += this->name;
+    out += '>';
 }
 
-std::string MALBuiltinFuncType::to_string(bool print_readably)
+MALValue MALBuiltinFuncType::deepCopy()
 {
-    return "<builtin:" + this->name + ">";
+    return Ref<MALBuiltinFuncType>(new MALBuiltinFuncType(this->name, this->target, this->thunk));
 }
 
-std::string MALAtomType::to_string(bool print_readably)
+bool MALBuiltinFuncType::isEqualTo(const MALValue& other)
 {
-    return "*" + this->ref->to_string(print_readably);
+    if (other.type() != this->type()) {
+        return false;
+    }
+    return other.isHeap() && &*other.ptr() == this;
 }
 
-bool MALAtomType::isEqualTo(MALTypePtr other)
+void MALBuiltinFuncType::print(std::string& out, bool print_readably)
 {
-    if (other->type() != this->type()) {
+    out += "<builtin:";
+    out += this->name;
+    out += '>';
+}
+
+void MALAtomType::print(std::string& out, bool print_readably)
+{
+    out += '*';
+    this->ref.print(out, print_readably);
+}
+
+bool MALAtomType::isEqualTo(const MALValue& other)
+{
+    if (other.type() != this->type()) {
         return false;
     }
-    auto castOther = std::dynamic_pointer_cast<MALAtomType>(other);
-    return this->ref->isEqualTo(castOther->ref);
+    auto castOther = malCast<MALAtomType>(other);
+    return this->ref.isEqualTo(castOther->ref);
+}
+
+size_t MALAtomType::hash()
+{
+    //atoms compare by their current content, which can change
+    return (size_t)MALType::Types::Atom;
 }
 
-MALTypePtr MALAtomType::deepCopy()
+MALValue MALAtomType::deepCopy()
 {
-    return std::shared_ptr<MALAtomType>(new MALAtomType(this->ref));
+    return Ref<MALAtomType>(new MALAtomType(this->ref));
 }
@@ -6,23 +6,34 @@
 #include <map>
 #include <functional>
 #include <unordered_map>
+#include <string_view>
+#include <new>
+#include <iterator>
+#include <assert.h>
+
+#include "Ref.h"
+#include "Collector.h"
 
 #pragma once
 
-#define MALTypePtr std::shared_ptr<MALType>
-#define MALListTypePtr std::shared_ptr<MALListType>
-#define MALSymbolTypePtr std::shared_ptr<MALSymbolType>
+#define MALListTypePtr Ref<MALListType>
+#define MALSymbolTypePtr Ref<MALSymbolType>
 
 class Env;
+class Bytecode;
+class Lambda;
+class FormExpansion;
+class MALValue;
 class MALSymbolType;
 class MALListType;
 class MALSequenceType;
 class MALCallableType;
-class MALBoolType;
 
-class MALType : public std::enable_shared_from_this<MALType>
+class MALType : public RefCounted
 {
 public:
+	virtual ~MALType() = default;
+
 	enum Types {
 		List,
 		Number,
@@ -39,79 +50,140 @@ public:
 
 	static std::string typeToString(Types t);
 
-	bool is_macro;
-	virtual std::string to_string(bool print_readably) = 0;
+	// Appends the printed form to out, so nested values print into one buffer.
+	virtual void print(std::string& out, bool print_readably) = 0;
+	std::string to_string(bool print_readably) {
+		std::string out;
+		this->print(out, print_readably);
+		return out;
+	}
 	virtual MALType::Types type() const = 0;
 	virtual const bool isContainer() const = 0;
 	virtual bool isSequence() { return false; };
-	virtual bool isEqualTo(MALTypePtr other) = 0;
-	virtual MALTypePtr deepCopy() = 0;
+	virtual bool isEqualTo(const MALValue& other) = 0;
+	virtual MALValue deepCopy() = 0;
+	// Structural hash: values that are equal hash the same.
+	virtual size_t hash() = 0;
+};
 
-	bool tryAsSymbol(std::shared_ptr<MALSymbolType>& ptr) {
-		if (type() != Types::Symbol) {
-			ptr = nullptr;
-			return false;
-		}
-		ptr = std::dynamic_pointer_cast<MALSymbolType>(this->shared_from_this());
-		return true;
-	}
+// FNV-1a hash of a string, used for strings, symbols and keywords.
+size_t hashString(std::string_view text);
 
-	bool tryAsList(std::shared_ptr<MALListType>& ptr) {
-		if (type() != Types::List) {
-			ptr = nullptr;
-			return false;
+// A MAL value. Numbers, booleans and nil are stored inline; every other type
+// lives on the heap as a MALType. A default constructed value is empty and
+// compares equal to nullptr.
+class MALValue
+{
+	enum class Storage : unsigned char { Empty, Inline, Heap };
+	Storage storage;
+	MALType::Types tag;
+	union {
+		double numberValue;
+		bool boolValue;
+		Ref<MALType> heap;
+	};
+
+	MALValue(MALType::Types tag) : storage(Storage::Inline), tag(tag), numberValue(0) {}
+	void release() {
+		if (storage == Storage::Heap) {
+			heap.~Ref<MALType>();
 		}
-		ptr = std::dynamic_pointer_cast<MALListType>(this->shared_from_this());
-		return true;
 	}
-
-	bool tryAsCallable(std::shared_ptr<MALCallableType>& ptr) {
-		if (type() != Types::Function) {
-			ptr = nullptr;
-			return false;
+	void copyFrom(const MALValue& other) {
+		storage = other.storage;
+		tag = other.tag;
+		if (storage == Storage::Heap) {
+			new (&heap) Ref<MALType>(other.heap);
+		}
+		else {
+			numberValue = other.numberValue;
 		}
-		ptr = std::dynamic_pointer_cast<MALCallableType>(this->shared_from_this());
-		return true;
 	}
-
-	bool tryAsSequence(std::shared_ptr<MALSequenceType>& ptr) {
-		if (!isSequence()) {
-			ptr = nullptr;
-			return false;
+	void moveFrom(MALValue& other) {
+		storage = other.storage;
+		tag = other.tag;
+		if (storage == Storage::Heap) {
+			new (&heap) Ref<MALType>(std::move(other.heap));
+			other.heap.~Ref<MALType>();
+			other.storage = Storage::Empty;
+		}
+		else {
+			numberValue = other.numberValue;
 		}
-		ptr = std::dynamic_pointer_cast<MALSequenceType>(this->shared_from_this());
-		return true;
 	}
-
-	bool tryAsBool(std::shared_ptr<MALBoolType>& ptr) {
-		if (type() != Types::Bool) {
-			ptr = nullptr;
-			return false;
+public:
+	MALValue() : storage(Storage::Empty), tag(MALType::Types::Nil), numberValue(0) {}
+	MALValue(std::nullptr_t) : MALValue() {}
+	template<class T>
+	MALValue(const Ref<T>& ptr) : MALValue() {
+		if (ptr != nullptr) {
+			storage = Storage::Heap;
+			tag = ptr->type();
+			new (&heap) Ref<MALType>(ptr);
 		}
-		ptr = std::dynamic_pointer_cast<MALBoolType>(this->shared_from_this());
-		return true;
 	}
-
-	std::shared_ptr<MALSymbolType> asSymbol() {
-		if (type() != Types::Symbol) {
-			return nullptr;
+	MALValue(const MALValue& other) { copyFrom(other); }
+	MALValue(MALValue&& other) noexcept { moveFrom(other); }
+	~MALValue() { release(); }
+	// The old value is released last: it may own the one being assigned.
+	MALValue& operator=(const MALValue& other) {
+		if (this != &other) {
+			MALValue old(std::move(*this));
+			copyFrom(other);
 		}
-		return std::dynamic_pointer_cast<MALSymbolType>(this->shared_from_this());
+		return *this;
 	}
-
-	std::shared_ptr<MALSequenceType> asSequence() {
-		if (!isSequence()) {
-			return nullptr;
+	MALValue& operator=(MALValue&& other) noexcept {
+		if (this != &other) {
+			MALValue old(std::move(*this));
+			moveFrom(other);
 		}
-		return std::dynamic_pointer_cast<MALSequenceType>(this->shared_from_this());
+		return *this;
 	}
 
-	std::shared_ptr<MALListType> asList() {
-		if (type() != Types::List) {
-			return nullptr;
-		}
-		return std::dynamic_pointer_cast<MALListType>(this->shared_from_this());
+	static MALValue number(double value) {
+		MALValue result(MALType::Types::Number);
+		result.numberValue = value;
+		return result;
+	}
+	static MALValue boolean(bool value) {
+		MALValue result(MALType::Types::Bool);
+		result.boolValue = value;
+		return result;
 	}
+	static MALValue nil() { return MALValue(MALType::Types::Nil); }
+
+	bool operator==(std::nullptr_t) const { return storage == Storage::Empty; }
+	bool operator!=(std::nullptr_t) const { return storage != Storage::Empty; }
+
+	MALType::Types type() const { return tag; }
+	bool isHeap() const { return storage == Storage::Heap; }
+	// The heap object behind a container, string, symbol, function... value.
+	const Ref<MALType>& ptr() const { return heap; }
+	double asNumber() const { return numberValue; }
+	bool asBool() const { return boolValue; }
+	// nil and false are the only falsy values.
+	bool isTruthy() const { return !(tag == MALType::Types::Nil || (tag == MALType::Types::Bool && !boolValue)); }
+
+	void print(std::string& out, bool print_readably) const;
+	std::string to_string(bool print_readably) const {
+		std::string out;
+		this->print(out, print_readably);
+		return out;
+	}
+	bool isContainer() const { return isHeap() && heap->isContainer(); }
+	bool isSequence() const { return isHeap() && heap->isSequence(); }
+	bool isEqualTo(const MALValue& other) const;
+	size_t hash() const;
+	MALValue deepCopy() const { return isHeap() ? heap->deepCopy() : *this; }
+
+	bool tryAsSymbol(Ref<MALSymbolType>& ptr) const;
+	bool tryAsList(Ref<MALListType>& ptr) const;
+	bool tryAsCallable(Ref<MALCallableType>& ptr) const;
+	bool tryAsSequence(Ref<MALSequenceType>& ptr) const;
+	Ref<MALSymbolType> asSymbol() const;
+	Ref<MALSequenceType> asSequence() const;
+	Ref<MALListType> asList() const;
 };
 
 class MALLeafType : public MALType
@@ -120,180 +192,419 @@ public:
 	virtual const bool isContainer() const override { return false; };
 };
 
+// Containers cache their structural hash, so hashing a nested value visits
+// each element once and map lookups with a container key do not re-walk it.
+// Updates made in place must call invalidateHash; persistent updates start
+// from a copy and go through them too.
 class MALContainerType : public MALType
 {
+	// 0 means the hash was not computed yet.
+	size_t cachedHash = 0;
+protected:
+	virtual size_t computeHash() = 0;
+	void invalidateHash() { cachedHash = 0; }
+	// Equal containers always have equal hashes, so differing hashes reject
+	// without visiting the elements.
+	bool hashDiffers(MALContainerType* other) { return this->hash() != other->hash(); }
 public:
 	virtual const bool isContainer() const override { return true; };
 	virtual size_t size() = 0;
+	virtual size_t hash() override final;
 };
 
 class MALSequenceType : public MALContainerType
 {
 public:
 	virtual bool isSequence() override { return true; };
-	virtual MALTypePtr getAt(size_t pos) = 0;
-	virtual void setAt(size_t pos, MALTypePtr value) = 0;
-	virtual void push_back(MALTypePtr value) = 0;
+	virtual MALValue getAt(size_t pos) = 0;
+	virtual void setAt(size_t pos, MALValue value) = 0;
+	virtual void push_back(MALValue value) = 0;
+	// Copies the elements out in order.
+	virtual std::vector<MALValue> toVector() = 0;
 };
 
-class MALListType : public MALSequenceType
+// Block of list elements shared by every list that views part of it.
+class MALListChunk : public RefCounted
 {
 public:
-	virtual MALTypePtr deepCopy() override;
-	virtual bool isEqualTo(MALTypePtr other) override;
-	std::vector<MALTypePtr> values;
-	virtual std::string to_string(bool print_readably) override;
-	virtual MALType::Types type() const override { return  MALType::Types::List; }
-	virtual size_t size() override { return values.size(); };
-	virtual MALTypePtr getAt(size_t pos) override { return values[pos]; };
-	virtual void setAt(size_t pos, MALTypePtr value) { values[pos] = value; };
-	virtual void push_back(MALTypePtr value) override {
-		this->values.push_back(value);
-	}
+	std::vector<MALValue> values;
 };
 
-class MALNumberType : public MALLeafType {
+// Persistent list. A list is a chain of segments, each one viewing the range
+// [from, to) of a shared chunk. rest drops the head of the first segment and
+// cons puts a one element segment in front of an existing list, so both are
+// O(1) and share the elements after them. Lists built with push_back keep a
+// single chunk, so getAt is O(1) for them and O(segments) in general.
+// push_back and setAt are only meant for lists that are still being built.
+class MALListType : public MALSequenceType
+{
+	friend class Collector;
+	Ref<MALListChunk> chunk;
+	// 32 bits, so a list stays in the 64 byte size class with its expansion.
+	unsigned int from = 0;
+	unsigned int to = 0;
+	Ref<MALListType> next;
+	size_t length = 0;
+
+	void makeSingleChunk();
 public:
-	virtual MALTypePtr deepCopy() override;
-	virtual bool isEqualTo(MALTypePtr other) override;
-	double value;
-	MALNumberType(double value) : value(value) {}
-	virtual std::string to_string(bool print_readably) override;
-	virtual MALType::Types type() const override { return  MALType::Types::Number; }
+	class Iterator
+	{
+		const MALListType* segment;
+		size_t index;
+	public:
+		using iterator_category = std::forward_iterator_tag;
+		using value_type = MALValue;
+		using difference_type = std::ptrdiff_t;
+		using pointer = const MALValue*;
+		using reference = const MALValue&;
+
+		Iterator(const MALListType* segment) : segment(segment), index(segment != nullptr ? segment->from : 0) {}
+		reference operator*() const { return segment->chunk->values[index]; }
+		pointer operator->() const { return &segment->chunk->values[index]; }
+		Iterator& operator++() {
+			if (++index == segment->to) {
+				segment = segment->next.get();
+				index = segment != nullptr ? segment->from : 0;
+			}
+			return *this;
+		}
+		Iterator operator++(int) { Iterator old = *this; ++*this; return old; }
+		bool operator==(const Iterator& other) const { return segment == other.segment && index == other.index; }
+		bool operator!=(const Iterator& other) const { return !(*this == other); }
+	};
+
+	// Defined in Type.cpp, where FormExpansion is a complete type.
+	MALListType();
+	virtual ~MALListType();
+	// Takes the elements as a single chunk, followed by the elements of next.
+	MALListType(std::vector<MALValue> values, Ref<MALListType> next = nullptr);
+	static Ref<MALListType> cons(MALValue first, Ref<MALListType> rest);
+	Ref<MALListType> rest();
+	Iterator begin() const { return Iterator(this->length > 0 ? this : nullptr); }
+	Iterator end() const { return Iterator(nullptr); }
+
+	virtual MALValue deepCopy() override;
+	virtual bool isEqualTo(const MALValue& other) override;
+	virtual void print(std::string& out, bool print_readably) override;
+	virtual size_t computeHash() override;
+	virtual MALType::Types type() const override { return  MALType::Types::List; }
+	virtual size_t size() override { return length; };
+	virtual MALValue getAt(size_t pos) override;
+	virtual void setAt(size_t pos, MALValue value) override;
+	virtual void push_back(MALValue value) override;
+	virtual std::vector<MALValue> toVector() override { return std::vector<MALValue>(begin(), end()); }
+
+	// Whether this is the binding list of a resolved let* (see Resolver.h).
+	virtual bool isLetBindings() const { return false; }
+
+	// Kept by the evaluator on a form it evaluated (see SpecFormHandler.h);
+	// changing the list drops it.
+	Ref<FormExpansion> expansion;
 };
 
+// Symbols are interned: every name maps to a single canonical instance, so
+// symbols can be compared and hashed by identity.
 class MALSymbolType : public MALLeafType {
+	MALSymbolType(std::string name, size_t id) : name(name), nameHash(hashString(name)), id(id), canonical(this) {}
+protected:
+	// For MALResolvedSymbolType: a copy of an interned symbol.
+	MALSymbolType(MALSymbolType* symbol) : name(symbol->name), nameHash(symbol->nameHash), id(symbol->id), canonical(symbol) {}
 public:
-	virtual MALTypePtr deepCopy() override;
-	virtual bool isEqualTo(MALTypePtr other) override;
-	std::string name;
-	MALSymbolType(std::string name) : name(name) {}
-	virtual std::string to_string(bool print_readably) override;
+	virtual MALValue deepCopy() override;
+	virtual bool isEqualTo(const MALValue& other) override;
+	const std::string name;
+	const size_t nameHash;
+	const size_t id;
+	// The interned instance, which is this one unless this is a resolved reference.
+	MALSymbolType* const canonical;
+	bool isResolved() const { return canonical != this; }
+	virtual size_t hash() override { return nameHash; }
+	virtual void print(std::string& out, bool print_readably) override;
 	virtual MALType::Types type() const override { return  MALType::Types::Symbol; }
+	static MALSymbolTypePtr intern(std::string_view name);
 };
 
-class MALStringType : public MALLeafType {
+// Reference to a variable, resolved when the fn* or let* around it was
+// analysed (see Resolver.h): the variable is in the frame depth hops out along
+// outer, at slot, if that frame was built from the list of names. A reference
+// to a global has no names; depth is then the number of hops to the global
+// environment. For printing, equality and hashing it is the plain symbol, so a
+// macro given one as an argument sees no difference.
+class MALResolvedSymbolType : public MALSymbolType {
 public:
-	virtual MALTypePtr deepCopy() override;
-	virtual bool isEqualTo(MALTypePtr other) override;
-	std::string value;
-	MALStringType(std::string value) : value(value) {}
-	virtual std::string to_string(bool print_readably) override;
-	virtual MALType::Types type() const override { return  MALType::Types::String; }
+	MALResolvedSymbolType(Ref<MALSymbolType> symbol, unsigned int depth, unsigned int slot, Ref<MALSequenceType> names)
+		: MALSymbolType(symbol.get()), symbol(std::move(symbol)), depth(depth), slot(slot), names(std::move(names)) {}
+	// The interned symbol, which canonical points to.
+	const Ref<MALSymbolType> symbol;
+	const unsigned int depth;
+	const unsigned int slot;
+	const Ref<MALSequenceType> names;
+	bool isGlobal() const { return names == nullptr; }
 };
 
-class MALNilType : public MALLeafType {
+// Text shared by the rope leaves cut from it. It is never changed once a leaf
+// points to it.
+class MALStringBuffer : public RefCounted
+{
 public:
-	virtual MALTypePtr deepCopy() override;
-	virtual bool isEqualTo(MALTypePtr other) override;
-	virtual std::string to_string(bool print_readably) override;
-	virtual MALType::Types type() const override { return  MALType::Types::Nil; }
-	static std::shared_ptr<MALNilType> Nil;
+	std::string text;
+	MALStringBuffer(std::string text) : text(std::move(text)) {}
 };
 
-class MALBoolType : public MALLeafType {
+// Rope node. A leaf views length characters of a buffer starting at from; a
+// concatenation joins left and right. Concatenations are kept balanced, so
+// depth is O(log n) in the number of leaves.
+class MALStringNode : public RefCounted
+{
 public:
-	virtual MALTypePtr deepCopy() override;
-	virtual bool isEqualTo(MALTypePtr other) override;
-	bool value;
-	MALBoolType(bool value) : value(value) {}
-	virtual std::string to_string(bool print_readably) override;
-	virtual MALType::Types type() const override { return  MALType::Types::Bool; }
+	Ref<MALStringBuffer> buffer;
+	size_t from = 0;
+	Ref<MALStringNode> left;
+	Ref<MALStringNode> right;
+	size_t length = 0;
+	unsigned int depth = 0;
+
+	bool isLeaf() const { return buffer != nullptr; }
+	std::string_view leafText() const { return std::string_view(buffer->text).substr(from, length); }
+	static Ref<MALStringNode> leaf(Ref<MALStringBuffer> buffer, size_t from, size_t length);
+	// A leaf over all of text.
+	static Ref<MALStringNode> leaf(std::string text);
+	// O(log n) balanced concatenation; short neighbouring leaves are merged.
+	static Ref<MALStringNode> concat(const Ref<MALStringNode>& left, const Ref<MALStringNode>& right);
+	// Appends the characters in order, without flattening the rope.
+	void appendTo(std::string& out) const;
 };
 
+// Immutable string backed by a rope. concat is cheap and shares the text of its
+// inputs; the rope is flattened into a single leaf the first time the text is
+// needed as a whole, and stays flat afterwards.
+class MALStringType : public MALLeafType {
+	Ref<MALStringNode> rope;
+	// Computed on first use.
+	size_t cachedHash = 0;
+public:
+	MALStringType(std::string value);
+	MALStringType(Ref<MALStringNode> rope) : rope(std::move(rope)) {}
+	static Ref<MALStringType> concat(const Ref<MALStringType>& left, const Ref<MALStringType>& right);
+	const Ref<MALStringNode>& node() const { return rope; }
+	size_t size() const { return rope->length; }
+	// Valid until the string is released.
+	std::string_view value();
+
+	virtual MALValue deepCopy() override;
+	virtual bool isEqualTo(const MALValue& other) override;
+	virtual void print(std::string& out, bool print_readably) override;
+	virtual size_t hash() override;
+	virtual MALType::Types type() const override { return  MALType::Types::String; }
+};
+
+// Keywords are interned the same way as symbols.
 class MalKeywordType : public MALLeafType {
+	MalKeywordType(std::string value, size_t id) : value(value), nameHash(hashString(value)), id(id) {}
 public:
-	virtual MALTypePtr deepCopy() override;
-	virtual bool isEqualTo(MALTypePtr other) override;
-	std::string value;
-	MalKeywordType(std::string value) : value(value) {}
-	virtual std::string to_string(bool print_readably) override;
+	virtual MALValue deepCopy() override;
+	virtual bool isEqualTo(const MALValue& other) override;
+	const std::string value;
+	const size_t nameHash;
+	const size_t id;
+	virtual size_t hash() override;
+	virtual void print(std::string& out, bool print_readably) override;
 	virtual MALType::Types type() const override { return  MALType::Types::Keyword; }
+	static Ref<MalKeywordType> intern(std::string_view value);
+};
+
+// Node of the vector trie: leaves hold up to 32 values, branches up to 32
+// children.
+class MALVectorNode : public RefCounted
+{
+public:
+	std::vector<MALValue> values;
+	std::vector<Ref<MALVectorNode>> children;
 };
 
+// Persistent vector: a 32-way trie indexed by the bits of the position, plus
+// a tail leaf holding the last (up to 32) elements. getAt, conj and assocAt
+// are O(log32 n); conj and assocAt copy only the path they change and share
+// every other node with the original vector. push_back and setAt update the
+// vector in place, copying only nodes that are shared, and are meant for
+// vectors that are still being built.
 class MALVectorType : public MALSequenceType {
+	friend class Collector;
+	static const unsigned int bits = 5;
+	static const size_t width = 1 << bits;
+	static const size_t mask = width - 1;
+
+	size_t count = 0;
+	unsigned int shift = bits;
+	Ref<MALVectorNode> root;
+	Ref<MALVectorNode> tail;
+
+	size_t tailOffset() const { return count < width ? 0 : ((count - 1) >> bits) << bits; }
+	MALVectorNode* leafFor(size_t pos) const;
+	void pushTail(unsigned int level, Ref<MALVectorNode>& parent, Ref<MALVectorNode> tailNode);
+	static Ref<MALVectorNode> newPath(unsigned int level, Ref<MALVectorNode> node);
 public:
-	virtual MALTypePtr deepCopy() override;
-	virtual bool isEqualTo(MALTypePtr other) override;
-	std::vector<MALTypePtr> values;
-	virtual std::string to_string(bool print_readably) override;
+	MALVectorType() : root(new MALVectorNode()), tail(new MALVectorNode()) {}
+	MALVectorType(const std::vector<MALValue>& values);
+	// Persistent updates: return a new vector and leave this one unchanged.
+	Ref<MALVectorType> conj(MALValue value);
+	Ref<MALVectorType> assocAt(size_t pos, MALValue value);
+
+	virtual MALValue deepCopy() override;
+	virtual bool isEqualTo(const MALValue& other) override;
+	virtual void print(std::string& out, bool print_readably) override;
+	virtual size_t computeHash() override;
 	virtual MALType::Types type() const override { return  MALType::Types::Vector; }
-	virtual size_t size() override { return values.size(); };
-	virtual MALTypePtr getAt(size_t pos) override { return values[pos]; };
-	virtual void setAt(size_t pos, MALTypePtr value) { values[pos] = value; };
-	virtual void push_back(MALTypePtr value) override {
-		this->values.push_back(value);
-	}
+	virtual size_t size() override { return count; };
+	virtual MALValue getAt(size_t pos) override { return leafFor(pos)->values[pos & mask]; };
+	virtual void setAt(size_t pos, MALValue value) override;
+	virtual void push_back(MALValue value) override;
+	virtual std::vector<MALValue> toVector() override;
 };
 
-struct MALTypeHash {
-	std::size_t operator()(MALTypePtr const& key) const noexcept
-	{
-		return (size_t)&*key;
-	}
+struct MALHashMapNode;
+
+// Slot of a hash map trie node: either a key/value pair or a sub-trie.
+struct MALHashMapEntry {
+	size_t hash;
+	MALValue key;
+	MALValue value;
+	Ref<MALHashMapNode> node;
 };
-struct MALTypeEqualPred {
-	bool operator()(MALTypePtr lhs, MALTypePtr rhs) const
-	{
-		return lhs->isEqualTo(rhs);
-	}
+
+// Node of the hash map trie. bitmap marks which of the 32 slots for the next
+// 5 hash bits are used and entries holds only those, in slot order. Once the
+// hash bits run out, a node holds colliding keys in a plain list.
+struct MALHashMapNode : public RefCounted {
+	unsigned int bitmap = 0;
+	std::vector<MALHashMapEntry> entries;
 };
+
+// Persistent hash map: a hash array mapped trie over the structural hash of
+// the keys. assoc and dissoc are O(log32 n), copy only the path they change
+// and share the rest with the original map. set and remove update the map in
+// place, copying only shared nodes, and are meant for maps being built.
 class MALHashMapType : public MALContainerType {
+	friend class Collector;
+	Ref<MALHashMapNode> root;
+	size_t count = 0;
 public:
-	virtual MALTypePtr deepCopy() override;
-	virtual bool isEqualTo(MALTypePtr other) override;
-	std::unordered_map<MALTypePtr, MALTypePtr, MALTypeHash, MALTypeEqualPred> values;
-	virtual std::string to_string(bool print_readably) override;
+	MALHashMapType() : root(new MALHashMapNode()) {}
+	// Returns an empty value (== nullptr) when the key is missing.
+	MALValue get(const MALValue& key);
+	bool contains(const MALValue& key);
+	void set(MALValue key, MALValue value);
+	void remove(const MALValue& key);
+	Ref<MALHashMapType> assoc(MALValue key, MALValue value);
+	Ref<MALHashMapType> dissoc(const MALValue& key);
+	std::vector<std::pair<MALValue, MALValue>> entries();
+
+	virtual MALValue deepCopy() override;
+	virtual bool isEqualTo(const MALValue& other) override;
+	virtual size_t computeHash() override;
+	virtual void print(std::string& out, bool print_readably) override;
 	virtual MALType::Types type() const override { return  MALType::Types::HashMap; }
-	virtual size_t size() override { return values.size(); };
+	virtual size_t size() override { return count; };
 };
 
-using MALFunctor = std::function<MALTypePtr (std::vector<MALTypePtr>, std::shared_ptr<Env>)>;
+class MALBuiltinFuncType;
+// A builtin's function, stored without its signature (see Native.h).
+using MALNativeTarget = void (*)();
+// Calls the target of builtin with the argc arguments at args, which it may
+// move from.
+using MALNative = MALValue (*)(const MALBuiltinFuncType& builtin, MALValue* args, size_t argc, const Ref<Env>& env);
 
 class MALCallableType : public MALLeafType {
 public:
 	virtual bool isBuiltin() = 0;
 	virtual MALType::Types type() const override { return  MALType::Types::Function; }
 	std::string name;
+	bool is_macro = false;
 	MALCallableType(std::string name) : name(name) {}
 };
 
 class MALFuncType : public MALCallableType {
 public:
-	virtual MALTypePtr deepCopy() override;
-	virtual bool isEqualTo(MALTypePtr other) override;
-	MALFuncType(std::string name, std::shared_ptr<Env> env, std::shared_ptr<MALSequenceType> bindingsList, MALTypePtr funcBody)
-		: MALCallableType(name), env(env), bindingsList(bindingsList), funcBody(funcBody) {}
-	virtual std::string to_string(bool print_readably) override;
+	virtual MALValue deepCopy() override;
+	virtual bool isEqualTo(const MALValue& other) override;
+	// Defined in Type.cpp, where Env, Bytecode and Lambda are complete types.
+	MALFuncType(std::string name, Ref<Env> env, Ref<MALSequenceType> bindingsList, MALValue funcBody);
+	virtual ~MALFuncType();
+	virtual void print(std::string& out, bool print_readably) override;
 	virtual bool isBuiltin() override { return false; };
-	std::shared_ptr<Env> env;
-	std::shared_ptr<MALSequenceType> bindingsList;
-	MALTypePtr funcBody;
+	virtual size_t hash() override { return (size_t)this; }
+	Ref<Env> env;
+	Ref<MALSequenceType> bindingsList;
+	MALValue funcBody;
+	// Set for a function made by the bytecode engine, which runs it.
+	Ref<Bytecode> code;
+	// Set for a function made by the analyzer: its analyzed body.
+	Ref<Lambda> lambda;
 };
 
 class MALBuiltinFuncType : public MALCallableType {
 public:
-	virtual MALTypePtr deepCopy() override;
-	virtual bool isEqualTo(MALTypePtr other) override;
-	MALFunctor fn;
-	MALBuiltinFuncType(std::string name, MALFunctor fn) : MALCallableType(name), fn(fn) {}
-	virtual std::string to_string(bool print_readably) override;
+	virtual MALValue deepCopy() override;
+	virtual bool isEqualTo(const MALValue& other) override;
+	MALNativeTarget target;
+	MALNative thunk;
+	MALBuiltinFuncType(std::string name, MALNativeTarget target, MALNative thunk) : MALCallableType(name), target(target), thunk(thunk) {}
+	MALValue call(MALValue* args, size_t argc, const Ref<Env>& env) const { return this->thunk(*this, args, argc, env); }
+	virtual void print(std::string& out, bool print_readably) override;
 	virtual bool isBuiltin() override { return true; };
+	virtual size_t hash() override { return (size_t)this; }
 };
 
-class MALAtomType : public MALLeafType {
+class MALAtomType : public MALLeafType, public Collectable {
 public:
-	virtual std::string to_string(bool print_readably) override ;
-	virtual bool isEqualTo(MALTypePtr other) override;
-	virtual MALTypePtr deepCopy() override;
+	virtual void print(std::string& out, bool print_readably) override;
+	virtual bool isEqualTo(const MALValue& other) override;
+	virtual MALValue deepCopy() override;
+	virtual size_t hash() override;
 	virtual MALType::Types type() const override { return  MALType::Types::Atom; };
-	MALTypePtr ref;
-	MALAtomType(MALTypePtr ref) : ref(ref) {};
+	MALValue ref;
+	MALAtomType(MALValue ref) : Collectable(Kind::Atom), ref(ref) {};
 };
 
+// Tag based downcasts. isMALType<T> tells whether a heap value of the given
+// tag is a T without going through RTTI; malCast<T> then does a static_cast,
+// checked with assert in debug builds and unchecked in release builds.
+template<class T> bool isMALType(MALType::Types tag, MALType* value);
+template<> inline bool isMALType<MALType>(MALType::Types tag, MALType* value) { return true; }
+template<> inline bool isMALType<MALListType>(MALType::Types tag, MALType* value) { return tag == MALType::Types::List; }
+template<> inline bool isMALType<MALVectorType>(MALType::Types tag, MALType* value) { return tag == MALType::Types::Vector; }
+template<> inline bool isMALType<MALSequenceType>(MALType::Types tag, MALType* value) { return tag == MALType::Types::List || tag == MALType::Types::Vector; }
+template<> inline bool isMALType<MALHashMapType>(MALType::Types tag, MALType* value) { return tag == MALType::Types::HashMap; }
+template<> inline bool isMALType<MALContainerType>(MALType::Types tag, MALType* value) { return isMALType<MALSequenceType>(tag, value) || tag == MALType::Types::HashMap; }
+template<> inline bool isMALType<MALSymbolType>(MALType::Types tag, MALType* value) { return tag == MALType::Types::Symbol; }
+template<> inline bool isMALType<MALStringType>(MALType::Types tag, MALType* value) { return tag == MALType::Types::String; }
+template<> inline bool isMALType<MalKeywordType>(MALType::Types tag, MALType* value) { return tag == MALType::Types::Keyword; }
+template<> inline bool isMALType<MALAtomType>(MALType::Types tag, MALType* value) { return tag == MALType::Types::Atom; }
+template<> inline bool isMALType<MALCallableType>(MALType::Types tag, MALType* value) { return tag == MALType::Types::Function; }
+template<> inline bool isMALType<MALFuncType>(MALType::Types tag, MALType* value) {
+	return tag == MALType::Types::Function && !static_cast<MALCallableType*>(value)->isBuiltin();
+}
+template<> inline bool isMALType<MALBuiltinFuncType>(MALType::Types tag, MALType* value) {
+	return tag == MALType::Types::Function && static_cast<MALCallableType*>(value)->isBuiltin();
+}
+
+template<class T>
+Ref<T> malCast(const MALValue& value)
+{
+	assert(value.isHeap() && isMALType<T>(value.type(), value.ptr().get()) && "malCast: value is not of the requested type");
+	return Ref<T>(static_cast<T*>(value.ptr().get()));
+}
+
+template<class T, class U>
+Ref<T> malCast(const Ref<U>& value)
+{
+	assert((value == nullptr || isMALType<T>(value->type(), value.get())) && "malCast: value is not of the requested type");
+	return Ref<T>(static_cast<T*>(value.get()));
+}
+
 class MALException{
-public: 
-	MALTypePtr errorValue;
-	MALException(MALTypePtr errorVal) : errorValue(errorVal) {};
+public:
+	MALValue errorValue;
+	MALException(MALValue errorVal) : errorValue(errorVal) {};
 };
-
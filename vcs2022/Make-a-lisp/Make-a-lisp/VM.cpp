@@ -0,0 +1,363 @@
+#include "VM.h"
+#include "Compiler.h"
+#include "Collector.h"
+#include "Scope.h"
+#include "SpecFormHandler.h"
+
+namespace {
+    // A call waiting for the one it made to return.
+    struct Activation {
+        Ref<Bytecode> code;
+        const Instruction* ip;
+        EnvPtr frame;
+    };
+
+    // A try* whose body is running.
+    struct Handler {
+        // Depth of the call stack and of the operand stack at the try*.
+        size_t activations;
+        size_t stackSize;
+        Ref<Bytecode> code;
+        const Instruction* ip;
+        EnvPtr frame;
+        // Constant holding the body, named in the messages of C++ errors.
+        unsigned int body;
+    };
+
+    // Shared by the runs nested in one another, as when map calls a compiled
+    // function: each one works above the heights it started at.
+    std::vector<MALValue> stack;
+    std::vector<Activation> activations;
+    std::vector<Handler> handlers;
+}
+
+static void bindArguments(Env& frame, const Bytecode& code, MALValue* args, size_t argc)
+{
+    if (argc < code.requiredArgs) {
+        throw std::runtime_error("Error: Number of parameters don't match function's parameters list size.");
+    }
+    for (unsigned int i = 0; i < code.requiredArgs; i++) {
+        frame.setSlot(i, std::move(args[i]));
+    }
+    if (code.variadic) {
+        std::vector<MALValue> rest(std::make_move_iterator(args + code.requiredArgs), std::make_move_iterator(args + argc));
+        frame.setSlot(code.requiredArgs, Ref<MALListType>(new MALListType(std::move(rest))));
+    }
+}
+
+static bool isMacro(const MALValue& value)
+{
+    Ref<MALCallableType> callable;
+    return value.tryAsCallable(callable) && callable->is_macro;
+}
+
+static MALValue errorValue(const std::string& message, const Handler& handler)
+{
+    return Ref<MALStringType>(new MALStringType(message + ", in:\n\t" + handler.code->constants[handler.body].to_string(false)));
+}
+
+// Runs code in frame until it returns.
+static MALValue run(Ref<Bytecode> code, EnvPtr frame)
+{
+    auto stackBase = stack.size();
+    auto activationBase = activations.size();
+    auto handlerBase = handlers.size();
+    const Instruction* ip = code->instructions.data();
+    auto unwind = [&]() {
+        stack.resize(stackBase);
+        activations.resize(activationBase);
+        handlers.resize(handlerBase);
+    };
+    for (;;) {
+        MALValue error;
+        try {
+            for (;;) {
+                const Instruction& instruction = *ip++;
+                unsigned int argc = 0;
+                unsigned int site = 0;
+                bool tail = false;
+                switch (instruction.op) {
+                case OpCode::Constant:
+                    stack.push_back(code->constants[instruction.a]);
+                    continue;
+                case OpCode::Local: {
+                    auto& local = *code->locals[instruction.a];
+                    //a def! in a frame on the way may shadow the slot
+                    if (Env::hasLocalDefinitions()) {
+                        stack.push_back(frame->get(code->locals[instruction.a]));
+                    }
+                    else {
+                        Env* env = frame.get();
+                        for (unsigned int hops = 0; hops < local.depth; hops++) {
+                            env = env->outerFrame();
+                        }
+                        stack.push_back(env->getSlot(local.slot));
+                    }
+                    //a callee bound to a macro gets its arguments unevaluated
+                    if (instruction.b != 0 && isMacro(stack.back())) {
+                        auto& callSite = code->callSites[instruction.b - 1];
+                        stack.back() = EVAL(macroexpand(callSite.form, frame), frame);
+                        ip = code->instructions.data() + callSite.callPc + 1;
+                    }
+                    continue;
+                }
+                case OpCode::Global: {
+                    auto& global = code->globals[instruction.a];
+                    if (global.definitionEpoch == Env::definitions() && !Env::hasLocalDefinitions()) {
+                        stack.push_back(global.value);
+                        continue;
+                    }
+                    auto value = frame->get(global.symbol);
+                    if (instruction.b != 0 && isMacro(value)) {
+                        auto& callSite = code->callSites[instruction.b - 1];
+                        stack.push_back(EVAL(macroexpand(callSite.form, frame), frame));
+                        ip = code->instructions.data() + callSite.callPc + 1;
+                        continue;
+                    }
+                    global.value = value;
+                    global.definitionEpoch = Env::definitions();
+                    stack.push_back(std::move(value));
+                    continue;
+                }
+                case OpCode::SetLocal:
+                    frame->setSlot(instruction.a, std::move(stack.back()));
+                    stack.pop_back();
+                    continue;
+                case OpCode::Define:
+                    frame->set(code->constants[instruction.a].asSymbol(), stack.back());
+                    continue;
+                case OpCode::DefineMacro: {
+                    Ref<MALCallableType> callable;
+                    if (!stack.back().tryAsCallable(callable)) {
+                        throw std::runtime_error("ERROR: 'defmacro!' second param must evaluate to a function.");
+                    }
+                    frame->set(code->constants[instruction.a].asSymbol(), stack.back());
+                    callable->is_macro = true;
+                    continue;
+                }
+                case OpCode::Pop:
+                    stack.pop_back();
+                    continue;
+                case OpCode::Jump:
+                    ip = code->instructions.data() + instruction.a;
+                    continue;
+                case OpCode::JumpIfFalse: {
+                    bool truthy = stack.back().isTruthy();
+                    stack.pop_back();
+                    if (!truthy) {
+                        ip = code->instructions.data() + instruction.a;
+                    }
+                    continue;
+                }
+                case OpCode::Return:
+                    goto returnFromCall;
+                case OpCode::Closure: {
+                    auto& function = code->functions[instruction.a];
+                    Ref<MALFuncType> func(new MALFuncType(function->name, frame, function->params, function->body));
+                    func->code = function;
+                    stack.push_back(func);
+                    continue;
+                }
+                case OpCode::PushFrame:
+                    frame = Env::letFrame(std::move(frame), code->constants[instruction.a].asSequence(), 1);
+                    continue;
+                case OpCode::PopFrame: {
+                    EnvPtr outer(frame->outerFrame());
+                    Env::recycle(frame);
+                    frame = std::move(outer);
+                    continue;
+                }
+                case OpCode::PushHandler:
+                    handlers.push_back(Handler{ activations.size(), stack.size(), code, code->instructions.data() + instruction.a, frame, instruction.b });
+                    continue;
+                case OpCode::PopHandler:
+                    handlers.pop_back();
+                    continue;
+                case OpCode::MakeVector: {
+                    Ref<MALVectorType> vector(new MALVectorType());
+                    for (auto p = stack.end() - instruction.a; p != stack.end(); p++) {
+                        vector->push_back(std::move(*p));
+                    }
+                    stack.resize(stack.size() - instruction.a);
+                    stack.push_back(vector);
+                    continue;
+                }
+                case OpCode::MakeHashMap: {
+                    Ref<MALHashMapType> map(new MALHashMapType());
+                    for (auto p = stack.end() - 2 * instruction.a; p != stack.end(); p += 2) {
+                        map->set(std::move(p[0]), std::move(p[1]));
+                    }
+                    stack.resize(stack.size() - 2 * instruction.a);
+                    stack.push_back(map);
+                    continue;
+                }
+                case OpCode::Interpret:
+                    stack.push_back(EVAL(code->constants[instruction.a], frame));
+                    continue;
+                case OpCode::Expand: {
+                    auto& expansion = code->expansions[instruction.a];
+                    if (expansion.site.expand(frame)) {
+                        expansion.code = compileExpansion(expansion.site, globalFrame(frame));
+                    }
+                    Ref<Bytecode> expansionCode = expansion.code;
+                    if (instruction.b == 0) {
+                        activations.push_back(Activation{ std::move(code), ip, frame });
+                    }
+                    code = std::move(expansionCode);
+                    ip = code->instructions.data();
+                    continue;
+                }
+                case OpCode::Add:
+                case OpCode::Subtract:
+                case OpCode::Multiply:
+                case OpCode::Divide:
+                case OpCode::Less:
+                case OpCode::LessEqual:
+                case OpCode::Greater:
+                case OpCode::GreaterEqual:
+                case OpCode::Equal: {
+                    auto size = stack.size();
+                    MALValue result;
+                    if (applyPrimitive((size_t)instruction.op - (size_t)OpCode::Add, stack[size - 3], stack[size - 2], stack[size - 1], result)) {
+                        stack.resize(size - 2);
+                        stack.back() = std::move(result);
+                        continue;
+                    }
+                    argc = 2;
+                    site = instruction.a;
+                    break;
+                }
+                case OpCode::Call:
+                    argc = instruction.a;
+                    site = instruction.b;
+                    break;
+                case OpCode::TailCall:
+                    argc = instruction.a;
+                    site = instruction.b;
+                    tail = true;
+                    break;
+                }
+
+                //only calls get here
+                {
+                    Collector::collectIfNeeded();
+                    auto argsAt = stack.size() - argc;
+                    auto calleeValue = stack[argsAt - 1];
+                    if (calleeValue.type() != MALType::Types::Function) {
+                        auto& form = code->callSites[site].form;
+                        throw std::runtime_error("Error: function not found with name '" + form->getAt(0).to_string(true) + "' in '" + form->to_string(true) + "'");
+                    }
+                    auto callable = static_cast<MALCallableType*>(calleeValue.ptr().get());
+                    MALValue result;
+                    if (callable->isBuiltin()) {
+                        result = static_cast<MALBuiltinFuncType*>(callable)->call(stack.data() + argsAt, argc, frame);
+                    }
+                    else {
+                        auto func = static_cast<MALFuncType*>(callable);
+                        if (func->code == nullptr) {
+                            std::vector<MALValue> args(std::make_move_iterator(stack.begin() + argsAt), std::make_move_iterator(stack.end()));
+                            result = EVAL(func->funcBody, Env::callFrame(func->env, func->bindingsList, args.data(), args.size()));
+                        }
+                        else {
+                            Ref<Bytecode> calleeCode = func->code;
+                            EnvPtr calleeFrame;
+                            //nothing else holds the frame the tail call is made from: reuse it
+                            if (tail && frame.useCount() == 1 && !frame->isGlobal()) {
+                                frame->rebindSlots(func->env, calleeCode->names);
+                                calleeFrame = std::move(frame);
+                            }
+                            else {
+                                calleeFrame = Env::letFrame(func->env, calleeCode->names, 1);
+                            }
+                            bindArguments(*calleeFrame, *calleeCode, stack.data() + argsAt, argc);
+                            stack.resize(argsAt - 1);
+                            if (!tail) {
+                                activations.push_back(Activation{ std::move(code), ip, std::move(frame) });
+                            }
+                            code = std::move(calleeCode);
+                            frame = std::move(calleeFrame);
+                            ip = code->instructions.data();
+                            continue;
+                        }
+                    }
+                    stack.resize(argsAt - 1);
+                    stack.push_back(std::move(result));
+                    if (!tail) {
+                        continue;
+                    }
+                }
+
+            returnFromCall:
+                {
+                    auto result = std::move(stack.back());
+                    stack.pop_back();
+                    Env::recycle(frame);
+                    if (activations.size() == activationBase) {
+                        return result;
+                    }
+                    auto& caller = activations.back();
+                    code = std::move(caller.code);
+                    ip = caller.ip;
+                    frame = std::move(caller.frame);
+                    activations.pop_back();
+                    stack.push_back(std::move(result));
+                }
+            }
+        }
+        catch (MALException& e) {
+            if (handlers.size() == handlerBase) {
+                unwind();
+                throw;
+            }
+            error = e.errorValue;
+        }
+        catch (std::string& e) {
+            if (handlers.size() == handlerBase) {
+                unwind();
+                throw;
+            }
+            error = errorValue(e, handlers.back());
+        }
+        catch (std::exception& e) {
+            if (handlers.size() == handlerBase) {
+                unwind();
+                throw;
+            }
+            error = errorValue(e.what(), handlers.back());
+        }
+        catch (...) {
+            if (handlers.size() == handlerBase) {
+                unwind();
+                throw;
+            }
+            auto& handler = handlers.back();
+            error = Ref<MALStringType>(new MALStringType("Unknown error. Something went wrong running:\n\t" + handler.code->constants[handler.body].to_string(false)));
+        }
+        //resume at the innermost catch* of this run
+        auto handler = std::move(handlers.back());
+        handlers.pop_back();
+        activations.resize(handler.activations);
+        stack.resize(handler.stackSize);
+        code = std::move(handler.code);
+        ip = handler.ip;
+        frame = std::move(handler.frame);
+        stack.push_back(std::move(error));
+    }
+}
+
+static MALValue runTopLevel(const MALValue& ast, const EnvPtr& globalEnv)
+{
+    return run(compileTopLevel(ast, globalEnv), globalEnv);
+}
+
+MALValue VM::eval(MALValue ast, EnvPtr globalEnv)
+{
+    return evalTopLevel(std::move(ast), globalEnv, runTopLevel);
+}
+
+MALValue VM::apply(MALFuncType* func, std::vector<MALValue> args)
+{
+    auto frame = Env::letFrame(func->env, func->code->names, 1);
+    bindArguments(*frame, *func->code, args.data(), args.size());
+    return run(func->code, std::move(frame));
+}
@@ -0,0 +1,111 @@
+#pragma once
+#include <string>
+#include <vector>
+
+#include "Type.h"
+#include "Env.h"
+#include "SpecFormHandler.h"
+
+// Bytecode engine, picked with --vm on the command line. The compiler turns
+// each top-level form, after macroexpansion, into the instructions of a stack
+// machine; every fn* in it gets its own code, which the functions it makes
+// share. Locals live in the slots of the same Env frames the AST walker uses:
+// a call frame holds the parameters, and each let* and catch* pushes a frame
+// of its own. An instruction reaches a local, including one of an enclosing
+// function (an upvalue), by the frame depth and slot the compiler worked out,
+// and a global through a cache that stays valid until the next def!. A macro
+// call in the form is compiled when it first runs, from its expansion then,
+// and again when it expands to something else. A function the AST walker
+// made, and a form the compiler does not handle, are run by EVAL, so the two
+// engines can call each other.
+
+enum class OpCode : unsigned char {
+	Constant,      // push constants[a]
+	Local,         // push the local locals[a]; b is a call site + 1 to check for a macro, or 0
+	Global,        // push the global globals[a]; b is a call site + 1 to check for a macro, or 0
+	SetLocal,      // pop into slot a of the current frame
+	Define,        // bind constants[a] to the top of the stack, in the current frame
+	DefineMacro,   // the same, marking the function a macro
+	Pop,
+	Jump,          // go to a
+	JumpIfFalse,   // pop, and go to a if it is nil or false
+	Call,          // call with a arguments; b is the call site
+	TailCall,      // the same, replacing the current call
+	Return,
+	Closure,       // push a function running functions[a] in the current frame
+	PushFrame,     // enter a frame with a slot for each name in constants[a]
+	PopFrame,
+	PushHandler,   // catch errors from here to the PopHandler: go to a with the error pushed; b is the try* body
+	PopHandler,
+	MakeVector,    // pop a values into a vector
+	MakeHashMap,   // pop a key/value pairs into a map
+	Interpret,     // push EVAL of the form constants[a] in the current frame
+	Expand,        // run the code made of the expansion of expansions[a] in the current frame, as a call when b is 0
+	// The two-argument calls of the core arithmetic and comparisons: done in
+	// place when the callee is still the core function and the arguments are
+	// numbers, else a Call with call site a.
+	Add,
+	Subtract,
+	Multiply,
+	Divide,
+	Less,
+	LessEqual,
+	Greater,
+	GreaterEqual,
+	Equal,
+};
+
+struct Instruction {
+	OpCode op;
+	unsigned int a;
+	unsigned int b;
+};
+
+class Bytecode : public RefCounted {
+public:
+	// A global reference, with the value found for it at definitionEpoch.
+	struct GlobalRef {
+		Ref<MALResolvedSymbolType> symbol;
+		size_t definitionEpoch;
+		MALValue value;
+	};
+	// A call in the source, kept to report errors and to expand a macro the
+	// callee turns out to be after all.
+	struct CallSite {
+		MALListTypePtr form;
+		// The instruction making the call.
+		size_t callPc;
+	};
+
+	std::vector<Instruction> instructions;
+	std::vector<MALValue> constants;
+	// Frame depth and slot of each local reference.
+	std::vector<Ref<MALResolvedSymbolType>> locals;
+	std::vector<GlobalRef> globals;
+	std::vector<CallSite> callSites;
+	// A call of a macro, with the code made of its expansion: it returns the
+	// value of the expansion.
+	struct Expansion {
+		MacroCallSite site;
+		Ref<Bytecode> code;
+	};
+	std::vector<Expansion> expansions;
+	std::vector<Ref<Bytecode>> functions;
+	// For the code of a fn*: its parameters as written, its body and printed
+	// form, and the names of the slots of its call frame, which are the
+	// parameters without the '&'.
+	Ref<MALSequenceType> params;
+	MALValue body;
+	std::string name;
+	Ref<MALListType> names;
+	unsigned int requiredArgs = 0;
+	bool variadic = false;
+};
+
+class VM {
+public:
+	// Evaluates a top-level form in the global environment.
+	static MALValue eval(MALValue ast, EnvPtr globalEnv);
+	// Calls a function made by the bytecode engine.
+	static MALValue apply(MALFuncType* func, std::vector<MALValue> args);
+};
@@ -10,13 +10,13 @@
 #include "Type.h"
 #include "Env.h"
 
-void checkArgsIsAtLeast(std::string name, MALTypePtr type, int correctValue, int argCount);
+void checkArgsIsAtLeast(std::string name, MALValue type, int correctValue, int argCount);
 
 void checkArgsIsAtLeast(std::string name, int correctValue, int argCount);
 
 void checkArgsNumber(std::string name, int correctValue, int argCount);
 
-void checkArgsIs(std::string name, MALTypePtr type, int correctValue, int argCount);
+void checkArgsIs(std::string name, MALValue type, int correctValue, int argCount);
 
-void assertMalType(MALTypePtr element, MALType::Types type);
+void assertMalType(MALValue element, MALType::Types type);
 
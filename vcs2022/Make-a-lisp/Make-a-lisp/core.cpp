@@ -1,162 +1,124 @@
 #include "core.h"
+#include "SpecFormHandler.h"
+#include "Native.h"
 
-MALTypePtr add(std::vector<MALTypePtr> args, EnvPtr env) {
+double add(NativeArgs args) {
     double result = 0;
     for (auto p = args.begin(); p != args.end(); p++) {
-        assertMalType(*p, MALType::Types::Number);
-        auto number = std::dynamic_pointer_cast<MALNumberType>(*p);
-        result += number->value;
+        result += NativeParam<double>::from(*p);
     }
-    return std::shared_ptr<MALNumberType>(new MALNumberType(result));
+    return result;
 }
 
-MALTypePtr sub(std::vector<MALTypePtr> args, EnvPtr env) {
-    double result = args.size() > 0 ? (std::dynamic_pointer_cast<MALNumberType>(args[0]))->value : 0;
-    for (auto p = args.begin() + 1; p != args.end(); p++) {
-        assertMalType(*p, MALType::Types::Number);
-        auto number = std::dynamic_pointer_cast<MALNumberType>(*p);
-        result -= number->value;
+double sub(double result, NativeArgs args) {
+    for (auto p = args.begin(); p != args.end(); p++) {
+        result -= NativeParam<double>::from(*p);
     }
-    return std::shared_ptr<MALNumberType>(new MALNumberType(result));
+    return result;
 }
 
-MALTypePtr mult(std::vector<MALTypePtr> args, EnvPtr env) {
+double mult(NativeArgs args) {
     double result = 1;
     for (auto p = args.begin(); p != args.end(); p++) {
-        assertMalType(*p, MALType::Types::Number);
-        auto number = std::dynamic_pointer_cast<MALNumberType>(*p);
-        result *= number->value;
+        result *= NativeParam<double>::from(*p);
     }
-    return std::shared_ptr<MALNumberType>(new MALNumberType(result));
+    return result;
 }
 
-MALTypePtr divs(std::vector<MALTypePtr> args, EnvPtr env) {
-    double result = args.size() > 0 ? (std::dynamic_pointer_cast<MALNumberType>(args[0]))->value : 0;
-    for (auto p = args.begin() + 1; p != args.end(); p++) {
-        assertMalType(*p, MALType::Types::Number);
-        auto number = std::dynamic_pointer_cast<MALNumberType>(*p);
-        result /= number->value;
+double divs(double result, NativeArgs args) {
+    for (auto p = args.begin(); p != args.end(); p++) {
+        result /= NativeParam<double>::from(*p);
     }
-    return std::shared_ptr<MALNumberType>(new MALNumberType(result));
+    return result;
 }
 
-MALTypePtr prn(std::vector<MALTypePtr> args, EnvPtr env) {
-    auto nil = MALNilType::Nil;
+// Prints the args separated by spaces into a single buffer.
+static std::string printArgs(NativeArgs args, bool print_readably) {
+    std::string result = "";
+    for (size_t i = 0; i < args.size(); i++) {
+        if (i > 0) {
+            result += ' ';
+        }
+        pr_str(result, args[i], print_readably);
+    }
+    return result;
+}
+
+MALValue prn(NativeArgs args) {
+    auto nil = MALValue::nil();
     if (args.size() <= 0) {
         return nil;
     }
-    std::string result = "";
-    int i = 0;
-    for (i = 0; i < args.size() - 1; i++) {
-        result += pr_str(args[i], true) + " ";
-    }
-    result += pr_str(args[i], true);
-    std::cout << result;
+    auto result = printArgs(args, true);
+    std::cout.write(result.data(), result.size());
     return nil;
 }
 
-MALTypePtr println(std::vector<MALTypePtr> args, EnvPtr env) {
-    auto nil = MALNilType::Nil;
+MALValue println(NativeArgs args) {
+    auto nil = MALValue::nil();
     if (args.size() <= 0) {
         return nil;
     }
-    std::string result = "";
-    int i = 0;
-    for (i = 0; i < args.size() - 1; i++) {
-        result += pr_str(args[i], false) + " ";
-    }
-    result += pr_str(args[i], false);
-    std::cout << result << std::endl;
+    auto result = printArgs(args, false);
+    result += '\n';
+    std::cout.write(result.data(), result.size());
+    std::cout.flush();
     return nil;
 }
 
-MALTypePtr list(std::vector<MALTypePtr> args, EnvPtr env) {
-    auto result = std::shared_ptr<MALListType>(new MALListType());
-    for (auto p = args.begin(); p != args.end(); p++) {
-        result->values.push_back(*p);
-    }
-    return result;
+MALValue list(NativeArgs args) {
+    return Ref<MALListType>(new MALListType(std::vector<MALValue>(std::make_move_iterator(args.begin()), std::make_move_iterator(args.end()))));
 }
 
-MALTypePtr isList(std::vector<MALTypePtr> args, EnvPtr env) {
-    checkArgsIsAtLeast("list?", 1, args.size());
-    return std::shared_ptr<MALBoolType>(new MALBoolType(args[0]->type() == MALType::Types::List));
+bool isList(MALValue value) {
+    return value.type() == MALType::Types::List;
 }
 
-MALTypePtr isEmpty(std::vector<MALTypePtr> args, EnvPtr env) {
-    checkArgsIsAtLeast("empty?", 1, args.size());
-    return std::shared_ptr<MALBoolType>(new MALBoolType(args[0]->isContainer() && (std::dynamic_pointer_cast<MALContainerType>(args[0]))->size() == 0));
+bool isEmpty(MALValue value) {
+    return value.isContainer() && (malCast<MALContainerType>(value))->size() == 0;
 }
 
-MALTypePtr count(std::vector<MALTypePtr> args, EnvPtr env) {
-    checkArgsIsAtLeast("count", 1, args.size());
-    if (args[0]->type() == MALType::Types::Nil) {
-        return std::shared_ptr<MALNumberType>(new MALNumberType(0));
+double count(MALValue value) {
+    if (value.type() == MALType::Types::Nil) {
+        return 0;
     }
-    if (!args[0]->isContainer()) {
-        throw std::runtime_error("Error: Can only count container types. Found: '" + MALType::typeToString(args[0]->type()) + "'");
+    if (!value.isContainer()) {
+        throw std::runtime_error("Error: Can only count container types. Found: '" + MALType::typeToString(value.type()) + "'");
     }
-    return std::shared_ptr<MALNumberType>(new MALNumberType((std::dynamic_pointer_cast<MALContainerType>(args[0]))->size()));
+    return (double)(malCast<MALContainerType>(value))->size();
 }
 
-MALTypePtr eq(std::vector<MALTypePtr> args, EnvPtr env) {
-    checkArgsIsAtLeast("=", 2, args.size());
-    if (args[0]->type() != args[1]->type()) {
-        return std::shared_ptr<MALBoolType>(new MALBoolType(false));
+bool eq(MALValue a, MALValue b) {
+    if (a.type() != b.type()) {
+        return false;
     }
-    return std::shared_ptr<MALBoolType>(new MALBoolType(args[0]->isEqualTo(args[1])));
+    return a.isEqualTo(b);
 }
 
-MALTypePtr lt(std::vector<MALTypePtr> args, EnvPtr env) {
-    checkArgsIsAtLeast("<", 2, args.size());
-    assertMalType(args[0], MALType::Types::Number);
-    assertMalType(args[1], MALType::Types::Number);
-    auto l = std::dynamic_pointer_cast<MALNumberType>(args[0]);
-    auto r = std::dynamic_pointer_cast<MALNumberType>(args[1]);
-    return std::shared_ptr<MALBoolType>(new MALBoolType(l->value < r->value));
+bool lt(double a, double b) {
+    return a < b;
 }
 
-MALTypePtr lte(std::vector<MALTypePtr> args, EnvPtr env) {
-    checkArgsIsAtLeast("<=", 2, args.size());
-    assertMalType(args[0], MALType::Types::Number);
-    assertMalType(args[1], MALType::Types::Number);
-    auto l = std::dynamic_pointer_cast<MALNumberType>(args[0]);
-    auto r = std::dynamic_pointer_cast<MALNumberType>(args[1]);
-    return std::shared_ptr<MALBoolType>(new MALBoolType(l->value <= r->value));
+bool lte(double a, double b) {
+    return a <= b;
 }
 
-MALTypePtr gt(std::vector<MALTypePtr> args, EnvPtr env) {
-    checkArgsIsAtLeast(">", 2, args.size());
-    assertMalType(args[0], MALType::Types::Number);
-    assertMalType(args[1], MALType::Types::Number);
-    auto l = std::dynamic_pointer_cast<MALNumberType>(args[0]);
-    auto r = std::dynamic_pointer_cast<MALNumberType>(args[1]);
-    return std::shared_ptr<MALBoolType>(new MALBoolType(l->value > r->value));
+bool gt(double a, double b) {
+    return a > b;
 }
 
-MALTypePtr gte(std::vector<MALTypePtr> args, EnvPtr env) {
-    checkArgsIsAtLeast(">=", 2, args.size());
-    assertMalType(args[0], MALType::Types::Number);
-    assertMalType(args[1], MALType::Types::Number);
-    auto l = std::dynamic_pointer_cast<MALNumberType>(args[0]);
-    auto r = std::dynamic_pointer_cast<MALNumberType>(args[1]);
-    return std::shared_ptr<MALBoolType>(new MALBoolType(l->value >= r->value));
+bool gte(double a, double b) {
+    return a >= b;
 }
 
-MALTypePtr readString(std::vector<MALTypePtr> args, EnvPtr env) {
-    checkArgsIsAtLeast("read-string", 1, args.size());
-    assertMalType(args[0], MALType::Types::String);
-    auto stringType = std::dynamic_pointer_cast<MALStringType>(args[0]);
-    auto readString = stringType->value;
+MALValue readString(Ref<MALStringType> string) {
+    auto readString = std::string(string->value());
     auto result = read_str(readString);
     return result;
 }
 
-MALTypePtr slurp(std::vector<MALTypePtr> args, EnvPtr env) {
-    checkArgsIsAtLeast("slurp", 1, args.size());
-    assertMalType(args[0], MALType::Types::String);
-    auto stringType = std::dynamic_pointer_cast<MALStringType>(args[0]);
-    auto fileName = stringType->value;
+MALValue slurp(Ref<MALStringType> name) {
+    auto fileName = std::string(name->value());
 
     std::ifstream file(fileName);
     if (!file) {
@@ -165,138 +127,225 @@ MALTypePtr slurp(std::vector<MALTypePtr> args, EnvPtr env) {
     std::stringstream buffer;
     buffer << file.rdbuf();
 
-    return std::shared_ptr<MALStringType>(new MALStringType(buffer.str()));
+    return Ref<MALStringType>(new MALStringType(buffer.str()));
 }
 
-MALTypePtr atom(std::vector<MALTypePtr> args, EnvPtr env) {
-    checkArgsNumber("atom", 1, args.size());
-    return std::shared_ptr<MALAtomType>(new MALAtomType(args[0]));
+void evalStream(std::istream& input) {
+    StreamReader reader(input);
+    MALValue form;
+    while (reader.next(form)) {
+        evalTopLevel(form);
+    }
 }
 
-MALTypePtr isAtom(std::vector<MALTypePtr> args, EnvPtr env) {
-    checkArgsNumber("atom?", 1, args.size());
-    return std::shared_ptr<MALBoolType>(new MALBoolType(args[0]->type() == MALType::Types::Atom));
+MALValue loadFile(Ref<MALStringType> name) {
+    auto fileName = std::string(name->value());
+
+    std::ifstream file(fileName);
+    if (!file) {
+        throw std::runtime_error("Error: File named '" + fileName + "' could not be opened.");
+    }
+    evalStream(file);
+    return MALValue::nil();
 }
 
-MALTypePtr deref(std::vector<MALTypePtr> args, EnvPtr env) {
-    checkArgsNumber("deref", 1, args.size());
-    assertMalType(args[0], MALType::Types::Atom);
-    auto atom = std::dynamic_pointer_cast<MALAtomType>(args[0]);
+MALValue atom(MALValue value) {
+    return Ref<MALAtomType>(new MALAtomType(std::move(value)));
+}
+
+bool isAtom(MALValue value) {
+    return value.type() == MALType::Types::Atom;
+}
+
+MALValue deref(Ref<MALAtomType> atom) {
     if (atom->ref == nullptr) {
-        return MALNilType::Nil;
+        return MALValue::nil();
     }
     return atom->ref;
 }
 
-MALTypePtr resetBang(std::vector<MALTypePtr> args, EnvPtr env) {
-    checkArgsNumber("reset!", 2, args.size());
-    assertMalType(args[0], MALType::Types::Atom);
-    auto atom = std::dynamic_pointer_cast<MALAtomType>(args[0]);
-    atom->ref = args[1];
-    return args[1];
+MALValue resetBang(Ref<MALAtomType> atom, MALValue value) {
+    atom->ref = value;
+    return value;
 }
 
-MALTypePtr swapBang(std::vector<MALTypePtr> args, EnvPtr env) {
-    checkArgsIsAtLeast("reset!", 2, args.size());
-    assertMalType(args[0], MALType::Types::Atom);
-    assertMalType(args[1], MALType::Types::Function);
-    auto atom = std::dynamic_pointer_cast<MALAtomType>(args[0]);
-    auto func = std::dynamic_pointer_cast<MALCallableType>(args[1]);
-    std::shared_ptr<MALListType> callFuncAst(new MALListType());
-    callFuncAst->values.push_back(func);
-    callFuncAst->values.push_back(atom->ref);
-    for (int i = 2; i < args.size(); i++) {
-        callFuncAst->values.push_back(args[i]);
+MALValue swapBang(const EnvPtr& env, Ref<MALAtomType> atom, Ref<MALCallableType> func, NativeArgs args) {
+    Ref<MALListType> callFuncAst(new MALListType());
+    callFuncAst->push_back(func);
+    callFuncAst->push_back(atom->ref);
+    for (auto p = args.begin(); p != args.end(); p++) {
+        callFuncAst->push_back(std::move(*p));
     }
     auto result = EVAL(callFuncAst,env);
     atom->ref = result;
     return result;
 }
 
-MALTypePtr evalSpecialForm(std::vector<MALTypePtr> args, EnvPtr env) {
-    checkArgsIsAtLeast("eval", 1, args.size());
-    auto res = EVAL(args[0], nullptr);
+MALValue evalSpecialForm(MALValue form) {
+    auto res = evalTopLevel(form);
     return res;
 }
 
 
-MALTypePtr cons(std::vector<MALTypePtr> args, EnvPtr env) {
-    checkArgsNumber("cons", 2, args.size());
-    if (!args[1]->isSequence()) {
-        throw std::runtime_error("Error: Second parameter of 'cons' must be a sequence (e.g. list or vector). Found: " + args[1]->to_string(true));
+MALValue cons(MALValue value, MALValue sequence) {
+    if (!sequence.isSequence()) {
+        throw std::runtime_error("Error: Second parameter of 'cons' must be a sequence (e.g. list or vector). Found: " + sequence.to_string(true));
     }
-    auto argAsSequence = args[1]->asSequence();
-    MALListTypePtr newList(new MALListType());
-    newList->values.push_back(args[0]);
-    for (int i = 0; i < argAsSequence->size(); i++) {
-        newList->values.push_back(argAsSequence->getAt(i));
+    MALListTypePtr rest;
+    if (!sequence.tryAsList(rest)) {
+        rest = MALListTypePtr(new MALListType(sequence.asSequence()->toVector()));
     }
-    return newList;
+    return MALListType::cons(value, rest);
 }
 
-MALTypePtr concatList(std::vector<MALTypePtr> args, EnvPtr env) {
-    MALListTypePtr newList(new MALListType());
+MALValue concatList(NativeArgs args) {
+    //every argument is copied except a trailing list, which the result shares
+    std::vector<MALValue> values;
+    MALListTypePtr tail;
     for (auto p = args.begin(); p != args.end(); p++) {
-        if (!(*p)->isSequence()) {
-            throw std::runtime_error("Error: All parameters of 'concat' must be a sequence (e.g. list or vector). Found: " + (*p)->to_string(true));
+        if (!p->isSequence()) {
+            throw std::runtime_error("Error: All parameters of 'concat' must be a sequence (e.g. list or vector). Found: " + p->to_string(true));
+        }
+        if (p + 1 == args.end() && p->tryAsList(tail)) {
+            break;
         }
-        auto argAsSequence = (*p)->asSequence();
-        for (int i = 0; i < argAsSequence->size(); i++) {
-            newList->values.push_back(argAsSequence->getAt(i));
+        auto argValues = p->asSequence()->toVector();
+        values.insert(values.end(), argValues.begin(), argValues.end());
+    }
+    return MALListTypePtr(new MALListType(std::move(values), tail));
+}
+
+// Prints the args one after the other into a single string. Unless they have
+// to be escaped, string args are shared with the result instead of copied, so
+// building a long string piece by piece stays linear.
+static MALValue joinPrinted(NativeArgs args, bool print_readably, const char* separator) {
+    Ref<MALStringNode> result = MALStringNode::leaf("");
+    std::string pending = "";
+    auto flush = [&]() {
+        if (!pending.empty()) {
+            result = MALStringNode::concat(result, MALStringNode::leaf(std::move(pending)));
+            pending.clear();
+        }
+    };
+    for (size_t i = 0; i < args.size(); i++) {
+        if (i > 0) {
+            pending += separator;
+        }
+        if (!print_readably && args[i].type() == MALType::Types::String) {
+            flush();
+            result = MALStringNode::concat(result, malCast<MALStringType>(args[i])->node());
+        }
+        else {
+            pr_str(pending, args[i], print_readably);
         }
     }
-    return newList;
+    flush();
+    return Ref<MALStringType>(new MALStringType(result));
 }
 
-MALTypePtr pr_str_func(std::vector<MALTypePtr> args, EnvPtr env) {
-    if (args.size() <= 0) {
-        return std::shared_ptr<MALStringType>(new MALStringType(""));
-    }
-    std::string result = "";
-    int i = 0;
-    for (i = 0; i < args.size() - 1; i++) {
-        result += pr_str(args[i], true) + " ";
+MALValue pr_str_func(NativeArgs args) {
+    return joinPrinted(args, true, " ");
+}
+
+MALValue str(NativeArgs args) {
+    return joinPrinted(args, false, "");
+}
+
+MALValue vec(MALValue sequence) {
+    if (!sequence.isSequence()) {
+        throw std::runtime_error("Error: Parameter of 'vec' must be a sequence (e.g. list or vector). Found: " + sequence.to_string(true));
     }
-    result += pr_str(args[i], true);
-    return std::shared_ptr<MALStringType>(new MALStringType(result));
+    return Ref<MALVectorType>(new MALVectorType(sequence.asSequence()->toVector()));
 }
 
-MALTypePtr str(std::vector<MALTypePtr> args, EnvPtr env) {
-    if (args.size() <= 0) {
-        return std::shared_ptr<MALStringType>(new MALStringType(""));
+MALValue vectorFunc(NativeArgs args) {
+    return Ref<MALVectorType>(new MALVectorType(std::vector<MALValue>(std::make_move_iterator(args.begin()), std::make_move_iterator(args.end()))));
+}
+
+MALValue conjFunc(MALValue collection, NativeArgs args) {
+    if (collection.type() == MALType::Types::List) {
+        //lists grow at the front
+        auto result = collection.asList();
+        for (auto p = args.begin(); p != args.end(); p++) {
+            result = MALListType::cons(*p, result);
+        }
+        return result;
     }
-    std::string result = "";
-    int i = 0;
-    for (i = 0; i < args.size() - 1; i++) {
-        result += pr_str(args[i], false);
+    auto result = NativeParam<Ref<MALVectorType>>::from(collection);
+    for (auto p = args.begin(); p != args.end(); p++) {
+        result = result->conj(*p);
     }
-    result += pr_str(args[i], false);
-    return std::shared_ptr<MALStringType>(new MALStringType(result));
+    return result;
 }
 
-MALTypePtr vec(std::vector<MALTypePtr> args, EnvPtr env) {
-    auto result = std::shared_ptr<MALVectorType>(new MALVectorType());
-    if (args.size() <= 0) {
-        return result;
+MALValue hashMapFunc(NativeArgs args) {
+    if (args.size() % 2 != 0) {
+        throw std::runtime_error("Error: 'hash-map' expects key/value pairs.");
     }
+    auto result = Ref<MALHashMapType>(new MALHashMapType());
+    for (size_t i = 0; i < args.size(); i += 2) {
+        result->set(args[i], args[i + 1]);
+    }
+    return result;
+}
 
-    if (!args[0]->isSequence()) {
-        throw std::runtime_error("Error: Parameter of 'vec' must be a sequence (e.g. list or vector). Found: " + args[0]->to_string(true));
+bool isMapFunc(MALValue value) {
+    return value.type() == MALType::Types::HashMap;
+}
+
+MALValue assocFunc(Ref<MALHashMapType> map, NativeArgs args) {
+    if (args.size() % 2 != 0) {
+        throw std::runtime_error("Error: 'assoc' expects a map followed by key/value pairs.");
+    }
+    auto result = Ref<MALHashMapType>(new MALHashMapType(*map));
+    for (size_t i = 0; i < args.size(); i += 2) {
+        result->set(args[i], args[i + 1]);
     }
-    auto argAsSequence = args[0]->asSequence();
-    for (int i = 0; i < argAsSequence->size(); i++) {
-        result->values.push_back(argAsSequence->getAt(i));
+    return result;
+}
+
+MALValue dissocFunc(Ref<MALHashMapType> map, NativeArgs args) {
+    auto result = Ref<MALHashMapType>(new MALHashMapType(*map));
+    for (auto p = args.begin(); p != args.end(); p++) {
+        result->remove(*p);
     }
     return result;
 }
 
-MALTypePtr nthFunc(std::vector<MALTypePtr> args, EnvPtr env) {
-    checkArgsIsAtLeast("nthFunc", 2, args.size());
-    assertMalType(args[1], MALType::Types::Number);
-    auto index = std::dynamic_pointer_cast<MALNumberType>(args[1])->value;
-    std::shared_ptr<MALSequenceType> astAsSequence;
-    if (!args[0]->tryAsSequence(astAsSequence)) {
-        throw std::runtime_error("Error: First parameter of 'nth' must be a sequence (e.g. list or vector). Found: " + args[0]->to_string(true));
+MALValue getFunc(MALValue map, MALValue key) {
+    if (map.type() == MALType::Types::Nil) {
+        return MALValue::nil();
+    }
+    auto value = NativeParam<Ref<MALHashMapType>>::from(map)->get(key);
+    return value != nullptr ? value : MALValue::nil();
+}
+
+bool containsFunc(Ref<MALHashMapType> map, MALValue key) {
+    return map->contains(key);
+}
+
+MALValue keysFunc(Ref<MALHashMapType> map) {
+    std::vector<MALValue> result;
+    auto entries = map->entries();
+    for (auto p = entries.begin(); p != entries.end(); p++) {
+        result.push_back(p->first);
+    }
+    return MALListTypePtr(new MALListType(std::move(result)));
+}
+
+MALValue valsFunc(Ref<MALHashMapType> map) {
+    std::vector<MALValue> result;
+    auto entries = map->entries();
+    for (auto p = entries.begin(); p != entries.end(); p++) {
+        result.push_back(p->second);
+    }
+    return MALListTypePtr(new MALListType(std::move(result)));
+}
+
+MALValue nthFunc(MALValue sequence, double index) {
+    Ref<MALSequenceType> astAsSequence;
+    if (!sequence.tryAsSequence(astAsSequence)) {
+        throw std::runtime_error("Error: First parameter of 'nth' must be a sequence (e.g. list or vector). Found: " + sequence.to_string(true));
     }
     if (index >= astAsSequence->size() || index < 0) {
         throw std::runtime_error("Error: Index '"+std::to_string((int)index)+"' is not a valid index of sequence '" + astAsSequence->to_string(true) + "'");
@@ -304,151 +353,210 @@ MALTypePtr nthFunc(std::vector<MALTypePtr> args, EnvPtr env) {
     return astAsSequence->getAt(index);
 }
 
-MALTypePtr firstFunc(std::vector<MALTypePtr> args, EnvPtr env) {
-    checkArgsIsAtLeast("firstFunc", 1, args.size());
-    std::shared_ptr<MALSequenceType> astAsSequence;
-    if (args[0]->type() == MALType::Types::Nil) {
-        return MALNilType::Nil;
+MALValue firstFunc(MALValue sequence) {
+    Ref<MALSequenceType> astAsSequence;
+    if (sequence.type() == MALType::Types::Nil) {
+        return MALValue::nil();
     }
-    if (!args[0]->tryAsSequence(astAsSequence)) {
-        throw std::runtime_error("Error: Parameter of 'first' must be a sequence (e.g. list or vector). Found: " + args[0]->to_string(true));
+    if (!sequence.tryAsSequence(astAsSequence)) {
+        throw std::runtime_error("Error: Parameter of 'first' must be a sequence (e.g. list or vector). Found: " + sequence.to_string(true));
     }
     if (astAsSequence->size() <= 0) {
-        return MALNilType::Nil;
+        return MALValue::nil();
     }
     return astAsSequence->getAt(0);
 }
 
-MALTypePtr restFunc(std::vector<MALTypePtr> args, EnvPtr env) {
-    checkArgsIsAtLeast("rest", 1, args.size());
-    std::shared_ptr<MALSequenceType> astAsSequence;
-    MALListTypePtr newList = MALListTypePtr(new MALListType());
-    if (args[0]->type() == MALType::Types::Nil) {
-        return newList;
+MALValue restFunc(MALValue sequence) {
+    Ref<MALSequenceType> astAsSequence;
+    MALListTypePtr astAsList;
+    if (sequence.type() == MALType::Types::Nil) {
+        return MALListTypePtr(new MALListType());
     }
-    if (!args[0]->tryAsSequence(astAsSequence)) {
-        throw std::runtime_error("Error: Parameter of 'rest' must be a sequence (e.g. list or vector). Found: " + args[0]->to_string(true));
+    if (!sequence.tryAsSequence(astAsSequence)) {
+        throw std::runtime_error("Error: Parameter of 'rest' must be a sequence (e.g. list or vector). Found: " + sequence.to_string(true));
     }
-    if (astAsSequence->size() <= 0) {
-        return newList;
-    }
-    for (int i = 1; i < astAsSequence->size(); i++) {
-        newList->push_back(astAsSequence->getAt(i));
+    if (!sequence.tryAsList(astAsList)) {
+        astAsList = MALListTypePtr(new MALListType(astAsSequence->toVector()));
     }
-    return newList;
+    return astAsList->rest();
 }
 
-MALTypePtr throwFunc(std::vector<MALTypePtr> args, EnvPtr env) {
-    checkArgsNumber("throw", 1, args.size());
-    throw MALException(args[0]);
+MALValue throwFunc(MALValue value) {
+    throw MALException(value);
 }
 
-MALTypePtr applyFunc(std::vector<MALTypePtr> args, EnvPtr env) {
-    checkArgsIsAtLeast("apply", 1, args.size());
-    assertMalType(args[0], MALType::Types::Function);
-    MALListTypePtr result(new MALListType());
-    result->values.push_back(args[0]);
-    std::shared_ptr<MALSequenceType> astAsSequence;
-    for (int i = 1; i < args.size(); i++) {
-        if (args[i]->tryAsSequence(astAsSequence)) {
-            for (int j = 0; j < astAsSequence->size(); j++) {
-                result->values.push_back(astAsSequence->getAt(j));
-            }
+MALValue applyFunc(const EnvPtr& env, Ref<MALCallableType> func, NativeArgs args) {
+    std::vector<MALValue> values;
+    values.push_back(func);
+    Ref<MALSequenceType> astAsSequence;
+    for (auto p = args.begin(); p != args.end(); p++) {
+        if (p->tryAsSequence(astAsSequence)) {
+            auto sequenceValues = astAsSequence->toVector();
+            values.insert(values.end(), sequenceValues.begin(), sequenceValues.end());
         }
         else {
-            result->values.push_back(args[i]);
+            values.push_back(*p);
         }
     }
-    return EVAL(result, env);
+    return EVAL(MALListTypePtr(new MALListType(std::move(values))), env);
 }
 
-MALTypePtr mapFunc(std::vector<MALTypePtr> args, EnvPtr env) {
-    checkArgsNumber("map", 2, args.size());
-    assertMalType(args[0], MALType::Types::Function);
-    std::shared_ptr<MALSequenceType> astAsSequence;
-    if (!args[1]->tryAsSequence(astAsSequence)) {
+MALValue mapFunc(const EnvPtr& env, Ref<MALCallableType> func, MALValue sequence) {
+    Ref<MALSequenceType> astAsSequence;
+    if (!sequence.tryAsSequence(astAsSequence)) {
         throw std::runtime_error("ERROR: Second parameter of 'map' must be a sequence.");
     }
-    MALListTypePtr result(new MALListType());
+    std::vector<MALValue> result;
     MALListTypePtr funcCall(new MALListType());
-    funcCall->values.push_back(args[0]);
-    funcCall->values.push_back(args[0]);
-    for (int i = 0; i < astAsSequence->size(); i++) {
-        funcCall->setAt(1, astAsSequence->getAt(i)); //set correct argument to func call
-        result->values.push_back(EVAL(funcCall,env)); //call fun on element at position i
+    funcCall->push_back(func);
+    funcCall->push_back(func);
+    auto elements = astAsSequence->toVector();
+    for (auto p = elements.begin(); p != elements.end(); p++) {
+        funcCall->setAt(1, *p); //set correct argument to func call
+        result.push_back(EVAL(funcCall,env)); //call fun on element at position i
     }
+    return MALListTypePtr(new MALListType(std::move(result)));
+}
+
+bool isNilFunc(MALValue value) {
+    return value.type() == MALType::Types::Nil;
+}
+
+bool isTrueFunc(MALValue value) {
+    return value.type() == MALType::Types::Bool && value.asBool() == true;
+}
+
+bool isFalseFunc(MALValue value) {
+    return value.type() == MALType::Types::Bool && value.asBool() == false;
+}
+
+bool isSymbolFunc(MALValue value) {
+    return value.type() == MALType::Types::Symbol;
+}
+
+double timeMsFunc() {
+    auto now = std::chrono::system_clock::now().time_since_epoch();
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(now).count();
+    return (double)ms;
+}
+
+// Counters of the small object pool, as {:hits n :misses n :retained-bytes n :live-bytes n},
+// and the bytes held by the reader's arena as :arena-bytes.
+MALValue poolStatsFunc() {
+    auto stats = Pool::stats();
+    auto result = Ref<MALHashMapType>(new MALHashMapType());
+    result->set(MalKeywordType::intern("hits"), MALValue::number((double)stats.hits));
+    result->set(MalKeywordType::intern("misses"), MALValue::number((double)stats.misses));
+    result->set(MalKeywordType::intern("retained-bytes"), MALValue::number((double)stats.retainedBytes));
+    result->set(MalKeywordType::intern("live-bytes"), MALValue::number((double)stats.liveBytes));
+    result->set(MalKeywordType::intern("arena-bytes"), MALValue::number((double)ReadArena::retainedBytes()));
+    return result;
+}
+
+// Cycle collector counters and heap size, with pauses in milliseconds.
+MALValue gcStatsFunc() {
+    auto stats = Collector::stats();
+    auto result = Ref<MALHashMapType>(new MALHashMapType());
+    result->set(MalKeywordType::intern("collections"), MALValue::number((double)stats.collections));
+    result->set(MalKeywordType::intern("full-collections"), MALValue::number((double)stats.fullCollections));
+    result->set(MalKeywordType::intern("freed"), MALValue::number((double)stats.freedObjects));
+    result->set(MalKeywordType::intern("tracked"), MALValue::number((double)stats.trackedObjects));
+    result->set(MalKeywordType::intern("heap-bytes"), MALValue::number((double)Pool::stats().liveBytes));
+    result->set(MalKeywordType::intern("last-pause-ms"), MALValue::number(stats.lastPauseMs));
+    result->set(MalKeywordType::intern("max-pause-ms"), MALValue::number(stats.maxPauseMs));
+    result->set(MalKeywordType::intern("total-pause-ms"), MALValue::number(stats.totalPauseMs));
+    return result;
+}
+
+// Environment frames allocated, and tail calls that reused the frame they were
+// made from, as {:created n :reused n}.
+MALValue frameStatsFunc() {
+    auto stats = Env::stats();
+    auto result = Ref<MALHashMapType>(new MALHashMapType());
+    result->set(MalKeywordType::intern("created"), MALValue::number((double)stats.created));
+    result->set(MalKeywordType::intern("reused"), MALValue::number((double)stats.reused));
+    return result;
+}
+
+// Macro calls expanded and quasiquote templates translated by EVAL, and the
+// evaluations that used what an earlier one made instead, as
+// {:expanded n :reused n}.
+MALValue expansionStatsFunc() {
+    auto stats = expansionStats();
+    auto result = Ref<MALHashMapType>(new MALHashMapType());
+    result->set(MalKeywordType::intern("expanded"), MALValue::number((double)stats.expanded));
+    result->set(MalKeywordType::intern("reused"), MALValue::number((double)stats.reused));
     return result;
 }
 
-MALTypePtr isNilFunc(std::vector<MALTypePtr> args, EnvPtr env) {
-    checkArgsNumber("nil?", 1, args.size());
-    return std::shared_ptr<MALBoolType>(new MALBoolType(args[0]->type() == MALType::Types::Nil));
-}
-
-MALTypePtr isTrueFunc(std::vector<MALTypePtr> args, EnvPtr env) {
-    checkArgsNumber("true?", 1, args.size());
-    std::shared_ptr<MALBoolType> astAsBool;
-    bool result = args[0]->tryAsBool(astAsBool) && astAsBool->value == true;
-    return std::shared_ptr<MALBoolType>(new MALBoolType(result));
-}
-
-MALTypePtr isFalseFunc(std::vector<MALTypePtr> args, EnvPtr env) {
-    checkArgsNumber("false?", 1, args.size());
-    std::shared_ptr<MALBoolType> astAsBool;
-    bool result = args[0]->tryAsBool(astAsBool) && astAsBool->value == false;
-    return std::shared_ptr<MALBoolType>(new MALBoolType(result));
-}
-
-MALTypePtr isSymbolFunc(std::vector<MALTypePtr> args, EnvPtr env) {
-    checkArgsNumber("symbol?", 1, args.size());
-    return std::shared_ptr<MALBoolType>(new MALBoolType(args[0]->type() == MALType::Types::Symbol));
-}
-
-std::map<std::string, MALFunctor> ns = {
-    {"+", add},
-    {"-", sub},
-    {"*", mult},
-    {"/", divs},
-    {"prn", prn},
-    {"println", println},
-    {"list", list},
-    {"list?", isList},
-    {"empty?", isEmpty},
-    {"count", count},
-    {"=", eq},
-    {"==", eq},
-    {"<", lt},
-    {"<=", lte},
-    {">", gt},
-    {">=", gte},
-    {"read-string", readString},
-    {"slurp", slurp},
-    {"atom", atom},
-    {"atom?", isAtom},
-    {"deref", deref},
-    {"reset!", resetBang},
-    {"swap!", swapBang},
-    {"eval", evalSpecialForm},
-    {"cons", cons},
-    {"concat", concatList},
-    {"pr-str", pr_str_func},
-    {"str", str},
-    {"vec", vec},
-    {"nth", nthFunc},
-    {"first", firstFunc},
-    {"rest", restFunc},
-    {"throw", throwFunc},
-    {"apply", applyFunc},
-    {"map", mapFunc},
-    {"nil?", isNilFunc},
-    {"true?", isTrueFunc},
-    {"false?", isFalseFunc},
-    {"symbol?", isSymbolFunc},
+// Runs a full collection and returns the number of objects freed.
+double gcFunc() {
+    return (double)Collector::collect(true);
+}
+
+const NativeDefinition ns[] = {
+    defnative("+", add),
+    defnative("-", sub),
+    defnative("*", mult),
+    defnative("/", divs),
+    defnative("prn", prn),
+    defnative("println", println),
+    defnative("list", list),
+    defnative("list?", isList),
+    defnative("empty?", isEmpty),
+    defnative("count", count),
+    defnative("=", eq),
+    defnative("==", eq),
+    defnative("<", lt),
+    defnative("<=", lte),
+    defnative(">", gt),
+    defnative(">=", gte),
+    defnative("read-string", readString),
+    defnative("slurp", slurp),
+    defnative("load-file", loadFile),
+    defnative("atom", atom),
+    defnative("atom?", isAtom),
+    defnative("deref", deref),
+    defnative("reset!", resetBang),
+    defnative("swap!", swapBang),
+    defnative("eval", evalSpecialForm),
+    defnative("cons", cons),
+    defnative("concat", concatList),
+    defnative("pr-str", pr_str_func),
+    defnative("str", str),
+    defnative("vec", vec),
+    defnative("vector", vectorFunc),
+    defnative("conj", conjFunc),
+    defnative("hash-map", hashMapFunc),
+    defnative("map?", isMapFunc),
+    defnative("assoc", assocFunc),
+    defnative("dissoc", dissocFunc),
+    defnative("get", getFunc),
+    defnative("contains?", containsFunc),
+    defnative("keys", keysFunc),
+    defnative("vals", valsFunc),
+    defnative("nth", nthFunc),
+    defnative("first", firstFunc),
+    defnative("rest", restFunc),
+    defnative("throw", throwFunc),
+    defnative("apply", applyFunc),
+    defnative("map", mapFunc),
+    defnative("nil?", isNilFunc),
+    defnative("true?", isTrueFunc),
+    defnative("false?", isFalseFunc),
+    defnative("symbol?", isSymbolFunc),
+    defnative("time-ms", timeMsFunc),
+    defnative("pool-stats", poolStatsFunc),
+    defnative("gc-stats", gcStatsFunc),
+    defnative("gc", gcFunc),
+    defnative("frame-stats", frameStatsFunc),
+    defnative("expansion-stats", expansionStatsFunc),
 };
 
 void addBuiltInOperationsToEnv(EnvPtr env)
 {
-    for (auto p = ns.begin(); p != ns.end(); p++) {
-        env->set(std::shared_ptr<MALSymbolType>(new MALSymbolType(p->first)), std::shared_ptr<MALBuiltinFuncType>(new MALBuiltinFuncType(p->first, p->second)));
+    for (auto p = std::begin(ns); p != std::end(ns); p++) {
+        env->set(MALSymbolType::intern(p->name), Ref<MALBuiltinFuncType>(new MALBuiltinFuncType(p->name, p->target, p->thunk)));
     }
 }
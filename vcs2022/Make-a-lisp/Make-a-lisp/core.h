@@ -1,6 +1,7 @@
 #pragma once
 #include <iostream>
 #include <fstream>
+#include <chrono>
 #include <sstream>
 #include <string>
 #include <unordered_map>
@@ -14,7 +15,13 @@
 #include "assert.h"
 #include "assert.h"
 
-MALTypePtr EVAL(MALTypePtr ast, EnvPtr env);
+MALValue EVAL(MALValue ast, EnvPtr env);
+// Evaluates a top-level form in the global env (env, or the REPL's when
+// nullptr) with the engine picked on the command line.
+MALValue evalTopLevel(MALValue ast, EnvPtr env = nullptr);
 
 void addBuiltInOperationsToEnv(EnvPtr env);
 
+// Reads and evaluates the top-level forms of a stream one at a time, in the global env.
+void evalStream(std::istream& input);
+